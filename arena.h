@@ -0,0 +1,161 @@
+// Arena allocator for large per-image buffers (pixels, indices, partial sums): 64 byte aligned blocks carved from big
+// mappings, optionally backed by huge pages. Arena is reset between images of a batch, so later images reuse memory
+// which is already faulted in instead of getting fresh pages from the kernel.
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGNMENT 64
+#define ARENA_HUGE_PAGE_SIZE (2L * 1024 * 1024)
+#define ARENA_MIN_CHUNK (64L * 1024 * 1024)
+#define ARENA_MAX_CHUNKS 64
+
+// none: normal pages, thp: transparent huge pages requested with madvise, hugetlb: pages from hugetlbfs pool
+// (falls back to thp when pool is empty)
+enum HugePages {
+    HUGE_PAGES_NONE,
+    HUGE_PAGES_THP,
+    HUGE_PAGES_HUGETLB
+};
+
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk chunks[ARENA_MAX_CHUNKS];
+    int num_chunks;
+    int huge_pages;
+    // used pages are given back to kernel on reset, so they are first touched again by next image (for buffers which
+    // are placed on NUMA nodes by first touch)
+    int release_pages;
+    // bytes mapped so far, for reporting
+    size_t mapped;
+} Arena;
+
+static inline int parseHugePages(const char *name){
+    //returns huge pages mode with given name, -1 if there is none
+    if (strcmp(name, "none") == 0)
+        return HUGE_PAGES_NONE;
+    if (strcmp(name, "thp") == 0 || name[0] == '\0')
+        return HUGE_PAGES_THP;
+    if (strcmp(name, "hugetlb") == 0)
+        return HUGE_PAGES_HUGETLB;
+    return -1;
+}
+
+static inline void initArena(Arena *arena, int huge_pages){
+    memset(arena, 0, sizeof(Arena));
+    arena->huge_pages = huge_pages;
+}
+
+static inline char *mapArenaChunk(Arena *arena, size_t size){
+    //maps size bytes (multiple of huge page size) aligned to huge page, NULL on failure
+#ifdef MAP_HUGETLB
+    if (arena->huge_pages == HUGE_PAGES_HUGETLB) {
+        void *chunk = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (chunk != MAP_FAILED)
+            return (char *)chunk;
+        fprintf(stderr, "No huge pages available for %zu bytes (see /proc/sys/vm/nr_hugepages), using transparent huge pages.\n", size);
+        arena->huge_pages = HUGE_PAGES_THP;
+    }
+#endif
+    // map one huge page more and cut unaligned ends off, so transparent huge pages can back whole chunk
+    void *mapping = mmap(NULL, size + ARENA_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+    char *start = (char *)mapping;
+    char *chunk = (char *)(((size_t)start + ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1));
+    if (chunk > start)
+        munmap(start, chunk - start);
+    if (start + ARENA_HUGE_PAGE_SIZE > chunk)
+        munmap(chunk + size, start + ARENA_HUGE_PAGE_SIZE - chunk);
+#ifdef MADV_HUGEPAGE
+    if (arena->huge_pages == HUGE_PAGES_THP)
+        madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+    return chunk;
+}
+
+static inline void *arenaAlloc(Arena *arena, size_t size){
+    //returns 64 byte aligned block which lives until next resetArena, NULL if memory can not be mapped
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (arena->num_chunks > 0) {
+        ArenaChunk *chunk = &arena->chunks[arena->num_chunks - 1];
+        if (chunk->size - chunk->used >= size) {
+            void *block = chunk->base + chunk->used;
+            chunk->used += size;
+            return block;
+        }
+    }
+    if (arena->num_chunks == ARENA_MAX_CHUNKS) {
+        fprintf(stderr, "Arena has no room for %zu bytes.\n", size);
+        return NULL;
+    }
+
+    size_t chunk_size = size > ARENA_MIN_CHUNK ? size : ARENA_MIN_CHUNK;
+    chunk_size = (chunk_size + ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t)(ARENA_HUGE_PAGE_SIZE - 1);
+    char *base = mapArenaChunk(arena, chunk_size);
+    if (base == NULL) {
+        fprintf(stderr, "Can not map %zu bytes for arena.\n", chunk_size);
+        return NULL;
+    }
+    ArenaChunk *chunk = &arena->chunks[arena->num_chunks++];
+    chunk->base = base;
+    chunk->size = chunk_size;
+    chunk->used = size;
+    arena->mapped += chunk_size;
+    return base;
+}
+
+static inline void *arenaCalloc(Arena *arena, size_t size){
+    //reused memory is not zero, so it is cleared
+    void *block = arenaAlloc(arena, size);
+    if (block != NULL)
+        memset(block, 0, size);
+    return block;
+}
+
+static inline void *arenaAllocator(void *context, size_t size){
+    //arenaAlloc in form of image_io allocator
+    return arenaAlloc((Arena *)context, size);
+}
+
+static inline void resetArena(Arena *arena){
+    //frees all blocks at once, if image needed several chunks they are replaced by one big enough for all of them,
+    //so same sized images after it only use memory which is already mapped
+    if (arena->num_chunks > 1) {
+        size_t total = 0;
+        for (int c = 0; c < arena->num_chunks; c++) {
+            total += arena->chunks[c].size;
+            munmap(arena->chunks[c].base, arena->chunks[c].size);
+        }
+        arena->num_chunks = 0;
+        char *base = mapArenaChunk(arena, total);
+        if (base != NULL) {
+            arena->chunks[0].base = base;
+            arena->chunks[0].size = total;
+            arena->num_chunks = 1;
+            arena->mapped += total;
+        }
+    }
+    for (int c = 0; c < arena->num_chunks; c++) {
+        if (arena->release_pages && arena->chunks[c].used > 0)
+            madvise(arena->chunks[c].base, arena->chunks[c].used, MADV_DONTNEED);
+        arena->chunks[c].used = 0;
+    }
+}
+
+static inline void freeArena(Arena *arena){
+    for (int c = 0; c < arena->num_chunks; c++)
+        munmap(arena->chunks[c].base, arena->chunks[c].size);
+    arena->num_chunks = 0;
+}
+
+#endif
@@ -0,0 +1,36 @@
+// Command line helpers shared by all programs: options are "--name=value" or "--name" flags and may appear anywhere,
+// other arguments are positional and counted without options between them
+#ifndef ARGS_H
+#define ARGS_H
+
+#include <stdio.h>
+#include <string.h>
+
+static inline const char *getOption(int argc, char *argv[], const char *name){
+    //returns value of "--name=value" argument, empty string for "--name" flag and NULL if option is not given
+    size_t name_len = strlen(name);
+    for(int i = 1; i < argc; i++){
+        if(strncmp(argv[i], "--", 2) == 0 && strncmp(argv[i] + 2, name, name_len) == 0){
+            if(argv[i][2 + name_len] == '=')
+                return argv[i] + 3 + name_len;
+            if(argv[i][2 + name_len] == '\0')
+                return "";
+        }
+    }
+    return NULL;
+}
+
+static inline const char *getPositionalArg(int argc, char *argv[], int index){
+    //returns index-th argument which is not an option (program name is 0), NULL if there are not enough arguments
+    int position = 0;
+    for(int i = 1; i < argc; i++){
+        if(strncmp(argv[i], "--", 2) == 0)
+            continue;
+        position++;
+        if(position == index)
+            return argv[i];
+    }
+    return NULL;
+}
+
+#endif
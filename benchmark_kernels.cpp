@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstdlib>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "args.h"
+
+// Micro-benchmarks of single stages of one k-means iteration, run on synthetic images so no image files are needed.
+// Every benchmark is run for all combinations of image size, layout and number of clusters, with warmup runs,
+// repetitions and statistics. Usage:
+//   ./benchmark_kernels [--clusters=2,4,...] [--sizes=400x200,...] [--layouts=noise,gradient,flat] [--filter=<part of name>]
+//                       [--warmup=<n>] [--reps=<n>] [--min-time=<ms>] [--json=<file>]
+
+#define MAX_LIST 32
+
+// Results of benchmarked functions are added here, so compiler can not remove the calls
+volatile long benchmark_sink = 0;
+
+typedef struct {
+    int width;
+    int height;
+    int num_pixels;
+    int num_of_clusters;
+    unsigned char *image;
+    unsigned char *image_out;
+    int *centroids;
+    int *closest_centroid_indices;
+    long *centroids_sums;
+    long *centroids_sums_saved;
+} BenchmarkData;
+
+typedef struct {
+    const char *name;
+    void (*run)(BenchmarkData *data);
+} Benchmark;
+
+void initCentroids(int *centroids, int num_of_clusters, unsigned char* imageIn, int imageSize){
+    int counter = 0;
+    //we use interval to select starting centroids from image, spreaded equally across
+    int interval = imageSize / num_of_clusters;
+    for(int i = 0; i < (num_of_clusters * 4); i = i + 4){
+        centroids[i] = imageIn[counter];
+        centroids[i + 1] = imageIn[counter+1];
+        centroids[i + 2] = imageIn[counter+2];
+        centroids[i + 3] = imageIn[counter+3];
+        counter = counter + (interval * 4);
+    }
+}
+
+void applyNewCentroidValue(int centroidIndex, int* centroids, long *centroids_sums){
+
+    // get sum of all colors for this centroid from centroids_sums
+    int blue = centroids_sums[centroidIndex*5];
+    int green = centroids_sums[centroidIndex*5 + 1];
+    int red = centroids_sums[centroidIndex*5 + 2];
+    int alpha = centroids_sums[centroidIndex*5 + 3];
+    int count = centroids_sums[centroidIndex*5 + 4];
+
+    // compute average for all non empty clusters
+    if(count == 0){
+        //printf("Warning! Cluster %d has no points. \n", centroidIndex);
+    }else {
+        centroids[centroidIndex * 4] = blue / count;
+        centroids[centroidIndex * 4 + 1] = green / count;
+        centroids[centroidIndex * 4 + 2] = red / count;
+        centroids[centroidIndex * 4 + 3] = alpha / count;
+    }
+
+    // reset centroids_sums for next iteration
+    for (int i = 0; i < 5; i++)
+        centroids_sums[centroidIndex*5 + i] = 0;
+}
+
+int findClosestCentroid(int *centroids, int num_of_clusters, int blue, int green, int red, int alpha){
+    //we init index and distance to 1st centroid, than compute for the remaining ones
+    int centroidIndex = 0;
+    float minimum_distance = sqrt(pow((float)(centroids[0] - blue), 2.0) + pow((float)(centroids[1] - green), 2.0) + pow((float)(centroids[2] - red), 2.0)
+        + pow((float)(centroids[3] - alpha), 2.0));
+
+    for(int i = 4; i < (num_of_clusters * 4); i = i + 4){
+        float current_distance = sqrt(pow((float)(centroids[i] - blue), 2.0) + pow((float)(centroids[i+1] - green), 2.0) + pow((float)(centroids[i+2] - red), 2.0)
+            + pow((float)(centroids[i+3] - alpha), 2.0));
+        if(current_distance < minimum_distance){
+            centroidIndex = i / 4;
+            minimum_distance = current_distance;
+        }
+    }
+    return centroidIndex;
+}
+
+int findClosestCentroidSquared(int *centroids, int num_of_clusters, int blue, int green, int red, int alpha){
+    //squared distance picks same centroid as distance used by kernels, but without sqrt
+    int centroidIndex = 0;
+    int delta_blue = centroids[0] - blue;
+    int delta_green = centroids[1] - green;
+    int delta_red = centroids[2] - red;
+    int delta_alpha = centroids[3] - alpha;
+    int minimum_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+
+    for(int i = 4; i < (num_of_clusters * 4); i = i + 4){
+        delta_blue = centroids[i] - blue;
+        delta_green = centroids[i+1] - green;
+        delta_red = centroids[i+2] - red;
+        delta_alpha = centroids[i+3] - alpha;
+        int current_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+        if(current_distance < minimum_distance){
+            centroidIndex = i / 4;
+            minimum_distance = current_distance;
+        }
+    }
+    return centroidIndex;
+}
+
+void applyNewColoursToImage(unsigned char* image, int* closest_centroid_indices,  int size, int* centroids){
+    //for each pixel in image assign it new centroid colour
+    for(int i = 0; i < (size); i = i + 4){
+        //find colour centroid for this pixel
+        int closestCentroid = closest_centroid_indices[i/4];
+        //apply centroid colour to this pixel
+        image[i] = centroids[closestCentroid * 4];
+        image[i+1] = centroids[closestCentroid * 4 + 1];
+        image[i+2] = centroids[closestCentroid * 4 + 2];
+        image[i+3] = centroids[closestCentroid * 4 + 3];
+    }
+}
+
+int parseIntList(const char *list, int *values, int max_values){
+    //parses comma separated list of integers, returns number of values
+    int num_values = 0;
+    const char *c = list;
+    while (*c != '\0' && num_values < max_values) {
+        values[num_values++] = atoi(c);
+        c = strchr(c, ',');
+        if (c == NULL)
+            break;
+        c++;
+    }
+    return num_values;
+}
+
+int parseSizeList(const char *list, int *widths, int *heights, int max_values){
+    //parses comma separated list of WIDTHxHEIGHT sizes, returns number of sizes
+    int num_values = 0;
+    const char *c = list;
+    while (*c != '\0' && num_values < max_values) {
+        if (sscanf(c, "%dx%d", &widths[num_values], &heights[num_values]) == 2)
+            num_values++;
+        c = strchr(c, ',');
+        if (c == NULL)
+            break;
+        c++;
+    }
+    return num_values;
+}
+
+unsigned int nextRandom(unsigned int *state){
+    //small LCG, so images are same on every machine and run
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+void generateImage(unsigned char *image, int width, int height, const char *layout){
+    //noise: every pixel random (worst case for branch prediction of closest centroid)
+    //gradient: colours change smoothly over image, neighbouring pixels mostly share centroid
+    //flat: blocks of 64x64 pixels of single random colour
+    unsigned int state = 12345;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char *pixel = image + ((size_t)y * width + x) * 4;
+            if (strcmp(layout, "gradient") == 0) {
+                pixel[0] = x * 255 / (width > 1 ? width - 1 : 1);
+                pixel[1] = y * 255 / (height > 1 ? height - 1 : 1);
+                pixel[2] = (x + y) * 255 / (width + height > 2 ? width + height - 2 : 1);
+            }
+            else if (strcmp(layout, "flat") == 0) {
+                // Colour of block is hash of its position
+                unsigned int block_state = ((x / 64) * 73856093u) ^ ((y / 64) * 19349663u);
+                unsigned int colour = nextRandom(&block_state);
+                pixel[0] = colour & 0xff;
+                pixel[1] = (colour >> 8) & 0xff;
+                pixel[2] = (colour >> 16) & 0xff;
+            }
+            else {
+                unsigned int colour = nextRandom(&state);
+                pixel[0] = colour & 0xff;
+                pixel[1] = (colour >> 8) & 0xff;
+                pixel[2] = (colour >> 16) & 0xff;
+            }
+            pixel[3] = 255;
+        }
+    }
+}
+
+void runFindClosestCentroid(BenchmarkData *data){
+    //assignment only, distance as in sequential and OpenMP programs
+    long sum = 0;
+    for (int point = 0; point < data->num_pixels; point++) {
+        unsigned char *pixel = data->image + point * 4;
+        sum += findClosestCentroid(data->centroids, data->num_of_clusters, pixel[0], pixel[1], pixel[2], pixel[3]);
+    }
+    benchmark_sink += sum;
+}
+
+void runFindClosestCentroidSquared(BenchmarkData *data){
+    //assignment only, squared integer distance as in OpenCL fallback and hybrid programs
+    long sum = 0;
+    for (int point = 0; point < data->num_pixels; point++) {
+        unsigned char *pixel = data->image + point * 4;
+        sum += findClosestCentroidSquared(data->centroids, data->num_of_clusters, pixel[0], pixel[1], pixel[2], pixel[3]);
+    }
+    benchmark_sink += sum;
+}
+
+void runAccumulateSums(BenchmarkData *data){
+    //adding pixels to sums of their centroid, with indices computed before
+    long *centroids_sums = data->centroids_sums;
+    memset(centroids_sums, 0, data->num_of_clusters * 5 * sizeof(long));
+    for (int point = 0; point < data->num_pixels; point++) {
+        unsigned char *pixel = data->image + point * 4;
+        int closest_centroid = data->closest_centroid_indices[point];
+        centroids_sums[closest_centroid*5] += pixel[0];
+        centroids_sums[closest_centroid*5 + 1] += pixel[1];
+        centroids_sums[closest_centroid*5 + 2] += pixel[2];
+        centroids_sums[closest_centroid*5 + 3] += pixel[3];
+        centroids_sums[closest_centroid*5 + 4] += 1;
+    }
+    benchmark_sink += centroids_sums[4];
+}
+
+void runApplyNewCentroidValue(BenchmarkData *data){
+    //update of all centroids, includes restoring sums which update resets
+    memcpy(data->centroids_sums, data->centroids_sums_saved, data->num_of_clusters * 5 * sizeof(long));
+    for (int centroid = 0; centroid < data->num_of_clusters; centroid++)
+        applyNewCentroidValue(centroid, data->centroids, data->centroids_sums);
+    benchmark_sink += data->centroids[0];
+}
+
+void runApplyNewColoursToImage(BenchmarkData *data){
+    //writing centroid colours to output image
+    applyNewColoursToImage(data->image_out, data->closest_centroid_indices, data->num_pixels * 4, data->centroids);
+    benchmark_sink += data->image_out[0];
+}
+
+double getTimeMs(){
+    struct timespec clock_now;
+    clock_gettime(CLOCK_MONOTONIC, &clock_now);
+    return clock_now.tv_sec * 1000.0 + clock_now.tv_nsec / (1000.0*1000.0);
+}
+
+int compareDoubles(const void *a, const void *b){
+    double difference = *(const double *)a - *(const double *)b;
+    return (difference > 0) - (difference < 0);
+}
+
+int main(int argc, char *argv[]){
+
+    Benchmark benchmarks[] = {
+        {"findClosestCentroid", runFindClosestCentroid},
+        {"findClosestCentroidSquared", runFindClosestCentroidSquared},
+        {"accumulateSums", runAccumulateSums},
+        {"applyNewCentroidValue", runApplyNewCentroidValue},
+        {"applyNewColoursToImage", runApplyNewColoursToImage},
+    };
+    int num_benchmarks = sizeof(benchmarks) / sizeof(Benchmark);
+
+    // Parameters, defaults cover clusters used in sbatch sweeps and both test images
+    int clusters[MAX_LIST] = {2, 4, 8, 16, 32, 64, 128, 256, 512, 1024};
+    int num_clusters = 10;
+    int widths[MAX_LIST] = {400, 1600};
+    int heights[MAX_LIST] = {200, 900};
+    int num_sizes = 2;
+    const char *layouts[] = {"noise", "gradient", "flat"};
+    int num_layouts = 3;
+
+    const char *arg = getOption(argc, argv, "clusters");
+    if (arg != NULL)
+        num_clusters = parseIntList(arg, clusters, MAX_LIST);
+    arg = getOption(argc, argv, "sizes");
+    if (arg != NULL)
+        num_sizes = parseSizeList(arg, widths, heights, MAX_LIST);
+    const char *layouts_arg = getOption(argc, argv, "layouts");
+    const char *filter = getOption(argc, argv, "filter");
+    arg = getOption(argc, argv, "warmup");
+    int warmup = arg != NULL ? atoi(arg) : 1;
+    arg = getOption(argc, argv, "reps");
+    int reps = arg != NULL ? atoi(arg) : 5;
+    if (reps < 1)
+        reps = 1;
+    // Every repetition runs the stage enough times to last at least min_time, short stages are otherwise below timer resolution
+    arg = getOption(argc, argv, "min-time");
+    double min_time = arg != NULL ? atof(arg) : 10.0;
+    const char *json_file = getOption(argc, argv, "json");
+
+    FILE *json = NULL;
+    if (json_file != NULL) {
+        json = fopen(json_file, "w");
+        if (!json) {
+            fprintf(stderr, "Can not write %s.\n", json_file);
+            exit(1);
+        }
+        fprintf(json, "{\n  \"context\": {\"warmup\": %d, \"repetitions\": %d, \"min_time_ms\": %.3f},\n  \"benchmarks\": [", warmup, reps, min_time);
+    }
+    int num_results = 0;
+
+    printf("%-58s %10s %10s %10s %10s %10s %10s\n", "benchmark", "iterations", "min_ms", "median_ms", "mean_ms", "stddev_ms", "Mpix/s");
+
+    double *samples = (double *)malloc(reps * sizeof(double));
+    for (int s = 0; s < num_sizes; s++) {
+        BenchmarkData data;
+        data.width = widths[s];
+        data.height = heights[s];
+        data.num_pixels = widths[s] * heights[s];
+        data.image = (unsigned char *)malloc(data.num_pixels * 4 * sizeof(unsigned char));
+        data.image_out = (unsigned char *)malloc(data.num_pixels * 4 * sizeof(unsigned char));
+        data.closest_centroid_indices = (int *)malloc(data.num_pixels * sizeof(int));
+
+        for (int l = 0; l < num_layouts; l++) {
+            if (layouts_arg != NULL && strstr(layouts_arg, layouts[l]) == NULL)
+                continue;
+            generateImage(data.image, data.width, data.height, layouts[l]);
+
+            for (int c = 0; c < num_clusters; c++) {
+                // Same state as after first assignment of k-means: initial centroids, their indices and sums
+                data.num_of_clusters = clusters[c];
+                data.centroids = (int *)malloc(data.num_of_clusters * 4 * sizeof(int));
+                data.centroids_sums = (long *)calloc(data.num_of_clusters * 5, sizeof(long));
+                data.centroids_sums_saved = (long *)calloc(data.num_of_clusters * 5, sizeof(long));
+                initCentroids(data.centroids, data.num_of_clusters, data.image, data.num_pixels);
+                for (int point = 0; point < data.num_pixels; point++) {
+                    unsigned char *pixel = data.image + point * 4;
+                    int closest_centroid = findClosestCentroidSquared(data.centroids, data.num_of_clusters, pixel[0], pixel[1], pixel[2], pixel[3]);
+                    data.closest_centroid_indices[point] = closest_centroid;
+                    for (int channel = 0; channel < 4; channel++)
+                        data.centroids_sums_saved[closest_centroid*5 + channel] += pixel[channel];
+                    data.centroids_sums_saved[closest_centroid*5 + 4] += 1;
+                }
+                int *centroids_saved = (int *)malloc(data.num_of_clusters * 4 * sizeof(int));
+                memcpy(centroids_saved, data.centroids, data.num_of_clusters * 4 * sizeof(int));
+
+                for (int b = 0; b < num_benchmarks; b++) {
+                    char name[256];
+                    snprintf(name, sizeof(name), "%s/%dx%d/%s/k:%d", benchmarks[b].name, data.width, data.height, layouts[l], data.num_of_clusters);
+                    if (filter != NULL && strstr(name, filter) == NULL)
+                        continue;
+
+                    // Warmup, also finds number of iterations per repetition
+                    long iterations = 1;
+                    for (int w = 0; w < warmup; w++) {
+                        memcpy(data.centroids, centroids_saved, data.num_of_clusters * 4 * sizeof(int));
+                        double start = getTimeMs();
+                        for (long i = 0; i < iterations; i++)
+                            benchmarks[b].run(&data);
+                        double time = getTimeMs() - start;
+                        if (time < min_time && iterations < (1L << 30))
+                            iterations = time > 0 ? (long)(iterations * min_time / time) + 1 : iterations * 10;
+                    }
+
+                    for (int r = 0; r < reps; r++) {
+                        memcpy(data.centroids, centroids_saved, data.num_of_clusters * 4 * sizeof(int));
+                        double start = getTimeMs();
+                        for (long i = 0; i < iterations; i++)
+                            benchmarks[b].run(&data);
+                        samples[r] = (getTimeMs() - start) / iterations;
+                    }
+
+                    // Statistics of time of one run
+                    double mean = 0, stddev = 0;
+                    for (int r = 0; r < reps; r++)
+                        mean += samples[r];
+                    mean /= reps;
+                    for (int r = 0; r < reps; r++)
+                        stddev += (samples[r] - mean) * (samples[r] - mean);
+                    stddev = reps > 1 ? sqrt(stddev / (reps - 1)) : 0;
+                    qsort(samples, reps, sizeof(double), compareDoubles);
+                    double median = reps % 2 ? samples[reps / 2] : (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+                    double mpixels = median > 0 ? data.num_pixels / (median * 1000.0) : 0;
+
+                    printf("%-58s %10ld %10.4f %10.4f %10.4f %10.4f %10.1f\n", name, iterations, samples[0], median, mean, stddev, mpixels);
+                    if (json != NULL) {
+                        fprintf(json, "%s\n    {\"name\": \"%s\", \"stage\": \"%s\", \"width\": %d, \"height\": %d, \"layout\": \"%s\", \"clusters\": %d, "
+                                "\"iterations\": %ld, \"repetitions\": %d, \"min_ms\": %.6f, \"median_ms\": %.6f, \"mean_ms\": %.6f, \"stddev_ms\": %.6f, "
+                                "\"mpixels_per_s\": %.3f}", num_results > 0 ? "," : "", name, benchmarks[b].name, data.width, data.height, layouts[l],
+                                data.num_of_clusters, iterations, reps, samples[0], median, mean, stddev, mpixels);
+                    }
+                    num_results++;
+                    fflush(stdout);
+                }
+
+                free(centroids_saved);
+                free(data.centroids);
+                free(data.centroids_sums);
+                free(data.centroids_sums_saved);
+            }
+        }
+
+        free(data.image);
+        free(data.image_out);
+        free(data.closest_centroid_indices);
+    }
+    free(samples);
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+}
@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstdlib>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "args.h"
+
+// Local scaling benchmark driver, runs built programs over backends, threads, clusters and images without SLURM
+// and reports median iteration time, speedup and efficiency. Usage:
+//   ./benchmark_scaling [--backends=parallel_openmp_optimized_v2,...] [--threads=1,2,4,...] [--clusters=2,8,64,...]
+//                       [--images=test_images/sea_400_200.png,...] [--iterations=<n>] [--runs=<n>] [--mode=strong|weak]
+//                       [--baseline=<backend>] [--build-dir=<dir>] [--compare-dir=<dir>] [--csv=<file>] [--json=<file>]
+// Strong scaling runs every image with every number of threads. Weak scaling pairs i-th image with i-th number of threads,
+// so images should grow with threads (for example generated ones). Times are per-iteration times printed by programs,
+// without first iteration of every run. With --compare-dir every configuration is also run with programs from that
+// directory (old build) and change of time is reported.
+
+#define MAX_LIST 32
+#define MAX_SAMPLES 4096
+#define MAX_RESULTS 4096
+
+typedef struct {
+    const char *build;
+    const char *backend;
+    const char *image;
+    long pixels;
+    int clusters;
+    int threads;
+    int num_samples;
+    double median_ms;
+    double min_ms;
+    double speedup;
+    double efficiency;
+    double baseline_speedup;
+    double compare_ratio;
+} Result;
+
+int parseIntList(const char *list, int *values, int max_values){
+    //parses comma separated list of integers, returns number of values
+    int num_values = 0;
+    const char *c = list;
+    while (*c != '\0' && num_values < max_values) {
+        values[num_values++] = atoi(c);
+        c = strchr(c, ',');
+        if (c == NULL)
+            break;
+        c++;
+    }
+    return num_values;
+}
+
+int parseStringList(const char *list, char **values, int max_values){
+    //splits comma separated list to newly allocated strings, returns number of values
+    int num_values = 0;
+    const char *c = list;
+    while (*c != '\0' && num_values < max_values) {
+        const char *end = strchr(c, ',');
+        size_t len = end != NULL ? (size_t)(end - c) : strlen(c);
+        values[num_values] = (char *)malloc(len + 1);
+        memcpy(values[num_values], c, len);
+        values[num_values][len] = '\0';
+        num_values++;
+        if (end == NULL)
+            break;
+        c = end + 1;
+    }
+    return num_values;
+}
+
+long getImagePixels(const char *image){
+    //images are named <name>_<width>_<height>.<format>, returns 0 if size is not in name
+    const char *base = strrchr(image, '/');
+    base = base != NULL ? base + 1 : image;
+    const char *dot = strrchr(base, '.');
+    int width = 0, height = 0;
+    for (const char *c = base; *c != '\0' && (dot == NULL || c < dot); c++) {
+        if (*c == '_' && sscanf(c, "_%d_%d", &width, &height) == 2 && width > 0 && height > 0)
+            return (long)width * height;
+    }
+    return 0;
+}
+
+int compareDoubles(const void *a, const void *b){
+    double difference = *(const double *)a - *(const double *)b;
+    return (difference > 0) - (difference < 0);
+}
+
+int quoteShellArg(char *quoted, size_t size, const char *arg){
+    //writes arg in single quotes so shell passes it unchanged, quote inside it is written as '\''; returns 1 if it does not fit
+    size_t length = 0;
+    quoted[length++] = '\'';
+    for (const char *c = arg; *c != '\0'; c++) {
+        if (length + 6 > size)
+            return 1;
+        if (*c == '\'') {
+            memcpy(quoted + length, "'\\''", 4);
+            length += 4;
+        }
+        else
+            quoted[length++] = *c;
+    }
+    if (length + 2 > size)
+        return 1;
+    quoted[length++] = '\'';
+    quoted[length] = '\0';
+    return 0;
+}
+
+int runProgram(const char *build_dir, const char *backend, const char *image, int clusters, int iterations, int threads,
+               double *samples, int max_samples){
+    //runs program once and collects its per-iteration times, returns number of times or -1 if program failed
+    char quoted_dir[1024], quoted_image[1024], command[4096];
+    if (quoteShellArg(quoted_dir, sizeof(quoted_dir), build_dir) || quoteShellArg(quoted_image, sizeof(quoted_image), image))
+        return -1;
+    snprintf(command, sizeof(command), "OMP_NUM_THREADS=%d %s/%s %s %d %d 2>&1", threads, quoted_dir, backend, quoted_image, clusters, iterations);
+    FILE *pipe = popen(command, "r");
+    if (pipe == NULL)
+        return -1;
+
+    // Lines starting with number are iteration times, everything else (header, tuning, totals) is skipped
+    char line[1024];
+    int num_samples = 0;
+    int iteration = 0;
+    while (fgets(line, sizeof(line), pipe)) {
+        char *end;
+        double time = strtod(line, &end);
+        if (end == line || (*end != '\n' && *end != ' ' && *end != '\0'))
+            continue;
+        // First iteration includes first touch of memory and is not counted
+        if (iteration++ > 0 && num_samples < max_samples)
+            samples[num_samples++] = time;
+    }
+    int status = pclose(pipe);
+    if (status != 0) {
+        fprintf(stderr, "Command failed (%d): %s\n", status, command);
+        return -1;
+    }
+    return num_samples;
+}
+
+int measure(const char *build_dir, const char *backend, const char *image, int clusters, int iterations, int threads, int runs, Result *result){
+    //runs configuration several times and fills median and min iteration time, returns 0 on success
+    static double samples[MAX_SAMPLES];
+    int num_samples = 0;
+    for (int r = 0; r < runs; r++) {
+        int run_samples = runProgram(build_dir, backend, image, clusters, iterations, threads, samples + num_samples, MAX_SAMPLES - num_samples);
+        if (run_samples < 0)
+            return 1;
+        num_samples += run_samples;
+    }
+    if (num_samples == 0) {
+        fprintf(stderr, "No iteration times from %s/%s, at least 2 iterations are needed.\n", build_dir, backend);
+        return 1;
+    }
+    qsort(samples, num_samples, sizeof(double), compareDoubles);
+    result->num_samples = num_samples;
+    result->min_ms = samples[0];
+    result->median_ms = num_samples % 2 ? samples[num_samples / 2] : (samples[num_samples / 2 - 1] + samples[num_samples / 2]) / 2;
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+
+    // Parameters, defaults are small enough to finish in few minutes on a laptop
+    char *backends[MAX_LIST] = {(char *)"parallel_openmp_optimized_v2"};
+    int num_backends = 1;
+    int threads[MAX_LIST] = {1, 2, 4, 8};
+    int num_threads = 4;
+    int clusters[MAX_LIST] = {8, 64};
+    int num_clusters = 2;
+    char *images[MAX_LIST] = {(char *)"test_images/sea_400_200.png", (char *)"test_images/alps_1600_900.png"};
+    int num_images = 2;
+
+    const char *arg = getOption(argc, argv, "backends");
+    if (arg != NULL)
+        num_backends = parseStringList(arg, backends, MAX_LIST);
+    arg = getOption(argc, argv, "threads");
+    if (arg != NULL)
+        num_threads = parseIntList(arg, threads, MAX_LIST);
+    arg = getOption(argc, argv, "clusters");
+    if (arg != NULL)
+        num_clusters = parseIntList(arg, clusters, MAX_LIST);
+    arg = getOption(argc, argv, "images");
+    if (arg != NULL)
+        num_images = parseStringList(arg, images, MAX_LIST);
+    arg = getOption(argc, argv, "iterations");
+    int iterations = arg != NULL ? atoi(arg) : 10;
+    arg = getOption(argc, argv, "runs");
+    int runs = arg != NULL ? atoi(arg) : 3;
+    arg = getOption(argc, argv, "mode");
+    int weak = arg != NULL && strcmp(arg, "weak") == 0;
+    const char *baseline = getOption(argc, argv, "baseline");
+    const char *build_dir = getOption(argc, argv, "build-dir");
+    if (build_dir == NULL || build_dir[0] == '\0')
+        build_dir = ".";
+    const char *compare_dir = getOption(argc, argv, "compare-dir");
+    const char *csv_file = getOption(argc, argv, "csv");
+    const char *json_file = getOption(argc, argv, "json");
+
+    if (weak && num_images != num_threads) {
+        fprintf(stderr, "Weak scaling needs one image per number of threads (%d images, %d thread counts).\n", num_images, num_threads);
+        exit(1);
+    }
+    if (iterations < 2) {
+        fprintf(stderr, "At least 2 iterations are needed, first one is not counted.\n");
+        exit(1);
+    }
+
+    Result *results = (Result *)calloc(MAX_RESULTS, sizeof(Result));
+    int num_results = 0;
+
+    printf("mode:%s iterations:%d runs:%d build:%s%s%s\n", weak ? "weak" : "strong", iterations, runs, build_dir,
+           compare_dir != NULL ? " compare:" : "", compare_dir != NULL ? compare_dir : "");
+
+    for (int b = 0; b < num_backends; b++) {
+        for (int c = 0; c < num_clusters; c++) {
+            // Strong scaling has one series per image, weak scaling one series over all images
+            int num_series = weak ? 1 : num_images;
+            for (int s = 0; s < num_series; s++) {
+                printf("\n%s clusters:%d%s%s\n", backends[b], clusters[c], weak ? "" : " image:", weak ? "" : images[s]);
+                printf("%8s %12s %12s %10s %10s", "threads", "median_ms", "min_ms", "speedup", "efficiency");
+                if (baseline != NULL)
+                    printf(" %10s", "vs_base");
+                if (compare_dir != NULL)
+                    printf(" %10s %8s", "old_ms", "change");
+                printf("\n");
+
+                // Baseline backend runs with one thread on same image (first image of series)
+                double baseline_ms = 0;
+                if (baseline != NULL) {
+                    Result baseline_result;
+                    if (measure(build_dir, baseline, images[s], clusters[c], iterations, 1, runs, &baseline_result) == 0)
+                        baseline_ms = baseline_result.median_ms;
+                }
+
+                Result *first = NULL;
+                for (int t = 0; t < num_threads; t++) {
+                    const char *image = weak ? images[t] : images[s];
+                    Result *result = &results[num_results];
+                    result->build = build_dir;
+                    result->backend = backends[b];
+                    result->image = image;
+                    result->pixels = getImagePixels(image);
+                    result->clusters = clusters[c];
+                    result->threads = threads[t];
+                    if (measure(build_dir, backends[b], image, clusters[c], iterations, threads[t], runs, result) != 0)
+                        continue;
+
+                    // Speedup is relative to first (smallest) number of threads of series, in weak scaling
+                    // time should stay same, so efficiency is just ratio of times
+                    if (first == NULL)
+                        first = result;
+                    double thread_ratio = (double)threads[t] / first->threads;
+                    result->speedup = first->median_ms / result->median_ms;
+                    result->efficiency = weak ? result->speedup : result->speedup / thread_ratio;
+                    if (weak && first->pixels > 0 && result->pixels > 0)
+                        result->speedup *= (double)result->pixels / first->pixels;
+                    result->baseline_speedup = baseline_ms > 0 ? baseline_ms / result->median_ms : 0;
+
+                    printf("%8d %12.4f %12.4f %10.2f %10.2f", threads[t], result->median_ms, result->min_ms, result->speedup, result->efficiency);
+                    if (baseline != NULL)
+                        printf(" %10.2f", result->baseline_speedup);
+                    if (compare_dir != NULL) {
+                        Result old_result;
+                        if (measure(compare_dir, backends[b], image, clusters[c], iterations, threads[t], runs, &old_result) == 0) {
+                            result->compare_ratio = result->median_ms / old_result.median_ms;
+                            printf(" %10.4f %+7.1f%%", old_result.median_ms, (result->compare_ratio - 1) * 100);
+                        }
+                    }
+                    printf("\n");
+                    fflush(stdout);
+                    if (num_results < MAX_RESULTS - 1)
+                        num_results++;
+                }
+            }
+        }
+    }
+
+    if (csv_file != NULL) {
+        FILE *csv = fopen(csv_file, "w");
+        if (!csv) {
+            fprintf(stderr, "Can not write %s.\n", csv_file);
+        } else {
+            fprintf(csv, "mode,build,backend,image,pixels,clusters,threads,samples,median_ms,min_ms,speedup,efficiency,baseline_speedup,compare_ratio\n");
+            for (int r = 0; r < num_results; r++) {
+                Result *result = &results[r];
+                fprintf(csv, "%s,%s,%s,%s,%ld,%d,%d,%d,%.6f,%.6f,%.4f,%.4f,%.4f,%.4f\n", weak ? "weak" : "strong", result->build, result->backend,
+                        result->image, result->pixels, result->clusters, result->threads, result->num_samples, result->median_ms, result->min_ms,
+                        result->speedup, result->efficiency, result->baseline_speedup, result->compare_ratio);
+            }
+            fclose(csv);
+        }
+    }
+
+    if (json_file != NULL) {
+        FILE *json = fopen(json_file, "w");
+        if (!json) {
+            fprintf(stderr, "Can not write %s.\n", json_file);
+        } else {
+            fprintf(json, "{\n  \"mode\": \"%s\", \"iterations\": %d, \"runs\": %d, \"build\": \"%s\", \"compare\": \"%s\",\n  \"results\": [",
+                    weak ? "weak" : "strong", iterations, runs, build_dir, compare_dir != NULL ? compare_dir : "");
+            for (int r = 0; r < num_results; r++) {
+                Result *result = &results[r];
+                fprintf(json, "%s\n    {\"backend\": \"%s\", \"image\": \"%s\", \"pixels\": %ld, \"clusters\": %d, \"threads\": %d, \"samples\": %d, "
+                        "\"median_ms\": %.6f, \"min_ms\": %.6f, \"speedup\": %.4f, \"efficiency\": %.4f, \"baseline_speedup\": %.4f, \"compare_ratio\": %.4f}",
+                        r > 0 ? "," : "", result->backend, result->image, result->pixels, result->clusters, result->threads, result->num_samples,
+                        result->median_ms, result->min_ms, result->speedup, result->efficiency, result->baseline_speedup, result->compare_ratio);
+            }
+            fprintf(json, "\n  ]\n}\n");
+            fclose(json);
+        }
+    }
+
+    free(results);
+}
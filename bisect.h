@@ -0,0 +1,168 @@
+// Hierarchical (bisecting) initialization of centroids. Starting from one cluster of all pixels, cluster with largest
+// squared error is split in two until there are enough clusters: it is cut at mean of its widest channel (mean split
+// seeding) and the two halves are refined by few Lloyd iterations over its pixels only. Pixels of every cluster are
+// kept as consecutive range of index array, so split passes only over pixels of its cluster: seeding, BISECT_ITERATIONS
+// Lloyd passes, partition and measuring of both halves, so each level of splits costs about BISECT_ITERATIONS + 4
+// passes over image and whole hierarchy about n log k times that instead of n k per iteration. Splits are greedy, so
+// first m clusters of hierarchy are same for any larger k, and splitting can stop at target quality.
+#ifndef BISECT_H
+#define BISECT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <omp.h>
+#include "arena.h"
+
+// Lloyd iterations of every split, and smallest cluster which is split by all threads
+#define BISECT_ITERATIONS 4
+#define BISECT_PARALLEL_POINTS 65536
+
+typedef struct {
+    // pixels of cluster are order[start, end)
+    int start;
+    int end;
+    long sum[4];
+    long sum_squares[4];
+    double sse;
+} BisectCluster;
+
+static inline void measureBisectCluster(unsigned char *image, int *order, BisectCluster *cluster){
+    //sums of channels and of their squares, squared error of cluster around its mean
+    long sum[4] = {0, 0, 0, 0}, squares[4] = {0, 0, 0, 0};
+    #pragma omp parallel for schedule(static) reduction(+:sum[:4], squares[:4]) if(cluster->end - cluster->start > BISECT_PARALLEL_POINTS)
+    for (int i = cluster->start; i < cluster->end; i++) {
+        unsigned char *pixel = image + (long)order[i] * 4;
+        for (int channel = 0; channel < 4; channel++) {
+            sum[channel] += pixel[channel];
+            squares[channel] += pixel[channel] * pixel[channel];
+        }
+    }
+    double count = cluster->end - cluster->start;
+    cluster->sse = 0;
+    for (int channel = 0; channel < 4; channel++) {
+        cluster->sum[channel] = sum[channel];
+        cluster->sum_squares[channel] = squares[channel];
+        cluster->sse += squares[channel] - (double)sum[channel] * sum[channel] / count;
+    }
+}
+
+static inline int splitBisectCluster(unsigned char *image, int *order, BisectCluster *cluster, BisectCluster *second){
+    //splits cluster in two, first half stays in cluster; returns 0 if its pixels can not be separated
+    int start = cluster->start, end = cluster->end;
+    double count = end - start;
+
+    // seeds are means of pixels below and above mean of widest channel, variances follow from sums of cluster
+    int axis = 0;
+    double widest = -1;
+    for (int channel = 0; channel < 4; channel++) {
+        double variance = cluster->sum_squares[channel] / count - (cluster->sum[channel] / count) * (cluster->sum[channel] / count);
+        if (variance > widest) {
+            widest = variance;
+            axis = channel;
+        }
+    }
+    int cut = (int)(cluster->sum[axis] / count);
+    long sums[10] = {0};
+    #pragma omp parallel for schedule(static) reduction(+:sums[:10]) if(end - start > BISECT_PARALLEL_POINTS)
+    for (int i = start; i < end; i++) {
+        unsigned char *pixel = image + (long)order[i] * 4;
+        long *sum = sums + (pixel[axis] > cut) * 5;
+        for (int channel = 0; channel < 4; channel++)
+            sum[channel] += pixel[channel];
+        sum[4]++;
+    }
+
+    int centres[8];
+    for (int iteration = 0; iteration <= BISECT_ITERATIONS; iteration++) {
+        if (sums[4] == 0 || sums[9] == 0)
+            return 0;
+        for (int half = 0; half < 2; half++) {
+            for (int channel = 0; channel < 4; channel++)
+                centres[half * 4 + channel] = sums[half * 5 + channel] / sums[half * 5 + 4];
+        }
+        if (iteration == BISECT_ITERATIONS)
+            break;
+        memset(sums, 0, sizeof(sums));
+        #pragma omp parallel for schedule(static) reduction(+:sums[:10]) if(end - start > BISECT_PARALLEL_POINTS)
+        for (int i = start; i < end; i++) {
+            unsigned char *pixel = image + (long)order[i] * 4;
+            int first = 0, other = 0;
+            for (int channel = 0; channel < 4; channel++) {
+                first += (pixel[channel] - centres[channel]) * (pixel[channel] - centres[channel]);
+                other += (pixel[channel] - centres[4 + channel]) * (pixel[channel] - centres[4 + channel]);
+            }
+            long *sum = sums + (other < first) * 5;
+            for (int channel = 0; channel < 4; channel++)
+                sum[channel] += pixel[channel];
+            sum[4]++;
+        }
+    }
+
+    // pixels nearer to first centre go to front of range
+    int *middle = std::partition(order + start, order + end, [image, &centres](int point) {
+        unsigned char *pixel = image + (long)point * 4;
+        int first = 0, other = 0;
+        for (int channel = 0; channel < 4; channel++) {
+            first += (pixel[channel] - centres[channel]) * (pixel[channel] - centres[channel]);
+            other += (pixel[channel] - centres[4 + channel]) * (pixel[channel] - centres[4 + channel]);
+        }
+        return first <= other;
+    });
+    if (middle == order + start || middle == order + end)
+        return 0;
+    second->start = middle - order;
+    second->end = end;
+    cluster->end = second->start;
+    measureBisectCluster(image, order, cluster);
+    measureBisectCluster(image, order, second);
+    return 1;
+}
+
+static inline int bisectCentroids(int *centroids, int num_of_clusters, unsigned char *image, int num_pixels, double target_psnr,
+                                  double *psnr, Arena *arena){
+    //splits clusters until there are num_of_clusters of them, squared error reaches target PSNR (if it is above 0)
+    //or no cluster can be split; centroids are their means, returns number of clusters
+    int *order = (int*)arenaAlloc(arena, (size_t)num_pixels * sizeof(int));
+    BisectCluster *clusters = (BisectCluster*)arenaAlloc(arena, num_of_clusters * sizeof(BisectCluster));
+    #pragma omp parallel for schedule(static)
+    for (int point = 0; point < num_pixels; point++)
+        order[point] = point;
+    clusters[0].start = 0;
+    clusters[0].end = num_pixels;
+    measureBisectCluster(image, order, &clusters[0]);
+
+    int num_clusters = 1;
+    double sse = clusters[0].sse;
+    while (num_clusters < num_of_clusters) {
+        if (target_psnr > 0 && (sse <= 0 || 10 * log10(255.0 * 255.0 * num_pixels * 4 / sse) >= target_psnr))
+            break;
+        int largest = -1;
+        for (int cluster = 0; cluster < num_clusters; cluster++) {
+            if (clusters[cluster].sse > 0 && (largest < 0 || clusters[cluster].sse > clusters[largest].sse))
+                largest = cluster;
+        }
+        if (largest < 0)
+            break;
+        double before = clusters[largest].sse;
+        if (!splitBisectCluster(image, order, &clusters[largest], &clusters[num_clusters])) {
+            // pixels of cluster are too close to be separated, it is not picked again
+            clusters[largest].sse = 0;
+            continue;
+        }
+        sse += clusters[largest].sse + clusters[num_clusters].sse - before;
+        num_clusters++;
+    }
+
+    for (int cluster = 0; cluster < num_clusters; cluster++) {
+        long count = clusters[cluster].end - clusters[cluster].start;
+        for (int channel = 0; channel < 4; channel++)
+            centroids[cluster * 4 + channel] = clusters[cluster].sum[channel] / count;
+    }
+    *psnr = sse > 0 ? 10 * log10(255.0 * 255.0 * num_pixels * 4 / sse) : 99;
+    return num_clusters;
+}
+
+#endif
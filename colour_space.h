@@ -0,0 +1,142 @@
+// Perceptual colour spaces for clustering. Pixels are converted once on load to OKLab or CIELAB, quantized to bytes in
+// engine layout (L, a, b, alpha in place of B, G, R, A) with same scale on all three axes, so every algorithm works on
+// them unchanged and Euclidean distance follows perceived difference. Only centroids are converted back to BGRA.
+#ifndef COLOUR_SPACE_H
+#define COLOUR_SPACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+// OKLab L is 0 to 1 and a, b are within -0.32 to 0.28, one unit is 255 steps; CIELAB L is 0 to 100 and a, b are within
+// -108 to 99 for sRGB colours, one unit is 1.15 steps (about 0.9 delta E per step) so b still fits in a byte
+#define OKLAB_SCALE 255.0f
+#define LAB_SCALE 1.15f
+#define LAB_OFFSET 128.0f
+
+enum ColourSpace {
+    COLOUR_SPACE_BGRA,
+    COLOUR_SPACE_OKLAB,
+    COLOUR_SPACE_LAB,
+    NUM_COLOUR_SPACES
+};
+
+static const char *colour_space_names[NUM_COLOUR_SPACES] = {"bgra", "oklab", "lab"};
+
+static inline int parseColourSpace(const char *name){
+    //returns colour space with given name, -1 if there is none
+    for (int space = 0; space < NUM_COLOUR_SPACES; space++) {
+        if (strcmp(name, colour_space_names[space]) == 0)
+            return space;
+    }
+    return -1;
+}
+
+static inline float srgbToLinear(float value){
+    //value 0 to 1
+    return value <= 0.04045f ? value / 12.92f : powf((value + 0.055f) / 1.055f, 2.4f);
+}
+
+static inline float linearToSrgb(float value){
+    return value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+}
+
+static inline float fastCbrt(float x){
+    //cube root of x >= 0 from exponent bits divided by 3 and two Newton steps (relative error about 1e-6), without
+    //calls to libm, so loops using it vectorize
+    unsigned int bits;
+    memcpy(&bits, &x, 4);
+    bits = bits / 3 + 709921077u;
+    float y;
+    memcpy(&y, &bits, 4);
+    y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+    y = (2.0f * y + x / (y * y)) * (1.0f / 3.0f);
+    return x > 0.0f ? y : 0.0f;
+}
+
+static inline unsigned char quantizeColour(float value){
+    //rounds to byte, clamped
+    value += 0.5f;
+    return value <= 0.0f ? 0 : value >= 255.0f ? 255 : (unsigned char)value;
+}
+
+static inline void convertToColourSpace(unsigned char *image, unsigned char *out, int num_pixels, int space){
+    //converts pixels in engine layout to quantized colour space, alpha is kept; schedule is static like in other
+    //loops over pixels, so pages of out are placed with threads which use them
+    float linear[256];
+    for (int value = 0; value < 256; value++)
+        linear[value] = srgbToLinear(value / 255.0f);
+
+    #pragma omp parallel for schedule(static)
+    for (int point = 0; point < num_pixels; point++) {
+        unsigned char *pixel = image + (long)point * 4;
+        unsigned char *converted = out + (long)point * 4;
+        float blue = linear[pixel[0]], green = linear[pixel[1]], red = linear[pixel[2]];
+        float lightness, a, b;
+        if (space == COLOUR_SPACE_OKLAB) {
+            float l = fastCbrt(0.4122214708f * red + 0.5363325363f * green + 0.0514459929f * blue);
+            float m = fastCbrt(0.2119034982f * red + 0.6806995451f * green + 0.1073969566f * blue);
+            float s = fastCbrt(0.0883024619f * red + 0.2817188376f * green + 0.6299787005f * blue);
+            lightness = (0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s) * OKLAB_SCALE;
+            a = (1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s) * OKLAB_SCALE + LAB_OFFSET;
+            b = (0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s) * OKLAB_SCALE + LAB_OFFSET;
+        } else {
+            // XYZ relative to D65 white, f is cube root with linear part near black
+            float x = (0.4124564f * red + 0.3575761f * green + 0.1804375f * blue) / 0.95047f;
+            float y = 0.2126729f * red + 0.7151522f * green + 0.0721750f * blue;
+            float z = (0.0193339f * red + 0.1191920f * green + 0.9503041f * blue) / 1.08883f;
+            float fx = x > 0.008856f ? fastCbrt(x) : 7.787037f * x + 4.0f / 29.0f;
+            float fy = y > 0.008856f ? fastCbrt(y) : 7.787037f * y + 4.0f / 29.0f;
+            float fz = z > 0.008856f ? fastCbrt(z) : 7.787037f * z + 4.0f / 29.0f;
+            lightness = (116.0f * fy - 16.0f) * LAB_SCALE;
+            a = 500.0f * (fx - fy) * LAB_SCALE + LAB_OFFSET;
+            b = 200.0f * (fy - fz) * LAB_SCALE + LAB_OFFSET;
+        }
+        converted[0] = quantizeColour(lightness);
+        converted[1] = quantizeColour(a);
+        converted[2] = quantizeColour(b);
+        converted[3] = pixel[3];
+    }
+}
+
+static inline void convertCentroidsToBgra(int *centroids, int num_of_clusters, int space, int *colours){
+    //converts centroids in colour space back to engine layout, colours outside of sRGB are clamped
+    for (int centroid = 0; centroid < num_of_clusters; centroid++) {
+        int *in = centroids + centroid * 4;
+        int *out = colours + centroid * 4;
+        float red, green, blue;
+        if (space == COLOUR_SPACE_OKLAB) {
+            float lightness = in[0] / OKLAB_SCALE, a = (in[1] - LAB_OFFSET) / OKLAB_SCALE, b = (in[2] - LAB_OFFSET) / OKLAB_SCALE;
+            float l = lightness + 0.3963377774f * a + 0.2158037573f * b;
+            float m = lightness - 0.1055613458f * a - 0.0638541728f * b;
+            float s = lightness - 0.0894841775f * a - 1.2914855480f * b;
+            l = l * l * l;
+            m = m * m * m;
+            s = s * s * s;
+            red = 4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s;
+            green = -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s;
+            blue = -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s;
+        } else if (space == COLOUR_SPACE_LAB) {
+            float fy = (in[0] / LAB_SCALE + 16.0f) / 116.0f;
+            float fx = fy + (in[1] - LAB_OFFSET) / LAB_SCALE / 500.0f;
+            float fz = fy - (in[2] - LAB_OFFSET) / LAB_SCALE / 200.0f;
+            float x = 0.95047f * (fx > 6.0f / 29.0f ? fx * fx * fx : (fx - 4.0f / 29.0f) / 7.787037f);
+            float y = fy > 6.0f / 29.0f ? fy * fy * fy : (fy - 4.0f / 29.0f) / 7.787037f;
+            float z = 1.08883f * (fz > 6.0f / 29.0f ? fz * fz * fz : (fz - 4.0f / 29.0f) / 7.787037f);
+            red = 3.2404542f * x - 1.5371385f * y - 0.4985314f * z;
+            green = -0.9692660f * x + 1.8760108f * y + 0.0415560f * z;
+            blue = 0.0556434f * x - 0.2040259f * y + 1.0572252f * z;
+        } else {
+            memcpy(out, in, 4 * sizeof(int));
+            continue;
+        }
+        out[0] = quantizeColour(linearToSrgb(blue < 0 ? 0 : blue) * 255.0f);
+        out[1] = quantizeColour(linearToSrgb(green < 0 ? 0 : green) * 255.0f);
+        out[2] = quantizeColour(linearToSrgb(red < 0 ? 0 : red) * 255.0f);
+        out[3] = in[3];
+    }
+}
+
+#endif
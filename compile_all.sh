@@ -2,5 +2,12 @@
 
 g++ sequential.cpp -O2 -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -o sequential
 g++ sequential_optimized.cpp -O2 -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -o sequential_optimized
-g++ parallel_opencl.cpp -O2 -I/usr/include/cuda -L/usr/lib64 -l:"libOpenCL.so.1" -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -o parallel_opencl
-g++ parallel_openmp.cpp -O2 -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -fopenmp -o parallel_openmp
\ No newline at end of file
+g++ parallel_opencl.cpp -O2 -I/usr/include/cuda -L/usr/lib64 -l:"libOpenCL.so.1" -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -fopenmp -o parallel_opencl
+g++ parallel_openmp.cpp -O2 -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -fopenmp -o parallel_openmp
+g++ parallel_openmp_optimized_v2.cpp -O2 -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -lz -fopenmp -o parallel_openmp_optimized_v2
+g++ parallel_hybrid.cpp -O2 -I/usr/include/cuda -L/usr/lib64 -l:"libOpenCL.so.1" -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -fopenmp -o parallel_hybrid
+g++ parallel_opencl_multi.cpp -O2 -I/usr/include/cuda -L/usr/lib64 -l:"libOpenCL.so.1" -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -fopenmp -o parallel_opencl_multi
+g++ benchmark_kernels.cpp -O2 -o benchmark_kernels
+g++ benchmark_scaling.cpp -O2 -o benchmark_scaling
+g++ generate_image.cpp -O2 -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -fopenmp -o generate_image
+g++ kmeans_auto.cpp -O2 -Wl,-rpath,./ -L./ -l:"libfreeimage.so.3" -fopenmp -o kmeans_auto
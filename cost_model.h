@@ -0,0 +1,288 @@
+// Cost model used to pick backend, algorithm and number of threads for given image and number of clusters
+#ifndef COST_MODEL_H
+#define COST_MODEL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define COST_MODEL_FILE "kmeans_cost_model.txt"
+
+enum Algorithm {
+    ALGORITHM_LLOYD,
+    ALGORITHM_PRUNED,
+    ALGORITHM_HISTOGRAM,
+    ALGORITHM_MINIBATCH,
+    ALGORITHM_FILTERING,
+    NUM_ALGORITHMS
+};
+
+// lloyd: every pixel against every centroid
+// pruned: skips centroids which can not be closer than current one (triangle inequality on centroid distances)
+// histogram: clusters distinct colours weighted by their counts, same result as lloyd
+// minibatch: updates centroids from random sample of pixels every iteration, approximate
+// filtering: histogram with k-d tree of colours, whole subtrees go to centroid which is nearest to all of them
+static const char *algorithm_names[NUM_ALGORITHMS] = {"lloyd", "pruned", "histogram", "minibatch", "filtering"};
+
+enum Backend {
+    BACKEND_OPENMP,
+    BACKEND_OPENCL,
+    NUM_BACKENDS
+};
+
+// OpenMP backend is parallel_openmp_optimized_v2 (all algorithms), OpenCL backend is parallel_opencl (lloyd only)
+static const char *backend_names[NUM_BACKENDS] = {"openmp", "opencl"};
+
+typedef struct {
+    // CPU costs on one thread: one distance evaluation, pass over one point (load, store index, add to sums),
+    // building histogram per pixel and per log2 of pixels (sorting), fraction of distances evaluated with pruning
+    double distance_ns;
+    double point_ns;
+    double histogram_ns;
+    double pruned_fraction;
+
+    // Fork/join and reduction of thread sums per thread per parallel region, memory bandwidth shared by all threads
+    double thread_overhead_us;
+    double bandwidth_gbs;
+
+    // Device costs: distance evaluation per pixel and centroid, kernel launches per iteration and host-device transfers
+    double gpu_distance_ns;
+    double gpu_launch_us;
+    double gpu_transfer_gbs;
+} CostModel;
+
+typedef struct {
+    long num_pixels;
+    long distinct_colours;
+    int num_of_clusters;
+    int num_of_iterations;
+    long batch_size;
+} Workload;
+
+typedef struct {
+    int backend;
+    int algorithm;
+    int threads;
+    double predicted_ms;
+} Choice;
+
+static const struct {
+    const char *name;
+    size_t offset;
+} cost_model_fields[] = {
+    {"distance_ns", offsetof(CostModel, distance_ns)},
+    {"point_ns", offsetof(CostModel, point_ns)},
+    {"histogram_ns", offsetof(CostModel, histogram_ns)},
+    {"pruned_fraction", offsetof(CostModel, pruned_fraction)},
+    {"thread_overhead_us", offsetof(CostModel, thread_overhead_us)},
+    {"bandwidth_gbs", offsetof(CostModel, bandwidth_gbs)},
+    {"gpu_distance_ns", offsetof(CostModel, gpu_distance_ns)},
+    {"gpu_launch_us", offsetof(CostModel, gpu_launch_us)},
+    {"gpu_transfer_gbs", offsetof(CostModel, gpu_transfer_gbs)},
+};
+
+#define NUM_COST_MODEL_FIELDS ((int)(sizeof(cost_model_fields) / sizeof(cost_model_fields[0])))
+
+static inline int parseAlgorithm(const char *name){
+    //returns algorithm with given name, -1 if there is none
+    for (int a = 0; a < NUM_ALGORITHMS; a++) {
+        if (strcmp(name, algorithm_names[a]) == 0)
+            return a;
+    }
+    return -1;
+}
+
+static inline void initCostModel(CostModel *model){
+    //defaults measured on one core of AMD EPYC node, calibrate with kmeans_auto --calibrate for other machines
+    model->distance_ns = 0.9;
+    model->point_ns = 2.5;
+    model->histogram_ns = 4.0;
+    model->pruned_fraction = 0.35;
+    model->thread_overhead_us = 4.0;
+    model->bandwidth_gbs = 20.0;
+    model->gpu_distance_ns = 0.01;
+    model->gpu_launch_us = 30.0;
+    model->gpu_transfer_gbs = 6.0;
+}
+
+static inline int readCostModel(const char *file_name, CostModel *model){
+    //file has one "<name> <value>" line per field, missing fields keep their values, returns 1 if file was read
+    FILE *fp = fopen(file_name, "r");
+    if (!fp)
+        return 0;
+    char line[256], name[128];
+    double value;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%127s %lf", name, &value) != 2)
+            continue;
+        for (int f = 0; f < NUM_COST_MODEL_FIELDS; f++) {
+            if (strcmp(name, cost_model_fields[f].name) == 0)
+                *(double *)((char *)model + cost_model_fields[f].offset) = value;
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+static inline int writeCostModel(const char *file_name, CostModel *model){
+    //returns 0 on success
+    FILE *fp = fopen(file_name, "w");
+    if (!fp) {
+        fprintf(stderr, "Can not write cost model %s.\n", file_name);
+        return 1;
+    }
+    for (int f = 0; f < NUM_COST_MODEL_FIELDS; f++)
+        fprintf(fp, "%s %.6f\n", cost_model_fields[f].name, *(double *)((char *)model + cost_model_fields[f].offset));
+    return fclose(fp) != 0;
+}
+
+static inline unsigned int sampleHash(unsigned int seed, unsigned int index){
+    //deterministic random number for index-th sample, so sampling gives same result with any number of threads
+    unsigned int h = seed * 0x9e3779b9u ^ index * 0x85ebca6bu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline int compareColours(const void *a, const void *b){
+    unsigned int colour_a = *(const unsigned int *)a, colour_b = *(const unsigned int *)b;
+    return colour_a < colour_b ? -1 : colour_a > colour_b;
+}
+
+static inline long estimateDistinctColours(unsigned char *image, long num_pixels, int sample_size){
+    //counts colours in random sample and extrapolates with GEE estimator: colours seen once are scaled by
+    //sqrt(pixels / sample), colours seen more than once are assumed to be all there is of them
+    if (num_pixels <= sample_size)
+        sample_size = (int)num_pixels;
+    if (sample_size <= 0)
+        return 0;
+    unsigned int *sample = (unsigned int *)malloc(sample_size * sizeof(unsigned int));
+    for (int s = 0; s < sample_size; s++) {
+        long pixel = num_pixels == sample_size ? s : (long)(((unsigned long)sampleHash(1, s) << 16 ^ sampleHash(2, s)) % num_pixels);
+        memcpy(&sample[s], image + pixel * 4, 4);
+    }
+    qsort(sample, sample_size, sizeof(unsigned int), compareColours);
+
+    long seen_once = 0, seen_more = 0;
+    for (int s = 0; s < sample_size;) {
+        int run = 1;
+        while (s + run < sample_size && sample[s + run] == sample[s])
+            run++;
+        if (run == 1)
+            seen_once++;
+        else
+            seen_more++;
+        s += run;
+    }
+    free(sample);
+    if (num_pixels == sample_size)
+        return seen_once + seen_more;
+    long estimate = (long)(sqrt((double)num_pixels / sample_size) * seen_once) + seen_more;
+    return estimate < num_pixels ? estimate : num_pixels;
+}
+
+static inline double parallelPassMs(CostModel *model, double work_ns, double bytes, int threads){
+    //one parallel pass: work split between threads but not faster than memory allows, plus overhead of threads
+    double compute_ms = work_ns / threads / 1e6;
+    double memory_ms = bytes / (model->bandwidth_gbs * 1e6);
+    return (compute_ms > memory_ms ? compute_ms : memory_ms) + threads * model->thread_overhead_us / 1000.0;
+}
+
+static inline double predictMs(CostModel *model, Workload *work, int backend, int algorithm, int threads){
+    //predicted time of all iterations including preparation which the algorithm needs (histogram, final assignment),
+    //negative if backend does not implement the algorithm
+    double pixels = work->num_pixels;
+    double k = work->num_of_clusters;
+    double iterations = work->num_of_iterations;
+    // pass reads pixel (4 bytes) and writes index (4 bytes)
+    double point_bytes = 8;
+
+    if (backend == BACKEND_OPENCL) {
+        if (algorithm != ALGORITHM_LLOYD)
+            return -1;
+        double transfer_ms = pixels * point_bytes / (model->gpu_transfer_gbs * 1e6);
+        return transfer_ms + iterations * (pixels * k * model->gpu_distance_ns / 1e6 + model->gpu_launch_us / 1000.0);
+    }
+
+    double full_pass_ms = parallelPassMs(model, pixels * (k * model->distance_ns + model->point_ns), pixels * point_bytes, threads);
+    switch (algorithm) {
+    case ALGORITHM_LLOYD:
+        return iterations * full_pass_ms;
+    case ALGORITHM_PRUNED: {
+        double evaluations = 1 + model->pruned_fraction * (k - 1);
+        double pass_ms = parallelPassMs(model, pixels * (evaluations * model->distance_ns + 1.5 * model->point_ns), pixels * point_bytes, threads);
+        return iterations * (pass_ms + k * k * model->distance_ns / 1e6);
+    }
+    case ALGORITHM_HISTOGRAM: {
+        // sorting is done on one thread, mapping pixels to colours and back is parallel
+        double colours = work->distinct_colours;
+        double build_ms = pixels * model->histogram_ns * log2(pixels > 2 ? pixels : 2) / 1e6 +
+                          2 * parallelPassMs(model, pixels * model->point_ns, pixels * point_bytes, threads);
+        double pass_ms = parallelPassMs(model, colours * (k * model->distance_ns + model->point_ns), colours * 12, threads);
+        return build_ms + iterations * pass_ms;
+    }
+    case ALGORITHM_MINIBATCH: {
+        // batch is assigned in parallel and applied on one thread, at the end all pixels are assigned once
+        double batch = work->batch_size < work->num_pixels ? work->batch_size : work->num_pixels;
+        double pass_ms = parallelPassMs(model, batch * (k * model->distance_ns + model->point_ns), batch * point_bytes, threads);
+        return iterations * (pass_ms + batch * model->point_ns / 1e6) + full_pass_ms;
+    }
+    case ALGORITHM_FILTERING: {
+        // histogram plus tree (sorting again), colour is compared with about log2(k) centroids left near it but
+        // filtering them costs few distances per node
+        double colours = work->distinct_colours;
+        double build_ms = pixels * model->histogram_ns * log2(pixels > 2 ? pixels : 2) / 1e6 +
+                          colours * model->histogram_ns * log2(colours > 2 ? colours : 2) / 1e6 +
+                          3 * parallelPassMs(model, pixels * model->point_ns, pixels * point_bytes, threads);
+        double evaluations = 4 * (1 + log2(k > 2 ? k : 2));
+        double pass_ms = parallelPassMs(model, colours * (evaluations * model->distance_ns + model->point_ns), colours * 12, threads);
+        return build_ms + iterations * pass_ms;
+    }
+    }
+    return -1;
+}
+
+static inline void chooseConfiguration(CostModel *model, Workload *work, int only_algorithm, int max_threads, int choose_threads,
+                                       int gpu_available, int allow_approximate, Choice *choice, FILE *log){
+    //tries every backend, algorithm (only given one if only_algorithm is not -1) and (if choose_threads) number of
+    //threads up to max_threads and keeps fastest, prediction of every candidate is written to log when it is not NULL
+    choice->backend = BACKEND_OPENMP;
+    choice->algorithm = only_algorithm >= 0 ? only_algorithm : ALGORITHM_LLOYD;
+    choice->threads = max_threads;
+    choice->predicted_ms = -1;
+    for (int backend = 0; backend < NUM_BACKENDS; backend++) {
+        if (backend == BACKEND_OPENCL && !gpu_available)
+            continue;
+        for (int algorithm = 0; algorithm < NUM_ALGORITHMS; algorithm++) {
+            if ((only_algorithm >= 0 && algorithm != only_algorithm) || (only_algorithm < 0 && algorithm == ALGORITHM_MINIBATCH && !allow_approximate))
+                continue;
+            int best_threads = max_threads;
+            double best_ms = -1;
+            for (int threads = choose_threads ? 1 : max_threads; threads <= max_threads; threads++) {
+                double ms = predictMs(model, work, backend, algorithm, threads);
+                if (ms >= 0 && (best_ms < 0 || ms < best_ms)) {
+                    best_ms = ms;
+                    best_threads = threads;
+                }
+            }
+            if (best_ms < 0)
+                continue;
+            if (log != NULL)
+                fprintf(log, "candidate backend:%s algorithm:%s threads:%d predicted:%.4f\n", backend_names[backend],
+                        algorithm_names[algorithm], best_threads, best_ms);
+            if (choice->predicted_ms < 0 || best_ms < choice->predicted_ms) {
+                choice->backend = backend;
+                choice->algorithm = algorithm;
+                choice->threads = best_threads;
+                choice->predicted_ms = best_ms;
+            }
+        }
+    }
+}
+
+#endif
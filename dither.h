@@ -0,0 +1,285 @@
+// Dithering of remapped image: picks palette colour of every pixel so that average colour of area stays close to
+// original, which hides banding of small palettes. Floyd-Steinberg error diffusion runs as wavefront over rows, ordered
+// (Bayer) and blue noise dithering add threshold of tiled matrix and are independent per pixel. Functions only choose
+// palette indices, image is changed by remap afterwards.
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <omp.h>
+#include "palette.h"
+
+// Pixels of row done between updates of its progress, side of Bayer matrix and of blue noise tile
+#define DITHER_CHUNK 64
+#define BAYER_SIZE 8
+#define BLUE_NOISE_SIZE 64
+// Pixels of initial blue noise pattern (one in ten) and width of Gaussian filter which finds clusters and voids
+#define BLUE_NOISE_DENSITY 10
+#define BLUE_NOISE_SIGMA 1.5f
+// Palette colours compared with all others to estimate distance between neighbouring colours, palettes up to this
+// size are searched by comparing all colours, which is faster than k-d tree for them
+#define PALETTE_SPREAD_SAMPLES 256
+#define DITHER_LINEAR_SEARCH_COLOURS 32
+
+enum DitherMode {
+    DITHER_NONE,
+    DITHER_FLOYD_STEINBERG,
+    DITHER_ORDERED,
+    DITHER_BLUE_NOISE,
+    NUM_DITHER_MODES
+};
+
+static const char *dither_mode_names[NUM_DITHER_MODES] = {"none", "floyd-steinberg", "ordered", "blue-noise"};
+
+static inline int parseDitherMode(const char *name){
+    //returns dither mode with given name, -1 if there is none
+    for (int mode = 0; mode < NUM_DITHER_MODES; mode++) {
+        if (strcmp(name, dither_mode_names[mode]) == 0)
+            return mode;
+    }
+    return -1;
+}
+
+static inline unsigned char clampColour(int value){
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+static inline int findDitherColour(PaletteLookup *lookup, unsigned char *colour){
+    //nearest palette colour, ties go to first colour like with k-d tree
+    int num_colours = lookup->palette->num_colours;
+    if (num_colours > DITHER_LINEAR_SEARCH_COLOURS)
+        return findPaletteColour(lookup, colour);
+    int *colours = lookup->palette->colours;
+    int best = 0, best_distance = INT_MAX;
+    for (int i = 0; i < num_colours; i++) {
+        int distance = 0;
+        for (int channel = 0; channel < 4; channel++)
+            distance += (colour[channel] - colours[i * 4 + channel]) * (colour[channel] - colours[i * 4 + channel]);
+        if (distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+static inline void addBlueNoiseEnergy(float *energy, float *kernel, int point, float sign){
+    //adds (or removes) Gaussian of one pattern pixel to energy of all pixels, tile wraps around
+    int point_x = point % BLUE_NOISE_SIZE, point_y = point / BLUE_NOISE_SIZE;
+    for (int y = 0; y < BLUE_NOISE_SIZE; y++) {
+        float *kernel_row = kernel + ((y - point_y + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE;
+        for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+            energy[y * BLUE_NOISE_SIZE + x] += sign * kernel_row[(x - point_x + BLUE_NOISE_SIZE) % BLUE_NOISE_SIZE];
+    }
+}
+
+static inline int findBlueNoiseExtreme(float *energy, unsigned char *pattern, int in_pattern){
+    //tightest cluster (highest energy of pattern pixels) or, for in_pattern 0, largest void (lowest energy of others)
+    int best = -1;
+    for (int point = 0; point < BLUE_NOISE_SIZE * BLUE_NOISE_SIZE; point++) {
+        if (pattern[point] != in_pattern)
+            continue;
+        if (best < 0 || (in_pattern ? energy[point] > energy[best] : energy[point] < energy[best]))
+            best = point;
+    }
+    return best;
+}
+
+static inline float *buildDitherMatrix(int mode, int *size){
+    //threshold matrix in 0 to 1 of ordered or blue noise mode, NULL for other modes; blue noise is made by
+    //void-and-cluster method (Ulichney): pixels get rank in order in which they fill largest voids of pattern
+    if (mode == DITHER_ORDERED) {
+        // Bayer matrix of size 2n is made of four matrices of size n: 4M, 4M+2, 4M+3, 4M+1
+        *size = BAYER_SIZE;
+        float *thresholds = (float*)malloc(BAYER_SIZE * BAYER_SIZE * sizeof(float));
+        int ranks[BAYER_SIZE * BAYER_SIZE] = {0};
+        for (int n = 1; n < BAYER_SIZE; n *= 2) {
+            for (int y = n - 1; y >= 0; y--) {
+                for (int x = n - 1; x >= 0; x--) {
+                    int rank = ranks[y * BAYER_SIZE + x] * 4;
+                    ranks[y * BAYER_SIZE + x] = rank;
+                    ranks[y * BAYER_SIZE + x + n] = rank + 2;
+                    ranks[(y + n) * BAYER_SIZE + x] = rank + 3;
+                    ranks[(y + n) * BAYER_SIZE + x + n] = rank + 1;
+                }
+            }
+        }
+        for (int i = 0; i < BAYER_SIZE * BAYER_SIZE; i++)
+            thresholds[i] = (ranks[i] + 0.5f) / (BAYER_SIZE * BAYER_SIZE);
+        return thresholds;
+    }
+    if (mode != DITHER_BLUE_NOISE)
+        return NULL;
+
+    const int num_points = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+    *size = BLUE_NOISE_SIZE;
+    float *kernel = (float*)malloc(num_points * sizeof(float));
+    float *energy = (float*)calloc(num_points, sizeof(float));
+    unsigned char *pattern = (unsigned char*)calloc(num_points, 1);
+    int *ranks = (int*)malloc(num_points * sizeof(int));
+    for (int y = 0; y < BLUE_NOISE_SIZE; y++) {
+        for (int x = 0; x < BLUE_NOISE_SIZE; x++) {
+            int dx = x < BLUE_NOISE_SIZE - x ? x : BLUE_NOISE_SIZE - x;
+            int dy = y < BLUE_NOISE_SIZE - y ? y : BLUE_NOISE_SIZE - y;
+            kernel[y * BLUE_NOISE_SIZE + x] = expf(-(dx * dx + dy * dy) / (2.0f * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+        }
+    }
+
+    // initial pattern of pixels picked by fixed pseudo random sequence, then its tightest clusters are moved to
+    // largest voids until it is even
+    int num_ones = 0;
+    for (unsigned int state = 1; num_ones < num_points / BLUE_NOISE_DENSITY; ) {
+        state = state * 1664525u + 1013904223u;
+        int point = (state >> 8) % num_points;
+        if (!pattern[point]) {
+            pattern[point] = 1;
+            addBlueNoiseEnergy(energy, kernel, point, 1);
+            num_ones++;
+        }
+    }
+    while (1) {
+        int cluster = findBlueNoiseExtreme(energy, pattern, 1);
+        pattern[cluster] = 0;
+        addBlueNoiseEnergy(energy, kernel, cluster, -1);
+        int hole = findBlueNoiseExtreme(energy, pattern, 0);
+        pattern[hole] = 1;
+        addBlueNoiseEnergy(energy, kernel, hole, 1);
+        if (hole == cluster)
+            break;
+    }
+
+    // pixels of pattern are ranked by removing tightest clusters, others by filling largest voids
+    unsigned char *initial_pattern = (unsigned char*)malloc(num_points);
+    float *initial_energy = (float*)malloc(num_points * sizeof(float));
+    memcpy(initial_pattern, pattern, num_points);
+    memcpy(initial_energy, energy, num_points * sizeof(float));
+    for (int rank = num_ones - 1; rank >= 0; rank--) {
+        int cluster = findBlueNoiseExtreme(energy, pattern, 1);
+        pattern[cluster] = 0;
+        addBlueNoiseEnergy(energy, kernel, cluster, -1);
+        ranks[cluster] = rank;
+    }
+    for (int rank = num_ones; rank < num_points; rank++) {
+        int hole = findBlueNoiseExtreme(initial_energy, initial_pattern, 0);
+        initial_pattern[hole] = 1;
+        addBlueNoiseEnergy(initial_energy, kernel, hole, 1);
+        ranks[hole] = rank;
+    }
+
+    float *thresholds = (float*)malloc(num_points * sizeof(float));
+    for (int i = 0; i < num_points; i++)
+        thresholds[i] = (ranks[i] + 0.5f) / num_points;
+    free(kernel);
+    free(energy);
+    free(pattern);
+    free(ranks);
+    free(initial_pattern);
+    free(initial_energy);
+    return thresholds;
+}
+
+static inline float getPaletteSpread(Palette *palette){
+    //average distance from palette colour to nearest other colour, estimated on evenly picked sample of colours
+    int samples = palette->num_colours < PALETTE_SPREAD_SAMPLES ? palette->num_colours : PALETTE_SPREAD_SAMPLES;
+    if (palette->num_colours < 2)
+        return 0;
+    double spread = 0;
+    for (int sample = 0; sample < samples; sample++) {
+        int *colour = palette->colours + (long)sample * palette->num_colours / samples * 4;
+        int nearest = INT_MAX;
+        for (int other = 0; other < palette->num_colours; other++) {
+            int *other_colour = palette->colours + other * 4;
+            int distance = 0;
+            for (int channel = 0; channel < 3; channel++)
+                distance += (colour[channel] - other_colour[channel]) * (colour[channel] - other_colour[channel]);
+            if (other_colour != colour && distance < nearest)
+                nearest = distance;
+        }
+        spread += sqrt((double)nearest);
+    }
+    return spread / samples;
+}
+
+static inline void ditherOrdered(unsigned char *image, int width, int height, int pitch, PaletteLookup *lookup,
+                                 float *thresholds, int size, int *indices){
+    //adds threshold of tiled matrix, scaled to distance between neighbouring palette colours, to colour channels of
+    //every pixel before finding nearest palette colour; alpha is kept
+    float spread = getPaletteSpread(lookup->palette);
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        float *threshold_row = thresholds + (y % size) * size;
+        for (int x = 0; x < width; x++) {
+            unsigned char *pixel = image + (long)y * pitch + x * 4;
+            int offset = (int)lrintf((threshold_row[x % size] - 0.5f) * spread);
+            unsigned char colour[4] = {clampColour(pixel[0] + offset), clampColour(pixel[1] + offset), clampColour(pixel[2] + offset), pixel[3]};
+            indices[(long)y * width + x] = findDitherColour(lookup, colour);
+        }
+    }
+}
+
+static inline void ditherFloydSteinberg(unsigned char *image, int width, int height, int pitch, PaletteLookup *lookup, int *indices){
+    //error of colour channels goes 7/16 to right, 3/16, 5/16 and 1/16 to left, same and right pixel of next row.
+    //Rows are dealt to threads in turn and row goes on to chunk when row above has done two pixels past its end, then
+    //errors it reads are complete and no other row writes where it does; errors are integers, so result does not
+    //depend on number of threads. Rows in progress keep errors of their next row in ring of team size + 2 rows.
+    int num_threads = omp_get_max_threads() < height ? omp_get_max_threads() : height;
+    int ring = num_threads + 2;
+    long row_length = (long)(width + 2) * 3;
+    int *errors = (int*)calloc(ring * row_length, sizeof(int));
+    int *progress = (int*)calloc(height, sizeof(int));
+    int *colours = lookup->palette->colours;
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        int team = omp_get_num_threads();
+        for (int y = omp_get_thread_num(); y < height; y += team) {
+            // errors of pixel x are at x * 3, with one pixel of padding on both sides
+            int *error = errors + (y % ring) * row_length + 3;
+            int *next = errors + ((y + 1) % ring) * row_length + 3;
+            memset(next - 3, 0, row_length * sizeof(int));
+            for (int start = 0; start < width; start += DITHER_CHUNK) {
+                int end = start + DITHER_CHUNK < width ? start + DITHER_CHUNK : width;
+                int needed = end + 2 < width ? end + 2 : width;
+                while (y > 0 && __atomic_load_n(&progress[y - 1], __ATOMIC_ACQUIRE) < needed)
+                    sched_yield();
+
+                for (int x = start; x < end; x++) {
+                    unsigned char *pixel = image + (long)y * pitch + x * 4;
+                    unsigned char colour[4];
+                    for (int channel = 0; channel < 3; channel++) {
+                        int diffused = error[x * 3 + channel];
+                        colour[channel] = clampColour(pixel[channel] + (diffused >= 0 ? diffused + 8 : diffused - 8) / 16);
+                    }
+                    colour[3] = pixel[3];
+                    int index = findDitherColour(lookup, colour);
+                    indices[(long)y * width + x] = index;
+                    for (int channel = 0; channel < 3; channel++) {
+                        int difference = colour[channel] - colours[index * 4 + channel];
+                        error[(x + 1) * 3 + channel] += difference * 7;
+                        next[(x - 1) * 3 + channel] += difference * 3;
+                        next[x * 3 + channel] += difference * 5;
+                        next[(x + 1) * 3 + channel] += difference;
+                    }
+                }
+                __atomic_store_n(&progress[y], end, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    free(errors);
+    free(progress);
+}
+
+static inline void ditherImage(int mode, unsigned char *image, int width, int height, int pitch, PaletteLookup *lookup,
+                               float *thresholds, int size, int *indices){
+    //fills palette index of every pixel (indices have width per row) with given dither mode
+    if (mode == DITHER_FLOYD_STEINBERG)
+        ditherFloydSteinberg(image, width, height, pitch, lookup, indices);
+    else
+        ditherOrdered(image, width, height, pitch, lookup, thresholds, size, indices);
+}
+
+#endif
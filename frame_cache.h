@@ -0,0 +1,106 @@
+// State kept between frames of image sequence: hash of every tile (range of consecutive pixels) and closest centroid
+// of every pixel from previous frame. Pixels of tiles whose hash did not change keep their centroid in first iteration
+// of next frame, so only changed tiles are assigned again.
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+typedef struct {
+    unsigned long long *tile_hashes;
+    unsigned char *changed_tiles;
+    int *indices;
+    long num_pixels;
+    long tile_size;
+    long num_tiles;
+    int num_of_clusters;
+    // indices and hashes belong to previous frame of same size
+    int valid;
+} FrameCache;
+
+static inline int isFramePattern(const char *pattern){
+    //1 if pattern has exactly one %d conversion (optionally with 0 flag and width) and no other conversions than %%,
+    //so it can be given to printf with frame number
+    int conversions = 0;
+    for (const char *c = pattern; *c != '\0'; c++) {
+        if (*c != '%')
+            continue;
+        c++;
+        if (*c == '%')
+            continue;
+        if (*c == '0')
+            c++;
+        while (*c >= '0' && *c <= '9')
+            c++;
+        if (*c != 'd')
+            return 0;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+static inline unsigned long long hashTile(const unsigned char *pixels, long num_pixels){
+    //64-bit hash of pixels, 4 bytes at a time (FNV-1a step on words with final mix)
+    unsigned long long hash = 14695981039346656037ull ^ (unsigned long long)num_pixels;
+    for (long point = 0; point < num_pixels; point++) {
+        unsigned int pixel;
+        memcpy(&pixel, pixels + point * 4, 4);
+        hash = (hash ^ pixel) * 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline int *prepareFrameCache(FrameCache *cache, long num_pixels, long tile_size, int num_of_clusters){
+    //returns index array for frame with given size, kept from previous frame when it had same size and number of
+    //clusters; otherwise it is reallocated and cache is invalid, returns NULL if allocation fails
+    if (cache->valid && cache->num_pixels == num_pixels && cache->tile_size == tile_size && cache->num_of_clusters == num_of_clusters)
+        return cache->indices;
+    free(cache->tile_hashes);
+    free(cache->changed_tiles);
+    free(cache->indices);
+    memset(cache, 0, sizeof(FrameCache));
+    cache->num_pixels = num_pixels;
+    cache->tile_size = tile_size;
+    cache->num_tiles = (num_pixels + tile_size - 1) / tile_size;
+    cache->num_of_clusters = num_of_clusters;
+    cache->tile_hashes = (unsigned long long*)malloc(cache->num_tiles * sizeof(unsigned long long));
+    cache->changed_tiles = (unsigned char*)malloc(cache->num_tiles);
+    cache->indices = (int*)malloc(num_pixels * sizeof(int));
+    if (cache->tile_hashes == NULL || cache->changed_tiles == NULL || cache->indices == NULL) {
+        fprintf(stderr, "Can not allocate frame cache.\n");
+        return NULL;
+    }
+    return cache->indices;
+}
+
+static inline long updateTileHashes(FrameCache *cache, const unsigned char *pixels){
+    //hashes tiles of new frame, marks those which differ from previous frame and returns their number (all tiles when
+    //cache was invalid); hashing is parallel over tiles
+    long changed = 0;
+    int valid = cache->valid;
+    #pragma omp parallel for schedule(static) reduction(+:changed)
+    for (long tile = 0; tile < cache->num_tiles; tile++) {
+        long start = tile * cache->tile_size;
+        long end = start + cache->tile_size < cache->num_pixels ? start + cache->tile_size : cache->num_pixels;
+        unsigned long long hash = hashTile(pixels + start * 4, end - start);
+        cache->changed_tiles[tile] = !valid || hash != cache->tile_hashes[tile];
+        cache->tile_hashes[tile] = hash;
+        changed += cache->changed_tiles[tile];
+    }
+    return changed;
+}
+
+static inline void freeFrameCache(FrameCache *cache){
+    free(cache->tile_hashes);
+    free(cache->changed_tiles);
+    free(cache->indices);
+    memset(cache, 0, sizeof(FrameCache));
+}
+
+#endif
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstdlib>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include "FreeImage.h"
+#include "image_io.h"
+#include "args.h"
+
+// Generator of deterministic synthetic test images, same arguments give same image on every machine and number of threads.
+// Usage: ./generate_image <output file> <width> <height> [--pattern=gradient|flat|noise|unique] [--seed=<n>]
+//                         [--regions=<n>] [--noise=<0-255>] [--colors=<n>]
+// gradient: smooth colour gradients over whole image
+// flat: about <regions> flat coloured regions (default 16)
+// noise: every pixel random colour
+// unique: every pixel different colour (up to 2^24 pixels), worst case for histogram based methods
+// --noise adds random noise of given amplitude to any pattern, --colors limits image to given number of colours.
+// Format of output is given by its extension (png, jpg, tif, pam, ppm, ...), it is raw image in engine layout (read
+// directly by engine) for .raw or unknown extension.
+// Name images <name>_<width>_<height>.<format> so scaling driver knows their size.
+
+unsigned int hash(unsigned int seed, unsigned int x, unsigned int y, unsigned int salt){
+    //every pixel gets its own random value, so rows can be generated in parallel in any order
+    unsigned int h = seed * 0x9e3779b9u ^ x * 0x85ebca6bu ^ y * 0xc2b2ae35u ^ salt * 0x27d4eb2fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+unsigned char clampColour(int value){
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+void generateGradient(unsigned char *pixel, int x, int y, int width, int height, unsigned int seed){
+    //each channel is a wave with different direction and frequency, picked by seed
+    double fx = (double)x / width;
+    double fy = (double)y / height;
+    for (int channel = 0; channel < 3; channel++) {
+        double angle = (hash(seed, channel, 0, 1) % 360) * M_PI / 180;
+        double frequency = 0.5 + (hash(seed, channel, 0, 2) % 100) / 50.0;
+        double position = fx * cos(angle) + fy * sin(angle);
+        pixel[channel] = clampColour((int)(127.5 + 127.5 * sin(2 * M_PI * frequency * position + channel)));
+    }
+}
+
+void generateFlat(unsigned char *pixel, int x, int y, int cell_size, unsigned int seed){
+    //regions are cells of jittered grid (Voronoi), pixel gets colour of closest cell point among 3x3 neighbouring cells
+    int cell_x = x / cell_size;
+    int cell_y = y / cell_size;
+    long minimum_distance = -1;
+    unsigned int closest_colour = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            int cx = cell_x + dx;
+            int cy = cell_y + dy;
+            if (cx < 0 || cy < 0)
+                continue;
+            long point_x = (long)cx * cell_size + hash(seed, cx, cy, 3) % cell_size;
+            long point_y = (long)cy * cell_size + hash(seed, cx, cy, 4) % cell_size;
+            long distance = (point_x - x) * (point_x - x) + (point_y - y) * (point_y - y);
+            if (minimum_distance < 0 || distance < minimum_distance) {
+                minimum_distance = distance;
+                closest_colour = hash(seed, cx, cy, 5);
+            }
+        }
+    }
+    pixel[0] = closest_colour & 0xff;
+    pixel[1] = (closest_colour >> 8) & 0xff;
+    pixel[2] = (closest_colour >> 16) & 0xff;
+}
+
+void generateUnique(unsigned char *pixel, long index, unsigned int seed){
+    //multiplication with odd number is bijection on 24 bits, so first 2^24 pixels all get different colours
+    unsigned int colour = (unsigned int)((index * 0x9e3779b1L + seed) & 0xffffff) * 0x2545f5u & 0xffffff;
+    pixel[0] = colour & 0xff;
+    pixel[1] = (colour >> 8) & 0xff;
+    pixel[2] = (colour >> 16) & 0xff;
+}
+
+int main(int argc, char *argv[]){
+
+    const char *output_file = getPositionalArg(argc, argv, 1);
+    const char *width_arg = getPositionalArg(argc, argv, 2);
+    const char *height_arg = getPositionalArg(argc, argv, 3);
+    if (height_arg == NULL) {
+        fprintf(stderr, "Usage: %s <output file> <width> <height> [--pattern=gradient|flat|noise|unique] [--seed=<n>] "
+                "[--regions=<n>] [--noise=<0-255>] [--colors=<n>]\n", argv[0]);
+        exit(1);
+    }
+    int width = atoi(width_arg);
+    int height = atoi(height_arg);
+    if (width <= 0 || height <= 0) {
+        fprintf(stderr, "Invalid size %sx%s.\n", width_arg, height_arg);
+        exit(1);
+    }
+
+    const char *pattern = getOption(argc, argv, "pattern");
+    if (pattern == NULL || pattern[0] == '\0')
+        pattern = "gradient";
+    const char *arg = getOption(argc, argv, "seed");
+    unsigned int seed = arg != NULL ? strtoul(arg, NULL, 10) : 1;
+    arg = getOption(argc, argv, "regions");
+    int regions = arg != NULL ? atoi(arg) : 16;
+    arg = getOption(argc, argv, "noise");
+    int noise = arg != NULL ? atoi(arg) : 0;
+    arg = getOption(argc, argv, "colors");
+    int colors = arg != NULL ? atoi(arg) : 0;
+
+    int pattern_id;
+    if (strcmp(pattern, "gradient") == 0)
+        pattern_id = 0;
+    else if (strcmp(pattern, "flat") == 0)
+        pattern_id = 1;
+    else if (strcmp(pattern, "noise") == 0)
+        pattern_id = 2;
+    else if (strcmp(pattern, "unique") == 0)
+        pattern_id = 3;
+    else {
+        fprintf(stderr, "Unknown pattern %s, use gradient, flat, noise or unique.\n", pattern);
+        exit(1);
+    }
+
+    // Cell size of flat regions so that image has about given number of them
+    if (regions < 1)
+        regions = 1;
+    int cell_size = (int)sqrt((double)width * height / regions);
+    if (cell_size < 1)
+        cell_size = 1;
+
+    // Palette for --colors, pixels are snapped to closest palette colour
+    int *palette = NULL;
+    if (colors > 0) {
+        palette = (int *)malloc(colors * 3 * sizeof(int));
+        for (int c = 0; c < colors; c++) {
+            unsigned int colour = hash(seed, c, 0, 6);
+            palette[c * 3] = colour & 0xff;
+            palette[c * 3 + 1] = (colour >> 8) & 0xff;
+            palette[c * 3 + 2] = (colour >> 16) & 0xff;
+        }
+    }
+
+    int pitch = width * 4;
+    unsigned char *image = (unsigned char *)malloc((size_t)pitch * height);
+    if (image == NULL) {
+        fprintf(stderr, "Can not allocate %dx%d image.\n", width, height);
+        exit(1);
+    }
+
+    struct timespec clock_start, clock_end;
+    clock_gettime(CLOCK_MONOTONIC, &clock_start);
+
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char *pixel = image + (size_t)y * pitch + x * 4;
+            if (pattern_id == 0) {
+                generateGradient(pixel, x, y, width, height, seed);
+            } else if (pattern_id == 1) {
+                generateFlat(pixel, x, y, cell_size, seed);
+            } else if (pattern_id == 2) {
+                unsigned int colour = hash(seed, x, y, 7);
+                pixel[0] = colour & 0xff;
+                pixel[1] = (colour >> 8) & 0xff;
+                pixel[2] = (colour >> 16) & 0xff;
+            } else {
+                generateUnique(pixel, (long)y * width + x, seed);
+            }
+
+            if (noise > 0) {
+                unsigned int random = hash(seed, x, y, 8);
+                for (int channel = 0; channel < 3; channel++)
+                    pixel[channel] = clampColour(pixel[channel] + (int)((random >> (channel * 8)) & 0xff) * (2 * noise + 1) / 256 - noise);
+            }
+
+            if (palette != NULL) {
+                int closest = 0;
+                int minimum_distance = -1;
+                for (int c = 0; c < colors; c++) {
+                    int delta_blue = palette[c * 3] - pixel[0];
+                    int delta_green = palette[c * 3 + 1] - pixel[1];
+                    int delta_red = palette[c * 3 + 2] - pixel[2];
+                    int distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red;
+                    if (minimum_distance < 0 || distance < minimum_distance) {
+                        minimum_distance = distance;
+                        closest = c;
+                    }
+                }
+                pixel[0] = palette[closest * 3];
+                pixel[1] = palette[closest * 3 + 1];
+                pixel[2] = palette[closest * 3 + 2];
+            }
+
+            // Generated images are opaque
+            pixel[3] = 255;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &clock_end);
+    long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+    printf("%s %dx%d pattern:%s seed:%u generated in %.4f\n", output_file, width, height, pattern, seed, nanosecs/(1000.0*1000.0));
+
+    // Save image in format of its extension
+    int failed = saveImage(output_file, image, width, height, pitch);
+
+    free(image);
+    free(palette);
+    return failed;
+}
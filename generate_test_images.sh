@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Generates synthetic benchmark images in test_images/ (raw engine format, read without decoding by parallel_openmp_optimized_v2)
+# Same sizes as images used in sbatch scripts plus 100 MP, every pattern is deterministic so results are comparable between machines
+# Arg 1 (optional): pattern (gradient, flat, noise, unique), defaults to gradient
+# Arg 2 (optional): noise added to pattern, defaults to 8 for gradient and to none for other patterns
+
+pattern=${1:-gradient}
+if [ "$pattern" == "gradient" ]; then
+    noise=${2:-8}
+else
+    noise=${2:-0}
+fi
+noise_option=""
+if [ "$noise" != "0" ]; then
+    noise_option="--noise=$noise"
+fi
+sizes=(4000x2667 7777x5016 12000x8334)
+
+for s in ${sizes[@]}
+do
+    width=${s%x*}
+    height=${s#*x}
+    ./generate_image test_images/${pattern}_${width}_${height}.raw $width $height --pattern=$pattern $noise_option
+done
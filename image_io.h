@@ -0,0 +1,351 @@
+// Loading and saving of images in engine layout: 4 bytes per pixel in order B, G, R, A, rows top to bottom
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "FreeImage.h"
+
+// Raw image file is text header "KMRAW <width> <height>\n" followed by width * height * 4 bytes in engine layout,
+// so it can be read straight into memory without decoding
+#define RAW_IMAGE_MAGIC "KMRAW"
+
+// Binary PNM images (P5 grey, P6 RGB, P7 PAM with 1 to 4 channels) with maxval 255 are read directly, rows of each
+// group are read and converted by one thread
+#define PNM_READ_ROWS 64
+
+// Allocator for image data (for example arena of engine), images are allocated with malloc when none is given
+typedef void *(*ImageAllocator)(void *context, size_t size);
+
+static inline long getFileSize(const char *file_name){
+    //returns size of file in bytes, 0 if it can not be opened
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp)
+        return 0;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+static inline int isRawImage(const char *file_name){
+    //checks magic at start of file
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp)
+        return 0;
+    char magic[sizeof(RAW_IMAGE_MAGIC)] = "";
+    size_t read = fread(magic, 1, sizeof(RAW_IMAGE_MAGIC) - 1, fp);
+    fclose(fp);
+    return read == sizeof(RAW_IMAGE_MAGIC) - 1 && strncmp(magic, RAW_IMAGE_MAGIC, sizeof(RAW_IMAGE_MAGIC) - 1) == 0;
+}
+
+static inline unsigned char *readRawImage(const char *file_name, int *width, int *height, int *pitch,
+                                          ImageAllocator allocate = NULL, void *context = NULL){
+    //returns image data (NULL if file can not be read), pitch of raw image is always width * 4
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Open file error: %s.\n", file_name);
+        return NULL;
+    }
+    if (fscanf(fp, RAW_IMAGE_MAGIC " %d %d", width, height) != 2 || fgetc(fp) != '\n' || *width <= 0 || *height <= 0) {
+        fprintf(stderr, "Invalid raw image header: %s.\n", file_name);
+        fclose(fp);
+        return NULL;
+    }
+    *pitch = *width * 4;
+    size_t size = (size_t)*pitch * *height;
+    unsigned char *image = (unsigned char *)(allocate != NULL ? allocate(context, size) : malloc(size));
+    if (image == NULL || fread(image, 1, size, fp) != size) {
+        fprintf(stderr, "Raw image %s is shorter than its size.\n", file_name);
+        if (allocate == NULL)
+            free(image);
+        image = NULL;
+    }
+    fclose(fp);
+    return image;
+}
+
+static inline int writeRawImage(const char *file_name, unsigned char *image, int width, int height, int pitch){
+    //returns 0 on success
+    FILE *fp = fopen(file_name, "wb");
+    if (!fp) {
+        fprintf(stderr, "Can not write %s.\n", file_name);
+        return 1;
+    }
+    fprintf(fp, RAW_IMAGE_MAGIC " %d %d\n", width, height);
+    int failed = 0;
+    for (int y = 0; y < height && !failed; y++)
+        failed = fwrite(image + (size_t)y * pitch, 1, (size_t)width * 4, fp) != (size_t)width * 4;
+    failed |= fclose(fp) != 0;
+    if (failed)
+        fprintf(stderr, "Can not write %s.\n", file_name);
+    return failed;
+}
+
+static inline int isPnmImage(const char *file_name){
+    //checks magic of binary PNM and PAM images
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp)
+        return 0;
+    char magic[3] = "";
+    size_t read = fread(magic, 1, 3, fp);
+    fclose(fp);
+    return read == 3 && magic[0] == 'P' && magic[1] >= '5' && magic[1] <= '7' && (magic[2] == '\n' || magic[2] == ' ' || magic[2] == '\t' || magic[2] == '\r');
+}
+
+static inline int readPnmNumber(FILE *fp){
+    //next number of PNM header, skipping whitespace and comments, -1 if there is none
+    int c = fgetc(fp);
+    while (c == '#' || c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+        if (c == '#')
+            while (c != '\n' && c != EOF)
+                c = fgetc(fp);
+        c = fgetc(fp);
+    }
+    if (c < '0' || c > '9')
+        return -1;
+    int value = 0;
+    while (c >= '0' && c <= '9' && value < 1 << 24) {
+        value = value * 10 + c - '0';
+        c = fgetc(fp);
+    }
+    return value;
+}
+
+static inline unsigned char *readPnmImage(const char *file_name, int *width, int *height, int *pitch,
+                                          ImageAllocator allocate = NULL, void *context = NULL){
+    //returns image in engine layout, NULL if file is not binary PNM or PAM with maxval 255 (without message, so caller
+    //can decode it in other way) or can not be read
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Open file error: %s.\n", file_name);
+        return NULL;
+    }
+    char magic[3] = "";
+    int channels = 0, maxval = 0;
+    *width = *height = 0;
+    if (fread(magic, 1, 2, fp) == 2 && magic[1] == '7') {
+        // PAM header is lines of "<name> <value>" up to ENDHDR, tuple type is given by depth
+        char line[256];
+        while (fgets(line, sizeof(line), fp) != NULL && strncmp(line, "ENDHDR", 6) != 0) {
+            sscanf(line, "WIDTH %d", width);
+            sscanf(line, "HEIGHT %d", height);
+            sscanf(line, "DEPTH %d", &channels);
+            sscanf(line, "MAXVAL %d", &maxval);
+        }
+    } else if (magic[1] == '5' || magic[1] == '6') {
+        *width = readPnmNumber(fp);
+        *height = readPnmNumber(fp);
+        maxval = readPnmNumber(fp);
+        channels = magic[1] == '5' ? 1 : 3;
+    }
+    if (*width <= 0 || *height <= 0 || channels < 1 || channels > 4 || maxval != 255) {
+        fclose(fp);
+        return NULL;
+    }
+    long data_start = ftell(fp);
+    fclose(fp);
+
+    *pitch = *width * 4;
+    size_t size = (size_t)*pitch * *height;
+    unsigned char *image = (unsigned char *)(allocate != NULL ? allocate(context, size) : malloc(size));
+    int fd = open(file_name, O_RDONLY);
+    int failed = image == NULL || fd < 0;
+    long row_bytes = (long)*width * channels;
+    int num_groups = (*height + PNM_READ_ROWS - 1) / PNM_READ_ROWS;
+
+    //every thread reads its groups of rows with pread and converts them, so file is read by all threads and
+    //rows of image are first touched by thread which reads them
+    if (!failed) {
+        #pragma omp parallel reduction(|:failed)
+        {
+            unsigned char *rows = (unsigned char *)malloc(row_bytes * PNM_READ_ROWS);
+            failed |= rows == NULL;
+            #pragma omp for schedule(static)
+            for (int group = 0; group < num_groups; group++) {
+                int row_start = group * PNM_READ_ROWS;
+                int row_end = row_start + PNM_READ_ROWS < *height ? row_start + PNM_READ_ROWS : *height;
+                size_t bytes = (row_end - row_start) * row_bytes;
+                if (failed || pread(fd, rows, bytes, data_start + row_start * row_bytes) != (ssize_t)bytes) {
+                    failed = 1;
+                    continue;
+                }
+                for (int y = row_start; y < row_end; y++) {
+                    unsigned char *value = rows + (y - row_start) * row_bytes;
+                    unsigned char *pixel = image + (long)y * *pitch;
+                    for (int x = 0; x < *width; x++, value += channels, pixel += 4) {
+                        // grey, grey with alpha, RGB or RGB with alpha
+                        pixel[0] = channels >= 3 ? value[2] : value[0];
+                        pixel[1] = channels >= 3 ? value[1] : value[0];
+                        pixel[2] = value[0];
+                        pixel[3] = channels == 2 || channels == 4 ? value[channels - 1] : 255;
+                    }
+                }
+            }
+            free(rows);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    if (failed) {
+        fprintf(stderr, "Can not read PNM image %s.\n", file_name);
+        if (allocate == NULL)
+            free(image);
+        return NULL;
+    }
+    return image;
+}
+
+static inline int writePnmImage(const char *file_name, unsigned char *image, int width, int height, int pitch, int alpha){
+    //writes PAM with alpha or PPM without it, returns 0 on success
+    FILE *fp = fopen(file_name, "wb");
+    if (!fp) {
+        fprintf(stderr, "Can not write %s.\n", file_name);
+        return 1;
+    }
+    int channels = alpha ? 4 : 3;
+    if (alpha)
+        fprintf(fp, "P7\nWIDTH %d\nHEIGHT %d\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n", width, height);
+    else
+        fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    unsigned char *row = (unsigned char *)malloc((size_t)width * channels);
+    int failed = row == NULL;
+    for (int y = 0; y < height && !failed; y++) {
+        unsigned char *pixel = image + (long)y * pitch;
+        for (int x = 0; x < width; x++) {
+            row[x * channels] = pixel[x * 4 + 2];
+            row[x * channels + 1] = pixel[x * 4 + 1];
+            row[x * channels + 2] = pixel[x * 4];
+            if (alpha)
+                row[x * channels + 3] = pixel[x * 4 + 3];
+        }
+        failed = fwrite(row, 1, (size_t)width * channels, fp) != (size_t)width * channels;
+    }
+    free(row);
+    failed |= fclose(fp) != 0;
+    if (failed)
+        fprintf(stderr, "Can not write %s.\n", file_name);
+    return failed;
+}
+
+static inline FREE_IMAGE_FORMAT getImageFormat(const char *file_name){
+    //format from signature of file, or from its extension when signature is not known
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileType(file_name, 0);
+    if (format == FIF_UNKNOWN)
+        format = FreeImage_GetFIFFromFilename(file_name);
+    return format;
+}
+
+static inline FIBITMAP *decodeImage(const char *file_name){
+    //decodes image file of any format FreeImage reads, NULL on failure
+    FREE_IMAGE_FORMAT format = getImageFormat(file_name);
+    if (format == FIF_UNKNOWN || !FreeImage_FIFSupportsReading(format)) {
+        fprintf(stderr, "Unknown format of image %s.\n", file_name);
+        return NULL;
+    }
+    FIBITMAP *imageLoad = FreeImage_Load(format, file_name, 0);
+    if (imageLoad == NULL)
+        fprintf(stderr, "Can not load image %s.\n", file_name);
+    return imageLoad;
+}
+
+static inline unsigned char *convertImage(FIBITMAP *imageLoad, int *width, int *height, int *pitch,
+                                          ImageAllocator allocate = NULL, void *context = NULL){
+    //converts decoded image to engine layout and unloads it
+    //24 and 32 bit images (JPEG, TIFF, most PNG) and 8 bit grey ones are converted straight from their rows
+    int bpp = FreeImage_GetBPP(imageLoad);
+    if (FreeImage_GetImageType(imageLoad) == FIT_BITMAP &&
+        (bpp == 24 || bpp == 32 || (bpp == 8 && FreeImage_GetColorType(imageLoad) == FIC_MINISBLACK && !FreeImage_IsTransparent(imageLoad)))) {
+        *width = FreeImage_GetWidth(imageLoad);
+        *height = FreeImage_GetHeight(imageLoad);
+        *pitch = *width * 4;
+        size_t size = (size_t)*height * *pitch;
+        unsigned char *image = (unsigned char *)(allocate != NULL ? allocate(context, size) : malloc(size));
+        if (image != NULL) {
+            int bytes = bpp / 8;
+            // FreeImage keeps rows bottom up
+            #pragma omp parallel for schedule(static)
+            for (int y = 0; y < *height; y++) {
+                BYTE *value = FreeImage_GetScanLine(imageLoad, *height - 1 - y);
+                unsigned char *pixel = image + (long)y * *pitch;
+                for (int x = 0; x < *width; x++, value += bytes, pixel += 4) {
+                    pixel[0] = bytes == 1 ? value[0] : value[FI_RGBA_BLUE];
+                    pixel[1] = bytes == 1 ? value[0] : value[FI_RGBA_GREEN];
+                    pixel[2] = bytes == 1 ? value[0] : value[FI_RGBA_RED];
+                    pixel[3] = bytes == 4 ? value[FI_RGBA_ALPHA] : 255;
+                }
+            }
+        }
+        FreeImage_Unload(imageLoad);
+        return image;
+    }
+
+    //Convert it to a 32-bit image
+    FIBITMAP *imageLoad32 = FreeImage_ConvertTo32Bits(imageLoad);
+
+    //Get image dimensions
+    *width = FreeImage_GetWidth(imageLoad32);
+    *height = FreeImage_GetHeight(imageLoad32);
+    *pitch = FreeImage_GetPitch(imageLoad32);
+
+    //Prepare room for a raw data copy of the image
+    size_t size = (size_t)*height * *pitch * sizeof(unsigned char);
+    unsigned char *image = (unsigned char *)(allocate != NULL ? allocate(context, size) : malloc(size));
+    if (image == NULL) {
+        FreeImage_Unload(imageLoad32);
+        FreeImage_Unload(imageLoad);
+        return NULL;
+    }
+
+    //Extract raw data from the image
+    FreeImage_ConvertToRawBits(image, imageLoad32, *pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+
+    //Free source image data free
+    FreeImage_Unload(imageLoad32);
+    FreeImage_Unload(imageLoad);
+    return image;
+}
+
+static inline unsigned char *loadImage(const char *file_name, int *width, int *height, int *pitch){
+    //raw and 8 bit PNM images are read directly, others are decoded with FreeImage and converted to 32 bits, NULL on failure
+    if (isRawImage(file_name))
+        return readRawImage(file_name, width, height, pitch);
+    unsigned char *image = isPnmImage(file_name) ? readPnmImage(file_name, width, height, pitch) : NULL;
+    if (image != NULL)
+        return image;
+
+    FIBITMAP *imageLoad = decodeImage(file_name);
+    if (imageLoad == NULL)
+        return NULL;
+    return convertImage(imageLoad, width, height, pitch);
+}
+
+static inline int saveImage(const char *file_name, unsigned char *image, int width, int height, int pitch){
+    //format is given by extension: .pam and .ppm are written directly, other extensions FreeImage can write go
+    //through it (as 24 bits if format has no alpha, like JPEG), anything else is raw image; returns 0 on success
+    const char *extension = strrchr(file_name, '.') != NULL ? strrchr(file_name, '.') : "";
+    if (strcasecmp(extension, ".pam") == 0 || strcasecmp(extension, ".ppm") == 0)
+        return writePnmImage(file_name, image, width, height, pitch, strcasecmp(extension, ".pam") == 0);
+    FREE_IMAGE_FORMAT format = FreeImage_GetFIFFromFilename(file_name);
+    if (format == FIF_UNKNOWN || strcasecmp(extension, ".raw") == 0)
+        return writeRawImage(file_name, image, width, height, pitch);
+
+    FIBITMAP *imageOutBitmap = FreeImage_ConvertFromRawBits(image, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+    if (!FreeImage_FIFSupportsExportBPP(format, 32)) {
+        FIBITMAP *imageOutBitmap24 = FreeImage_ConvertTo24Bits(imageOutBitmap);
+        FreeImage_Unload(imageOutBitmap);
+        imageOutBitmap = imageOutBitmap24;
+    }
+    int failed = imageOutBitmap == NULL || !FreeImage_Save(format, imageOutBitmap, file_name, 0);
+    if (imageOutBitmap != NULL)
+        FreeImage_Unload(imageOutBitmap);
+    if (failed)
+        fprintf(stderr, "Can not write %s.\n", file_name);
+    return failed;
+}
+
+#endif
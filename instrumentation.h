@@ -0,0 +1,341 @@
+// Per-phase timing and counters of one k-means run, written as JSON report
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum Phase {
+    PHASE_DECODE,
+    PHASE_CONVERT,
+    PHASE_INIT,
+    PHASE_ASSIGN,
+    PHASE_REDUCE,
+    PHASE_UPDATE,
+    PHASE_REMAP,
+    PHASE_ENCODE,
+    NUM_PHASES
+};
+
+static const char *phase_names[NUM_PHASES] = {"decode", "convert", "init", "assign", "reduce", "update", "remap", "encode"};
+
+// Hardware counters measured with perf_event_open when enabled, cache misses are last level cache misses on most CPUs
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    NUM_PERF_EVENTS
+};
+
+static const char *perf_event_names[NUM_PERF_EVENTS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+typedef struct {
+    // Time, number of calls and bytes read and written (estimate from sizes of arrays phase goes through) per phase
+    double phase_time_ms[NUM_PHASES];
+    long phase_calls[NUM_PHASES];
+    long phase_bytes[NUM_PHASES];
+
+    // Distance evaluations done in assignment and ones which were avoided against comparing every point of pass with
+    // every centroid (by pruning, filtering, skipping unchanged pixels or pixels outside of minibatch)
+    long distance_evaluations;
+    long distance_evaluations_skipped;
+    // Tile ranges taken from other threads by work stealing schedule
+    long tile_steals;
+
+    // Per iteration wall time, number of pixels which changed centroid and sum of squared errors of pixels to
+    // centroids they were assigned to in that iteration (inertia); iterations_done of last image can be fewer than
+    // num_iterations when it converged
+    int num_iterations;
+    int iterations_done;
+    double *iteration_time_ms;
+    long *reassigned_pixels;
+    double *iteration_sse;
+
+    // Quality of output image against input, measured while remapping (ssim is -1 when it was not computed)
+    long num_values;
+    double output_sse;
+    double output_ssim;
+
+    // Per thread time spent in assignment and number of pixels it processed
+    int num_threads;
+    double *thread_time_ms;
+    long *thread_pixels;
+
+    // Hardware counters per phase and thread (perf_values[(phase * num_threads + thread) * NUM_PERF_EVENTS + event]),
+    // counter file descriptors of every thread and counters of calling thread at start of current phase; only phases
+    // with perf_all_threads set measure every thread (threadPerfStart/threadPerfEnd), others only the calling thread
+    int perf_enabled;
+    int *perf_fds;
+    long *perf_values;
+    long perf_phase_start[NUM_PERF_EVENTS];
+    int perf_all_threads[NUM_PHASES];
+} Instrumentation;
+
+static inline void initInstrumentation(Instrumentation *inst, int num_iterations, int num_threads){
+    memset(inst, 0, sizeof(Instrumentation));
+    inst->num_iterations = num_iterations;
+    inst->iterations_done = num_iterations;
+    inst->iteration_time_ms = (double *)calloc(num_iterations > 0 ? num_iterations : 1, sizeof(double));
+    inst->reassigned_pixels = (long *)calloc(num_iterations > 0 ? num_iterations : 1, sizeof(long));
+    inst->iteration_sse = (double *)calloc(num_iterations > 0 ? num_iterations : 1, sizeof(double));
+    inst->output_ssim = -1;
+    inst->num_threads = num_threads;
+    inst->thread_time_ms = (double *)calloc(num_threads, sizeof(double));
+    inst->thread_pixels = (long *)calloc(num_threads, sizeof(long));
+}
+
+static inline void readPerfCounters(Instrumentation *inst, int thread, long *values){
+    //reads counters of given thread (must be called by that thread), scaled if counters were multiplexed
+    for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+        values[e] = 0;
+#ifdef __linux__
+        int fd = inst->perf_fds[thread * NUM_PERF_EVENTS + e];
+        unsigned long long data[3];
+        if (fd >= 0 && read(fd, data, sizeof(data)) == sizeof(data))
+            values[e] = data[2] > 0 ? (long)((double)data[0] * data[1] / data[2]) : 0;
+#endif
+    }
+}
+
+static inline int enablePerfCounters(Instrumentation *inst){
+    //opens counters in every OpenMP thread (counters follow OS thread, so thread pool has to be kept between regions,
+    //as it is by default), returns number of threads with at least one counter open
+    inst->perf_fds = (int *)malloc(inst->num_threads * NUM_PERF_EVENTS * sizeof(int));
+    inst->perf_values = (long *)calloc((long)NUM_PHASES * inst->num_threads * NUM_PERF_EVENTS, sizeof(long));
+    for (int i = 0; i < inst->num_threads * NUM_PERF_EVENTS; i++)
+        inst->perf_fds[i] = -1;
+
+    int num_opened = 0;
+#ifdef __linux__
+    #pragma omp parallel num_threads(inst->num_threads) reduction(+:num_opened)
+    {
+        int thread = omp_get_thread_num();
+        int opened = 0;
+        for (int e = 0; e < NUM_PERF_EVENTS; e++) {
+            struct perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = e == PERF_CYCLES ? PERF_COUNT_HW_CPU_CYCLES : e == PERF_INSTRUCTIONS ? PERF_COUNT_HW_INSTRUCTIONS :
+                          e == PERF_CACHE_MISSES ? PERF_COUNT_HW_CACHE_MISSES : PERF_COUNT_HW_BRANCH_MISSES;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            // User space only, so it works without privileges (perf_event_paranoid up to 2)
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+            inst->perf_fds[thread * NUM_PERF_EVENTS + e] = fd;
+            if (fd >= 0)
+                opened = 1;
+        }
+        num_opened += opened;
+    }
+#endif
+    if (num_opened == 0)
+        fprintf(stderr, "Hardware counters are not available (check /proc/sys/kernel/perf_event_paranoid).\n");
+    inst->perf_enabled = num_opened > 0;
+    return num_opened;
+}
+
+static inline void threadPerfStart(Instrumentation *inst, int thread, long *start){
+    //start of work of one thread inside parallel phase, thread 0 is calling thread and is measured by phaseStart/phaseEnd
+    if (inst->perf_enabled && thread != 0)
+        readPerfCounters(inst, thread, start);
+}
+
+static inline void threadPerfEnd(Instrumentation *inst, int phase, int thread, long *start){
+    if (thread == 0)
+        inst->perf_all_threads[phase] = 1;
+    if (inst->perf_enabled && thread != 0 && thread < inst->num_threads) {
+        long end[NUM_PERF_EVENTS];
+        readPerfCounters(inst, thread, end);
+        for (int e = 0; e < NUM_PERF_EVENTS; e++)
+            inst->perf_values[((long)phase * inst->num_threads + thread) * NUM_PERF_EVENTS + e] += end[e] - start[e];
+    }
+}
+
+static inline long getPerfTotal(Instrumentation *inst, int phase, int event){
+    long total = 0;
+    for (int t = 0; t < inst->num_threads; t++)
+        total += inst->perf_values[((long)phase * inst->num_threads + t) * NUM_PERF_EVENTS + event];
+    return total;
+}
+
+static inline void freeInstrumentation(Instrumentation *inst){
+#ifdef __linux__
+    for (int i = 0; inst->perf_fds != NULL && i < inst->num_threads * NUM_PERF_EVENTS; i++) {
+        if (inst->perf_fds[i] >= 0)
+            close(inst->perf_fds[i]);
+    }
+#endif
+    free(inst->perf_fds);
+    free(inst->perf_values);
+    free(inst->iteration_time_ms);
+    free(inst->reassigned_pixels);
+    free(inst->iteration_sse);
+    free(inst->thread_time_ms);
+    free(inst->thread_pixels);
+    memset(inst, 0, sizeof(Instrumentation));
+}
+
+static inline double phaseStart(Instrumentation *inst){
+    //returns start time which is passed to phaseEnd, phases are started and ended outside of parallel regions
+    if (inst->perf_enabled)
+        readPerfCounters(inst, 0, inst->perf_phase_start);
+    return omp_get_wtime();
+}
+
+static inline void phaseEnd(Instrumentation *inst, int phase, double start, long bytes){
+    inst->phase_time_ms[phase] += (omp_get_wtime() - start) * 1000.0;
+    inst->phase_calls[phase]++;
+    inst->phase_bytes[phase] += bytes;
+    if (inst->perf_enabled) {
+        long end[NUM_PERF_EVENTS];
+        readPerfCounters(inst, 0, end);
+        for (int e = 0; e < NUM_PERF_EVENTS; e++)
+            inst->perf_values[(long)phase * inst->num_threads * NUM_PERF_EVENTS + e] += end[e] - inst->perf_phase_start[e];
+    }
+}
+
+static inline double getPsnr(double sse, long num_values){
+    //peak signal to noise ratio in dB for 8 bit values, 0 error is reported as 99 dB so it stays valid JSON number
+    if (num_values <= 0)
+        return 0;
+    if (sse <= 0)
+        return 99;
+    return 10 * log10(255.0 * 255.0 * num_values / sse);
+}
+
+static inline void addDistanceEvaluations(Instrumentation *inst, long evaluations, long points, int num_of_clusters){
+    //evaluations done for pass over points (pixels or distinct colours), rest of points * num_of_clusters were avoided
+    inst->distance_evaluations += evaluations;
+    inst->distance_evaluations_skipped += points * num_of_clusters - evaluations;
+}
+
+static inline void addThreadLoad(Instrumentation *inst, int thread, double time_ms, long pixels){
+    //called by every thread for its own entry, so no synchronization is needed
+    if (thread < inst->num_threads) {
+        inst->thread_time_ms[thread] += time_ms;
+        inst->thread_pixels[thread] += pixels;
+    }
+}
+
+static inline double getLoadImbalance(Instrumentation *inst){
+    //slowest thread time divided by average thread time, 1 means perfectly balanced, threads without pixels are not counted
+    double max_time = 0, sum_time = 0;
+    int active_threads = 0;
+    for (int t = 0; t < inst->num_threads; t++) {
+        if (inst->thread_pixels[t] == 0)
+            continue;
+        active_threads++;
+        sum_time += inst->thread_time_ms[t];
+        if (inst->thread_time_ms[t] > max_time)
+            max_time = inst->thread_time_ms[t];
+    }
+    return sum_time > 0 ? max_time * active_threads / sum_time : 1;
+}
+
+static inline void printInstrumentationSummary(Instrumentation *inst, FILE *fp){
+    //one line per phase, for reading without JSON tools
+    for (int p = 0; p < NUM_PHASES; p++) {
+        if (inst->phase_calls[p] > 0)
+            fprintf(fp, "%-8s %12.4f ms %8ld calls %14ld bytes\n", phase_names[p], inst->phase_time_ms[p], inst->phase_calls[p], inst->phase_bytes[p]);
+    }
+    fprintf(fp, "distance evaluations: %ld skipped: %ld load imbalance: %.3f tile steals: %ld\n", inst->distance_evaluations,
+            inst->distance_evaluations_skipped, getLoadImbalance(inst), inst->tile_steals);
+    if (inst->num_values > 0) {
+        fprintf(fp, "output sse: %.0f psnr: %.3f dB", inst->output_sse, getPsnr(inst->output_sse, inst->num_values));
+        if (inst->output_ssim >= 0)
+            fprintf(fp, " ssim: %.4f", inst->output_ssim);
+        fprintf(fp, "\n");
+    }
+    if (inst->perf_enabled) {
+        for (int p = 0; p < NUM_PHASES; p++) {
+            long cycles = getPerfTotal(inst, p, PERF_CYCLES);
+            if (inst->phase_calls[p] == 0 || cycles == 0)
+                continue;
+            fprintf(fp, "%-8s cycles: %ld instructions: %ld (ipc %.2f) cache misses: %ld branch misses: %ld%s\n", phase_names[p], cycles,
+                    getPerfTotal(inst, p, PERF_INSTRUCTIONS), (double)getPerfTotal(inst, p, PERF_INSTRUCTIONS) / cycles,
+                    getPerfTotal(inst, p, PERF_CACHE_MISSES), getPerfTotal(inst, p, PERF_BRANCH_MISSES),
+                    inst->perf_all_threads[p] ? "" : " (thread 0 only)");
+        }
+    }
+}
+
+static inline int writeInstrumentationReport(Instrumentation *inst, const char *file_name, const char *image_name, int width, int height, int num_of_clusters){
+    //returns 0 on success
+    FILE *fp = fopen(file_name, "w");
+    if (!fp) {
+        fprintf(stderr, "Can not write report %s.\n", file_name);
+        return 1;
+    }
+    fprintf(fp, "{\n  \"image\": \"%s\", \"width\": %d, \"height\": %d, \"clusters\": %d, \"iterations\": %d, \"iterations_done\": %d, \"threads\": %d,\n",
+            image_name, width, height, num_of_clusters, inst->num_iterations, inst->iterations_done, inst->num_threads);
+
+    fprintf(fp, "  \"phases\": {");
+    for (int p = 0; p < NUM_PHASES; p++) {
+        fprintf(fp, "%s\n    \"%s\": {\"time_ms\": %.6f, \"calls\": %ld, \"bytes\": %ld}", p > 0 ? "," : "", phase_names[p],
+                inst->phase_time_ms[p], inst->phase_calls[p], inst->phase_bytes[p]);
+    }
+    fprintf(fp, "\n  },\n");
+
+    fprintf(fp, "  \"counters\": {\"distance_evaluations\": %ld, \"distance_evaluations_skipped\": %ld, \"tile_steals\": %ld},\n",
+            inst->distance_evaluations, inst->distance_evaluations_skipped, inst->tile_steals);
+
+    fprintf(fp, "  \"iterations_detail\": [");
+    for (int i = 0; i < inst->iterations_done; i++) {
+        fprintf(fp, "%s\n    {\"iteration\": %d, \"time_ms\": %.6f, \"reassigned_pixels\": %ld, \"sse\": %.0f, \"psnr\": %.6f}", i > 0 ? "," : "", i,
+                inst->iteration_time_ms[i], inst->reassigned_pixels[i], inst->iteration_sse[i], getPsnr(inst->iteration_sse[i], inst->num_values));
+    }
+    fprintf(fp, "\n  ],\n");
+
+    fprintf(fp, "  \"quality\": {\"sse\": %.0f, \"psnr\": %.6f", inst->output_sse, getPsnr(inst->output_sse, inst->num_values));
+    if (inst->output_ssim >= 0)
+        fprintf(fp, ", \"ssim\": %.6f", inst->output_ssim);
+    fprintf(fp, "},\n");
+
+    fprintf(fp, "  \"thread_load\": {\"imbalance\": %.6f, \"threads\": [", getLoadImbalance(inst));
+    for (int t = 0; t < inst->num_threads; t++) {
+        fprintf(fp, "%s\n    {\"thread\": %d, \"assign_ms\": %.6f, \"pixels\": %ld}", t > 0 ? "," : "", t,
+                inst->thread_time_ms[t], inst->thread_pixels[t]);
+    }
+    fprintf(fp, "\n  ]}");
+
+    // Counters per phase, summed over threads and for every thread separately; phases without all_threads are counters
+    // of thread 0 only
+    if (inst->perf_enabled) {
+        fprintf(fp, ",\n  \"perf_counters\": {");
+        int first_phase = 1;
+        for (int p = 0; p < NUM_PHASES; p++) {
+            if (inst->phase_calls[p] == 0)
+                continue;
+            fprintf(fp, "%s\n    \"%s\": {\"all_threads\": %s, \"total\": {", first_phase ? "" : ",", phase_names[p],
+                    inst->perf_all_threads[p] ? "true" : "false");
+            for (int e = 0; e < NUM_PERF_EVENTS; e++)
+                fprintf(fp, "%s\"%s\": %ld", e > 0 ? ", " : "", perf_event_names[e], getPerfTotal(inst, p, e));
+            fprintf(fp, "}, \"threads\": [");
+            for (int t = 0; t < inst->num_threads; t++) {
+                fprintf(fp, "%s{", t > 0 ? ", " : "");
+                for (int e = 0; e < NUM_PERF_EVENTS; e++)
+                    fprintf(fp, "%s\"%s\": %ld", e > 0 ? ", " : "", perf_event_names[e],
+                            inst->perf_values[((long)p * inst->num_threads + t) * NUM_PERF_EVENTS + e]);
+                fprintf(fp, "}");
+            }
+            fprintf(fp, "]}");
+            first_phase = 0;
+        }
+        fprintf(fp, "\n  }");
+    }
+    fprintf(fp, "\n}\n");
+    return fclose(fp) != 0;
+}
+
+#endif
@@ -0,0 +1,232 @@
+// Filtering algorithm (Kanungo et al.) on k-d tree of distinct colours. Every node keeps bounding box and weighted
+// sums of its colours; going down the tree, centroids which are farther than the one nearest to box centre for whole
+// box are dropped, and once one centroid is left all colours of node go to it at once. Pixel is compared with few
+// centroids near it, so cost of assignment grows with log of number of clusters instead of linearly.
+#ifndef KD_FILTER_H
+#define KD_FILTER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#include <omp.h>
+#include "arena.h"
+
+// Most colours in leaf, which are compared with all its remaining centroids, and subtrees per thread which are
+// dealt to threads in every iteration
+#define FILTER_LEAF_SIZE 16
+#define FILTER_TASKS_PER_THREAD 8
+
+typedef struct {
+    unsigned char box_min[4];
+    unsigned char box_max[4];
+    // weighted sums of channels and of their squares, weight of colours in node
+    long sum[4];
+    long sum_squares[4];
+    long weight;
+    // colours of node are [start, end) of tree order, children are -1 for leaf
+    int start;
+    int end;
+    int left;
+    int right;
+} FilterNode;
+
+typedef struct {
+    FilterNode *nodes;
+    int num_nodes;
+    // roots of subtrees which are processed as separate tasks
+    int *tasks;
+    int num_tasks;
+    int depth;
+} FilterTree;
+
+static inline int buildFilterNodes(FilterTree *tree, unsigned char *points, int *weights, int *order, int start, int end, int depth){
+    //builds node of colours order[start, end) split at median of widest channel, returns its index
+    int index = tree->num_nodes++;
+    FilterNode *node = &tree->nodes[index];
+    memset(node, 0, sizeof(FilterNode));
+    memset(node->box_min, 255, 4);
+    node->start = start;
+    node->end = end;
+    node->left = node->right = -1;
+    if (depth > tree->depth)
+        tree->depth = depth;
+    for (int i = start; i < end; i++) {
+        unsigned char *colour = points + (long)order[i] * 4;
+        for (int channel = 0; channel < 4; channel++) {
+            node->box_min[channel] = std::min(node->box_min[channel], colour[channel]);
+            node->box_max[channel] = std::max(node->box_max[channel], colour[channel]);
+            node->sum[channel] += (long)colour[channel] * weights[order[i]];
+            node->sum_squares[channel] += (long)colour[channel] * colour[channel] * weights[order[i]];
+        }
+        node->weight += weights[order[i]];
+    }
+    if (end - start <= FILTER_LEAF_SIZE)
+        return index;
+
+    int axis = 0;
+    for (int channel = 1; channel < 4; channel++) {
+        if (node->box_max[channel] - node->box_min[channel] > node->box_max[axis] - node->box_min[axis])
+            axis = channel;
+    }
+    int middle = (start + end) / 2;
+    std::nth_element(order + start, order + middle, order + end,
+                     [points, axis](int a, int b) { return points[(long)a * 4 + axis] < points[(long)b * 4 + axis]; });
+    int left = buildFilterNodes(tree, points, weights, order, start, middle, depth + 1);
+    int right = buildFilterNodes(tree, points, weights, order, middle, end, depth + 1);
+    tree->nodes[index].left = left;
+    tree->nodes[index].right = right;
+    return index;
+}
+
+static inline void buildFilterTree(FilterTree *tree, unsigned int *colours, int *weights, int num_colours, int *pixel_colours,
+                                   int num_pixels, int num_threads, Arena *arena){
+    //builds tree over distinct colours and reorders colours and weights to tree order, pixel_colours are changed to
+    //match; tree and temporary arrays are allocated from arena
+    memset(tree, 0, sizeof(FilterTree));
+    int *order = (int*)arenaAlloc(arena, num_colours * sizeof(int));
+    int *position = (int*)arenaAlloc(arena, num_colours * sizeof(int));
+    unsigned int *sorted_colours = (unsigned int*)arenaAlloc(arena, num_colours * sizeof(unsigned int));
+    int *sorted_weights = (int*)arenaAlloc(arena, num_colours * sizeof(int));
+    // leaves have at least half of FILTER_LEAF_SIZE colours
+    tree->nodes = (FilterNode*)arenaAlloc(arena, (2 * (num_colours / (FILTER_LEAF_SIZE / 2) + 1)) * sizeof(FilterNode));
+    for (int i = 0; i < num_colours; i++)
+        order[i] = i;
+    buildFilterNodes(tree, (unsigned char*)colours, weights, order, 0, num_colours, 0);
+
+    for (int i = 0; i < num_colours; i++) {
+        sorted_colours[i] = colours[order[i]];
+        sorted_weights[i] = weights[order[i]];
+        position[order[i]] = i;
+    }
+    memcpy(colours, sorted_colours, num_colours * sizeof(unsigned int));
+    memcpy(weights, sorted_weights, num_colours * sizeof(int));
+    #pragma omp parallel for schedule(static)
+    for (int point = 0; point < num_pixels; point++)
+        pixel_colours[point] = position[pixel_colours[point]];
+
+    // tasks are first level of nodes (or leaves above it) which has enough subtrees for all threads
+    int wanted = num_threads * FILTER_TASKS_PER_THREAD;
+    tree->tasks = (int*)arenaAlloc(arena, tree->num_nodes * sizeof(int));
+    int *next = (int*)arenaAlloc(arena, tree->num_nodes * sizeof(int));
+    tree->tasks[tree->num_tasks++] = 0;
+    while (tree->num_tasks < wanted) {
+        int num_next = 0, split = 0;
+        for (int i = 0; i < tree->num_tasks; i++) {
+            FilterNode *node = &tree->nodes[tree->tasks[i]];
+            if (node->left < 0) {
+                next[num_next++] = tree->tasks[i];
+            } else {
+                next[num_next++] = node->left;
+                next[num_next++] = node->right;
+                split = 1;
+            }
+        }
+        memcpy(tree->tasks, next, num_next * sizeof(int));
+        tree->num_tasks = num_next;
+        if (!split)
+            break;
+    }
+}
+
+template <int CHANNELS>
+static inline int getSquaredDistance(const int *a, const int *b){
+    int distance = 0;
+    for (int channel = 0; channel < CHANNELS; channel++)
+        distance += (a[channel] - b[channel]) * (a[channel] - b[channel]);
+    return distance;
+}
+
+template <int CHANNELS>
+void filterNode(FilterTree *tree, int index, unsigned char *points, int *weights, int *point_indices, int *centroids,
+                int *candidates, int num_candidates, long *sums, long *reassigned_pixels, long *sse, long *evaluations){
+    //assigns colours of node to nearest of candidates (sorted by index, lowest index wins ties like in linear search),
+    //candidates of children are written after those of node
+    FilterNode *node = &tree->nodes[index];
+    if (node->left < 0 || num_candidates == 1) {
+        int owner = candidates[0];
+        if (num_candidates == 1) {
+            // whole node goes to one centroid, its error follows from sums: sum of (x - c)^2 = x^2 - 2cx + c^2
+            int *colour = centroids + owner * 4;
+            for (int channel = 0; channel < CHANNELS; channel++)
+                *sse += node->sum_squares[channel] - 2 * colour[channel] * node->sum[channel] + (long)colour[channel] * colour[channel] * node->weight;
+            long *sum = sums + owner * 5;
+            for (int channel = 0; channel < CHANNELS; channel++)
+                sum[channel] += node->sum[channel];
+            sum[4] += node->weight;
+            for (int point = node->start; point < node->end; point++) {
+                if (point_indices[point] != owner) {
+                    *reassigned_pixels += weights[point];
+                    point_indices[point] = owner;
+                }
+            }
+            return;
+        }
+        for (int point = node->start; point < node->end; point++) {
+            unsigned char *colour_in = points + (long)point * 4;
+            int pixel[4] = {colour_in[0], colour_in[1], colour_in[2], colour_in[3]};
+            int closest = candidates[0], minimum_distance = INT_MAX;
+            for (int i = 0; i < num_candidates; i++) {
+                int distance = getSquaredDistance<CHANNELS>(pixel, centroids + candidates[i] * 4);
+                if (distance < minimum_distance) {
+                    minimum_distance = distance;
+                    closest = candidates[i];
+                }
+            }
+            *evaluations += num_candidates;
+            if (point_indices[point] != closest) {
+                *reassigned_pixels += weights[point];
+                point_indices[point] = closest;
+            }
+            *sse += (long)weights[point] * minimum_distance;
+            long *sum = sums + closest * 5;
+            for (int channel = 0; channel < CHANNELS; channel++)
+                sum[channel] += (long)pixel[channel] * weights[point];
+            sum[4] += weights[point];
+        }
+        return;
+    }
+
+    // candidate nearest to centre of box (coordinates are doubled so centre is integer)
+    int centre[4], doubled[4];
+    int nearest = candidates[0], nearest_distance = INT_MAX;
+    for (int channel = 0; channel < 4; channel++)
+        centre[channel] = node->box_min[channel] + node->box_max[channel];
+    for (int i = 0; i < num_candidates; i++) {
+        int *colour = centroids + candidates[i] * 4;
+        for (int channel = 0; channel < 4; channel++)
+            doubled[channel] = 2 * colour[channel];
+        int distance = getSquaredDistance<CHANNELS>(doubled, centre);
+        if (distance < nearest_distance) {
+            nearest_distance = distance;
+            nearest = candidates[i];
+        }
+    }
+
+    // candidate is dropped when even corner of box farthest towards it is closer to nearest one; on tie it is kept
+    // if it has lower index, as it would win that tie
+    int *children_candidates = candidates + num_candidates;
+    int num_children_candidates = 0;
+    int *nearest_colour = centroids + nearest * 4;
+    for (int i = 0; i < num_candidates; i++) {
+        int *colour = centroids + candidates[i] * 4;
+        if (candidates[i] != nearest) {
+            int corner[4];
+            for (int channel = 0; channel < 4; channel++)
+                corner[channel] = colour[channel] > nearest_colour[channel] ? node->box_max[channel] : node->box_min[channel];
+            int distance = getSquaredDistance<CHANNELS>(colour, corner);
+            int distance_nearest = getSquaredDistance<CHANNELS>(nearest_colour, corner);
+            if (distance > distance_nearest || (distance == distance_nearest && candidates[i] > nearest))
+                continue;
+        }
+        children_candidates[num_children_candidates++] = candidates[i];
+    }
+    *evaluations += 3 * num_candidates;
+    filterNode<CHANNELS>(tree, node->left, points, weights, point_indices, centroids, children_candidates, num_children_candidates,
+                         sums, reassigned_pixels, sse, evaluations);
+    filterNode<CHANNELS>(tree, node->right, points, weights, point_indices, centroids, children_candidates, num_children_candidates,
+                         sums, reassigned_pixels, sse, evaluations);
+}
+
+#endif
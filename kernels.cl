@@ -4,12 +4,20 @@ __kernel void find_closest_centroids(int num_of_clusters,
                                     int num_of_points,
                                     __global int *centroids,
                                     __global int *closest_centroid_indices,
-                                    __global const unsigned char *image_in) {
+                                    __global const unsigned char *image_in,
+                                    __global int *changed_pixels,
+                                    int iteration) {
     
     // Get the index of the work-item
     int gid = get_global_id(0);
     int lid = get_local_id(0);
 
+    // Count of pixels in this work-group which changed centroid
+    __local int changed_pixels_local;
+    if (lid == 0)
+        changed_pixels_local = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
     if (gid < num_of_points) {
 
         int image_point_index = gid * 4;
@@ -39,9 +47,15 @@ __kernel void find_closest_centroids(int num_of_clusters,
             }
         }
 
+        if (closest_centroid_indices[gid] != centroidIndex)
+            atomic_inc(&changed_pixels_local);
         closest_centroid_indices[gid] = centroidIndex;
     }
-    
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid == 0 && changed_pixels_local != 0)
+        atomic_add(&changed_pixels[iteration], changed_pixels_local);
+
 }
 
 
@@ -88,12 +102,20 @@ __kernel void find_closest_centroids_2(int num_of_clusters,
                                     __global int *centroids,
                                     __global long *centroids_sums,
                                     __global int *closest_centroid_indices,
-                                    __global const unsigned char *image_in) {
+                                    __global const unsigned char *image_in,
+                                    __global int *changed_pixels,
+                                    int iteration) {
     
     // Get the index of the work-item
     int gid = get_global_id(0);
     int lid = get_local_id(0);
 
+    // Count of pixels in this work-group which changed centroid
+    __local int changed_pixels_local;
+    if (lid == 0)
+        changed_pixels_local = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
     if (gid < num_of_points) {
 
         int image_point_index = gid * 4;
@@ -123,6 +145,8 @@ __kernel void find_closest_centroids_2(int num_of_clusters,
             }
         }
 
+        if (closest_centroid_indices[gid] != centroidIndex)
+            atomic_inc(&changed_pixels_local);
         closest_centroid_indices[gid] = centroidIndex;
         atomic_add(&centroids_sums[centroidIndex * 5], blue);
         atomic_add(&centroids_sums[centroidIndex * 5 + 1], green);
@@ -130,7 +154,11 @@ __kernel void find_closest_centroids_2(int num_of_clusters,
         atomic_add(&centroids_sums[centroidIndex * 5 + 3], alpha);
         atomic_add(&centroids_sums[centroidIndex * 5 + 4], 1);
     }
-    
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid == 0 && changed_pixels_local != 0)
+        atomic_add(&changed_pixels[iteration], changed_pixels_local);
+
 }
 
 
@@ -173,13 +201,18 @@ __kernel void find_closest_centroids_3(int num_of_clusters,
                                     __global long *centroids_sums,
                                     __local int *centroids_sums_local,
                                     __global int *closest_centroid_indices,
-                                    __global const unsigned char *image_in) {
+                                    __global const unsigned char *image_in,
+                                    __global int *changed_pixels,
+                                    int iteration) {
     
     // Get the index of the work-item
     int gid = get_global_id(0);
     int lid = get_local_id(0);
     int loc_size = get_local_size(0);
 
+    // Count of pixels in this work-group which changed centroid
+    __local int changed_pixels_local;
+
     // Divide work
     int displ = lid * num_of_clusters / loc_size;
     int num_of_work = (lid + 1)*num_of_clusters / loc_size - lid * num_of_clusters / loc_size;
@@ -192,6 +225,11 @@ __kernel void find_closest_centroids_3(int num_of_clusters,
         centroids_sums_local[i * 5 + 3] = 0;
         centroids_sums_local[i * 5 + 4] = 0;
     }
+    if (lid == 0)
+        changed_pixels_local = 0;
+
+    // Local sums have to be initialized before any work-item adds to them
+    barrier(CLK_LOCAL_MEM_FENCE);
 
     if (gid < num_of_points) {
 
@@ -222,10 +260,10 @@ __kernel void find_closest_centroids_3(int num_of_clusters,
             }
         }
 
+        if (closest_centroid_indices[gid] != centroidIndex)
+            atomic_inc(&changed_pixels_local);
         closest_centroid_indices[gid] = centroidIndex;
 
-        barrier(CLK_LOCAL_MEM_FENCE);
-
         // First add to local centroids sums 
         atomic_add(&centroids_sums_local[centroidIndex * 5], blue);
         atomic_add(&centroids_sums_local[centroidIndex * 5 + 1], green);
@@ -245,5 +283,7 @@ __kernel void find_closest_centroids_3(int num_of_clusters,
         atomic_add(&centroids_sums[i * 5 + 3], centroids_sums_local[i * 5 + 3]);
         atomic_add(&centroids_sums[i * 5 + 4], centroids_sums_local[i * 5 + 4]);
     }
+    if (lid == 0 && changed_pixels_local != 0)
+        atomic_add(&changed_pixels[iteration], changed_pixels_local);
     
 }
\ No newline at end of file
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstdlib>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <omp.h>
+#include "FreeImage.h"
+#include "image_io.h"
+#include "cost_model.h"
+#include "args.h"
+
+// Picks backend, algorithm and number of threads for image from cost model and runs it. Usage:
+//   ./kmeans_auto <image> <clusters> <iterations> [--cost-model=<file>] [--build-dir=<dir>] [--threads=<max>]
+//                 [--approximate] [--no-gpu] [--dry-run]
+//   ./kmeans_auto <image> --calibrate [--cost-model=<file>] [--build-dir=<dir>] [--threads=<max>]
+// Features are image size, estimate of distinct colours (from sample of pixels), number of clusters and iterations,
+// number of processors and whether OpenCL has a GPU. Every candidate and the choice are printed before the run.
+// --approximate also allows minibatch, --dry-run only prints the choice.
+// --calibrate measures model constants on given image with built programs and writes them to cost model file
+// (default kmeans_cost_model.txt, also read by parallel_openmp_optimized_v2 --algorithm=auto).
+
+#define CALIBRATION_ITERATIONS 5
+#define CALIBRATION_CLUSTERS 32
+#define CALIBRATION_REPORT "kmeans_auto_report.json"
+
+static const char *backend_binaries[NUM_BACKENDS] = {"parallel_openmp_optimized_v2", "parallel_opencl"};
+
+int quoteShellArg(char *quoted, size_t size, const char *arg){
+    //writes arg in single quotes so shell passes it unchanged, quote inside it is written as '\''; returns 1 if it does not fit
+    size_t length = 0;
+    quoted[length++] = '\'';
+    for (const char *c = arg; *c != '\0'; c++) {
+        if (length + 6 > size)
+            return 1;
+        if (*c == '\'') {
+            memcpy(quoted + length, "'\\''", 4);
+            length += 4;
+        }
+        else
+            quoted[length++] = *c;
+    }
+    if (length + 2 > size)
+        return 1;
+    quoted[length++] = '\'';
+    quoted[length] = '\0';
+    return 0;
+}
+
+int hasGpu(const char *build_dir){
+    //asks OpenCL program for its devices, so this program does not need OpenCL itself
+    char quoted_dir[1024], command[4096];
+    snprintf(command, sizeof(command), "%s/%s", build_dir, backend_binaries[BACKEND_OPENCL]);
+    if (access(command, X_OK) != 0 || quoteShellArg(quoted_dir, sizeof(quoted_dir), build_dir))
+        return 0;
+    snprintf(command, sizeof(command), "%s/%s --list-devices 2>/dev/null", quoted_dir, backend_binaries[BACKEND_OPENCL]);
+    FILE *pipe = popen(command, "r");
+    if (pipe == NULL)
+        return 0;
+    int gpu = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), pipe)) {
+        if (strstr(line, "(gpu,") != NULL)
+            gpu = 1;
+    }
+    pclose(pipe);
+    return gpu;
+}
+
+double runIterations(const char *command){
+    //runs command and returns mean of its per-iteration times without first one, negative if it failed
+    FILE *pipe = popen(command, "r");
+    if (pipe == NULL)
+        return -1;
+    char line[1024];
+    int iteration = 0;
+    double sum = 0;
+    while (fgets(line, sizeof(line), pipe)) {
+        char *end;
+        double time = strtod(line, &end);
+        if (end == line || (*end != '\n' && *end != ' ' && *end != '\0'))
+            continue;
+        if (iteration++ > 0)
+            sum += time;
+    }
+    if (pclose(pipe) != 0 || iteration < 2) {
+        fprintf(stderr, "Command failed: %s\n", command);
+        return -1;
+    }
+    return sum / (iteration - 1);
+}
+
+double readReportValue(const char *file_name, const char *key){
+    //returns number which follows key in JSON report written by engine, negative if it is not there
+    long size = getFileSize(file_name);
+    FILE *fp = fopen(file_name, "r");
+    if (!fp || size <= 0) {
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+    char *report = (char *)calloc(size + 1, 1);
+    size_t read = fread(report, 1, size, fp);
+    report[read] = '\0';
+    fclose(fp);
+    char *value = strstr(report, key);
+    double result = value != NULL ? strtod(value + strlen(key), NULL) : -1;
+    free(report);
+    return result;
+}
+
+int runEngine(const char *build_dir, const char *image, int algorithm, int clusters, int threads, double *assign_ms, double *init_ms, double *evaluations){
+    //runs OpenMP engine with report and returns time of one assignment, time of initialization and distance evaluations
+    char quoted_dir[1024], quoted_image[1024], command[4096];
+    if (quoteShellArg(quoted_dir, sizeof(quoted_dir), build_dir) || quoteShellArg(quoted_image, sizeof(quoted_image), image)) {
+        fprintf(stderr, "Path is too long: %s\n", image);
+        return 1;
+    }
+    snprintf(command, sizeof(command), "OMP_NUM_THREADS=%d %s/%s %s %d %d --algorithm=%s --report=%s > /dev/null", threads, quoted_dir,
+             backend_binaries[BACKEND_OPENMP], quoted_image, clusters, CALIBRATION_ITERATIONS, algorithm_names[algorithm], CALIBRATION_REPORT);
+    if (system(command) != 0) {
+        fprintf(stderr, "Command failed: %s\n", command);
+        return 1;
+    }
+    *assign_ms = readReportValue(CALIBRATION_REPORT, "\"assign\": {\"time_ms\": ") / CALIBRATION_ITERATIONS;
+    *init_ms = readReportValue(CALIBRATION_REPORT, "\"init\": {\"time_ms\": ");
+    *evaluations = readReportValue(CALIBRATION_REPORT, "\"distance_evaluations\": ") / CALIBRATION_ITERATIONS;
+    remove(CALIBRATION_REPORT);
+    return *assign_ms < 0;
+}
+
+int calibrate(CostModel *model, const char *build_dir, const char *image, long num_pixels, int max_threads){
+    //fits model constants from short runs: lloyd with 2 and many clusters gives cost of distance and of point,
+    //same on all threads gives overhead of threads, pruned gives fraction of evaluated distances, histogram its build cost
+    double assign_small, assign_large, assign_parallel, assign_pruned, init_ms, evaluations;
+    int k = CALIBRATION_CLUSTERS;
+    if (runEngine(build_dir, image, ALGORITHM_LLOYD, 2, 1, &assign_small, &init_ms, &evaluations) ||
+        runEngine(build_dir, image, ALGORITHM_LLOYD, k, 1, &assign_large, &init_ms, &evaluations) ||
+        runEngine(build_dir, image, ALGORITHM_LLOYD, k, max_threads, &assign_parallel, &init_ms, &evaluations))
+        return 1;
+    model->distance_ns = (assign_large - assign_small) * 1e6 / ((double)num_pixels * (k - 2));
+    if (model->distance_ns <= 0)
+        model->distance_ns = assign_large * 1e6 / ((double)num_pixels * k);
+    model->point_ns = assign_small * 1e6 / num_pixels - 2 * model->distance_ns;
+    if (model->point_ns < 0)
+        model->point_ns = 0;
+    double overhead_ms = assign_parallel - assign_large / max_threads;
+    model->thread_overhead_us = overhead_ms > 0 ? overhead_ms * 1000 / max_threads : 0;
+    printf("calibration lloyd clusters:2 %.4f clusters:%d %.4f threads:%d %.4f\n", assign_small, k, assign_large, max_threads, assign_parallel);
+
+    if (runEngine(build_dir, image, ALGORITHM_PRUNED, k, 1, &assign_pruned, &init_ms, &evaluations))
+        return 1;
+    model->pruned_fraction = (evaluations / num_pixels - 1) / (k - 1);
+    printf("calibration pruned %.4f evaluations per pixel:%.2f\n", assign_pruned, evaluations / num_pixels);
+
+    double assign_histogram;
+    if (runEngine(build_dir, image, ALGORITHM_HISTOGRAM, k, 1, &assign_histogram, &init_ms, &evaluations))
+        return 1;
+    model->histogram_ns = init_ms * 1e6 / (num_pixels * log2(num_pixels > 2 ? num_pixels : 2));
+    printf("calibration histogram init %.4f %.4f\n", init_ms, assign_histogram);
+
+    char quoted_dir[1024], quoted_image[1024];
+    if (hasGpu(build_dir) && !quoteShellArg(quoted_dir, sizeof(quoted_dir), build_dir) && !quoteShellArg(quoted_image, sizeof(quoted_image), image)) {
+        char command[4096];
+        snprintf(command, sizeof(command), "%s/%s %s %d %d 2>/dev/null", quoted_dir, backend_binaries[BACKEND_OPENCL], quoted_image, 2, CALIBRATION_ITERATIONS);
+        double gpu_small = runIterations(command);
+        snprintf(command, sizeof(command), "%s/%s %s %d %d 2>/dev/null", quoted_dir, backend_binaries[BACKEND_OPENCL], quoted_image, k, CALIBRATION_ITERATIONS);
+        double gpu_large = runIterations(command);
+        if (gpu_small > 0 && gpu_large > 0) {
+            model->gpu_distance_ns = (gpu_large - gpu_small) * 1e6 / ((double)num_pixels * (k - 2));
+            if (model->gpu_distance_ns <= 0)
+                model->gpu_distance_ns = gpu_large * 1e6 / ((double)num_pixels * k);
+            double launch_ms = gpu_small - num_pixels * 2 * model->gpu_distance_ns / 1e6;
+            model->gpu_launch_us = launch_ms > 0 ? launch_ms * 1000 : 0;
+            printf("calibration opencl clusters:2 %.4f clusters:%d %.4f\n", gpu_small, k, gpu_large);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+
+    const char *image = getPositionalArg(argc, argv, 1);
+    int calibration = getOption(argc, argv, "calibrate") != NULL;
+    if (image == NULL || (!calibration && getPositionalArg(argc, argv, 3) == NULL)) {
+        fprintf(stderr, "Usage: %s <image> <clusters> <iterations> [--cost-model=<file>] [--build-dir=<dir>] [--threads=<max>] "
+                "[--approximate] [--no-gpu] [--dry-run]\n       %s <image> --calibrate [--cost-model=<file>] [--build-dir=<dir>]\n", argv[0], argv[0]);
+        exit(1);
+    }
+    const char *cost_model_file = getOption(argc, argv, "cost-model");
+    if (cost_model_file == NULL || cost_model_file[0] == '\0')
+        cost_model_file = COST_MODEL_FILE;
+    const char *build_dir = getOption(argc, argv, "build-dir");
+    if (build_dir == NULL || build_dir[0] == '\0')
+        build_dir = ".";
+    const char *arg = getOption(argc, argv, "threads");
+    int max_threads = arg != NULL && atoi(arg) > 0 ? atoi(arg) : omp_get_num_procs();
+
+    CostModel model;
+    initCostModel(&model);
+    readCostModel(cost_model_file, &model);
+
+    // Image is loaded only to get its features, chosen program loads it again
+    struct timespec clock_start, clock_end;
+    clock_gettime(CLOCK_MONOTONIC, &clock_start);
+    int width, height, pitch;
+    unsigned char *imageIn = loadImage(image, &width, &height, &pitch);
+    if (imageIn == NULL)
+        exit(1);
+    long num_pixels = (long)width * height;
+    long distinct_colours = estimateDistinctColours(imageIn, num_pixels, 65536);
+    free(imageIn);
+    clock_gettime(CLOCK_MONOTONIC, &clock_end);
+    long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+    printf("%s %dx%d distinct colours:%ld (estimated in %.4f)\n", image, width, height, distinct_colours, nanosecs/(1000.0*1000.0));
+
+    if (calibration) {
+        if (calibrate(&model, build_dir, image, num_pixels, max_threads))
+            exit(1);
+        for (int f = 0; f < NUM_COST_MODEL_FIELDS; f++)
+            printf("%s %.6f\n", cost_model_fields[f].name, *(double *)((char *)&model + cost_model_fields[f].offset));
+        return writeCostModel(cost_model_file, &model);
+    }
+
+    int num_of_clusters = atoi(getPositionalArg(argc, argv, 2));
+    int num_of_iterations = atoi(getPositionalArg(argc, argv, 3));
+    int gpu = getOption(argc, argv, "no-gpu") == NULL && hasGpu(build_dir);
+    Workload work = {num_pixels, distinct_colours, num_of_clusters, num_of_iterations, 16384};
+    Choice choice;
+    chooseConfiguration(&model, &work, -1, max_threads, 1, gpu, getOption(argc, argv, "approximate") != NULL, &choice, stdout);
+    printf("auto backend:%s algorithm:%s threads:%d predicted:%.4f\n", backend_names[choice.backend], algorithm_names[choice.algorithm],
+           choice.threads, choice.predicted_ms);
+    fflush(stdout);
+    if (getOption(argc, argv, "dry-run") != NULL)
+        return 0;
+
+    char quoted_dir[1024], quoted_image[1024], command[4096];
+    if (quoteShellArg(quoted_dir, sizeof(quoted_dir), build_dir) || quoteShellArg(quoted_image, sizeof(quoted_image), image)) {
+        fprintf(stderr, "Path is too long: %s\n", image);
+        return 1;
+    }
+    if (choice.backend == BACKEND_OPENCL)
+        snprintf(command, sizeof(command), "%s/%s %s %d %d", quoted_dir, backend_binaries[choice.backend], quoted_image, num_of_clusters, num_of_iterations);
+    else
+        snprintf(command, sizeof(command), "OMP_NUM_THREADS=%d %s/%s %s %d %d --algorithm=%s", choice.threads, quoted_dir,
+                 backend_binaries[choice.backend], quoted_image, num_of_clusters, num_of_iterations, algorithm_names[choice.algorithm]);
+    return system(command) != 0;
+}
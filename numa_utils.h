@@ -0,0 +1,146 @@
+// NUMA placement for OpenMP threads: thread binding, first touch of buffers with static schedule and per-node copies
+// of small shared tables. Uses only sysfs and affinity calls, so it does not need libnuma.
+#ifndef NUMA_UTILS_H
+#define NUMA_UTILS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#define MAX_NUMA_NODES 64
+#define PAGE_SIZE 4096
+
+typedef struct {
+    int num_threads;
+    int *thread_cpu;
+    // dense node index (0 to num_nodes - 1) of every thread
+    int *thread_node;
+    int num_nodes;
+} NumaLayout;
+
+static inline int getCpuNode(int cpu){
+    //node of cpu from sysfs (cpu directory has link to its node), 0 if it is not known
+#ifdef __linux__
+    char path[128];
+    for (int node = 0; node < MAX_NUMA_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0)
+            return node;
+    }
+#endif
+    return 0;
+}
+
+static inline void initNumaLayout(NumaLayout *layout, int bind){
+    //finds cpu and node of every thread of current team size, with bind every thread is first pinned to one of allowed
+    //cpus, spread evenly over them so few threads still use all sockets
+    int num_threads = omp_get_max_threads();
+    layout->num_threads = num_threads;
+    layout->thread_cpu = (int *)calloc(num_threads, sizeof(int));
+    layout->thread_node = (int *)calloc(num_threads, sizeof(int));
+    layout->num_nodes = 1;
+
+#ifdef __linux__
+    int allowed_cpus[CPU_SETSIZE];
+    int num_allowed = 0;
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &mask))
+                allowed_cpus[num_allowed++] = cpu;
+        }
+    }
+    if (num_allowed == 0)
+        bind = 0;
+
+    #pragma omp parallel num_threads(num_threads)
+    {
+        int thread = omp_get_thread_num();
+        int cpu;
+        if (bind) {
+            cpu = num_threads <= num_allowed ? allowed_cpus[(long)thread * num_allowed / num_threads] : allowed_cpus[thread % num_allowed];
+            cpu_set_t thread_mask;
+            CPU_ZERO(&thread_mask);
+            CPU_SET(cpu, &thread_mask);
+            sched_setaffinity(0, sizeof(thread_mask), &thread_mask);
+        } else {
+            cpu = sched_getcpu();
+        }
+        layout->thread_cpu[thread] = cpu;
+        layout->thread_node[thread] = getCpuNode(cpu);
+    }
+
+    // node numbers can have gaps, threads get dense indices
+    int node_ids[MAX_NUMA_NODES];
+    layout->num_nodes = 0;
+    for (int t = 0; t < num_threads; t++) {
+        int n = 0;
+        while (n < layout->num_nodes && node_ids[n] != layout->thread_node[t])
+            n++;
+        if (n == layout->num_nodes)
+            node_ids[layout->num_nodes++] = layout->thread_node[t];
+        layout->thread_node[t] = n;
+    }
+#endif
+}
+
+static inline void freeNumaLayout(NumaLayout *layout){
+    free(layout->thread_cpu);
+    free(layout->thread_node);
+    memset(layout, 0, sizeof(NumaLayout));
+}
+
+static inline void placeCopy(void *destination, void *source, long num_elements, int element_size){
+    //every thread copies elements it gets in schedule(static) loop over num_elements, so pages of destination which are
+    //touched first here are placed on its node
+    #pragma omp parallel
+    {
+        // range of this thread is taken from the loop itself, so it is same as in other static loops over same elements
+        long first = -1, last = -1;
+        #pragma omp for schedule(static) nowait
+        for (long i = 0; i < num_elements; i++) {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+        if (first >= 0)
+            memcpy((char *)destination + first * element_size, (char *)source + first * element_size, (last - first + 1) * element_size);
+    }
+}
+
+static inline void **allocateNodeReplicas(NumaLayout *layout, size_t size){
+    //one copy of table per node, allocated and touched by first thread running on that node
+    void **replicas = (void **)calloc(layout->num_nodes, sizeof(void *));
+    #pragma omp parallel num_threads(layout->num_threads)
+    {
+        int thread = omp_get_thread_num();
+        int node = layout->thread_node[thread];
+        int first_on_node = 1;
+        for (int t = 0; t < thread; t++) {
+            if (layout->thread_node[t] == node)
+                first_on_node = 0;
+        }
+        if (first_on_node && posix_memalign(&replicas[node], PAGE_SIZE, size) == 0)
+            memset(replicas[node], 0, size);
+    }
+    return replicas;
+}
+
+static inline void updateNodeReplicas(NumaLayout *layout, void **replicas, void *source, size_t size){
+    //copies table to every node, pages of replicas stay where they were first touched
+    for (int node = 0; node < layout->num_nodes; node++)
+        memcpy(replicas[node], source, size);
+}
+
+static inline void freeNodeReplicas(NumaLayout *layout, void **replicas){
+    for (int node = 0; node < layout->num_nodes; node++)
+        free(replicas[node]);
+    free(replicas);
+}
+
+#endif
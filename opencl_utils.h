@@ -0,0 +1,208 @@
+// Helpers shared by OpenCL programs: checking of OpenCL calls, device selection and program build
+#ifndef OPENCL_UTILS_H
+#define OPENCL_UTILS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <CL/cl.h>
+
+#ifndef CL_PLATFORM_NOT_FOUND_KHR
+#define CL_PLATFORM_NOT_FOUND_KHR -1001
+#endif
+
+#define MAX_PLATFORMS 16
+
+static const char *getErrorString(cl_int error){
+    switch (error) {
+        case CL_SUCCESS: return "CL_SUCCESS";
+        case CL_DEVICE_NOT_FOUND: return "CL_DEVICE_NOT_FOUND";
+        case CL_DEVICE_NOT_AVAILABLE: return "CL_DEVICE_NOT_AVAILABLE";
+        case CL_COMPILER_NOT_AVAILABLE: return "CL_COMPILER_NOT_AVAILABLE";
+        case CL_MEM_OBJECT_ALLOCATION_FAILURE: return "CL_MEM_OBJECT_ALLOCATION_FAILURE";
+        case CL_OUT_OF_RESOURCES: return "CL_OUT_OF_RESOURCES";
+        case CL_OUT_OF_HOST_MEMORY: return "CL_OUT_OF_HOST_MEMORY";
+        case CL_PROFILING_INFO_NOT_AVAILABLE: return "CL_PROFILING_INFO_NOT_AVAILABLE";
+        case CL_BUILD_PROGRAM_FAILURE: return "CL_BUILD_PROGRAM_FAILURE";
+        case CL_INVALID_VALUE: return "CL_INVALID_VALUE";
+        case CL_INVALID_DEVICE_TYPE: return "CL_INVALID_DEVICE_TYPE";
+        case CL_INVALID_PLATFORM: return "CL_INVALID_PLATFORM";
+        case CL_INVALID_DEVICE: return "CL_INVALID_DEVICE";
+        case CL_INVALID_CONTEXT: return "CL_INVALID_CONTEXT";
+        case CL_INVALID_COMMAND_QUEUE: return "CL_INVALID_COMMAND_QUEUE";
+        case CL_INVALID_MEM_OBJECT: return "CL_INVALID_MEM_OBJECT";
+        case CL_INVALID_BUILD_OPTIONS: return "CL_INVALID_BUILD_OPTIONS";
+        case CL_INVALID_PROGRAM: return "CL_INVALID_PROGRAM";
+        case CL_INVALID_PROGRAM_EXECUTABLE: return "CL_INVALID_PROGRAM_EXECUTABLE";
+        case CL_INVALID_KERNEL_NAME: return "CL_INVALID_KERNEL_NAME";
+        case CL_INVALID_KERNEL: return "CL_INVALID_KERNEL";
+        case CL_INVALID_ARG_INDEX: return "CL_INVALID_ARG_INDEX";
+        case CL_INVALID_ARG_VALUE: return "CL_INVALID_ARG_VALUE";
+        case CL_INVALID_ARG_SIZE: return "CL_INVALID_ARG_SIZE";
+        case CL_INVALID_KERNEL_ARGS: return "CL_INVALID_KERNEL_ARGS";
+        case CL_INVALID_WORK_DIMENSION: return "CL_INVALID_WORK_DIMENSION";
+        case CL_INVALID_WORK_GROUP_SIZE: return "CL_INVALID_WORK_GROUP_SIZE";
+        case CL_INVALID_WORK_ITEM_SIZE: return "CL_INVALID_WORK_ITEM_SIZE";
+        case CL_INVALID_GLOBAL_OFFSET: return "CL_INVALID_GLOBAL_OFFSET";
+        case CL_INVALID_EVENT_WAIT_LIST: return "CL_INVALID_EVENT_WAIT_LIST";
+        case CL_INVALID_EVENT: return "CL_INVALID_EVENT";
+        case CL_INVALID_BUFFER_SIZE: return "CL_INVALID_BUFFER_SIZE";
+        case CL_INVALID_GLOBAL_WORK_SIZE: return "CL_INVALID_GLOBAL_WORK_SIZE";
+        case CL_PLATFORM_NOT_FOUND_KHR: return "CL_PLATFORM_NOT_FOUND_KHR";
+        default: return "unknown error";
+    }
+}
+
+static int checkStatus(cl_int status, const char *call){
+    //prints failed call and returns 1 if status is not CL_SUCCESS
+    if (status == CL_SUCCESS)
+        return 0;
+    fprintf(stderr, "OpenCL error in %s: %s (%d)\n", call, getErrorString(status), status);
+    return 1;
+}
+
+static cl_int keepFirstError(cl_int status, cl_int call_status){
+    //status of sequence of calls is that of first one which failed, so its own error is reported (codes are negative,
+    //combining them with | gives name of unrelated error)
+    return status != CL_SUCCESS ? status : call_status;
+}
+
+static cl_device_type parseDeviceType(const char *type_name){
+    //returns 0 for unknown type name
+    if (type_name == NULL || type_name[0] == '\0' || strcasecmp(type_name, "gpu") == 0)
+        return CL_DEVICE_TYPE_GPU;
+    if (strcasecmp(type_name, "cpu") == 0)
+        return CL_DEVICE_TYPE_CPU;
+    if (strcasecmp(type_name, "accelerator") == 0)
+        return CL_DEVICE_TYPE_ACCELERATOR;
+    if (strcasecmp(type_name, "default") == 0)
+        return CL_DEVICE_TYPE_DEFAULT;
+    if (strcasecmp(type_name, "all") == 0)
+        return CL_DEVICE_TYPE_ALL;
+    return 0;
+}
+
+static void printDevices(){
+    //lists all platforms and devices, used for --list-devices
+    cl_uint num_platforms = 0;
+    cl_platform_id platforms[MAX_PLATFORMS];
+    if (checkStatus(clGetPlatformIDs(MAX_PLATFORMS, platforms, &num_platforms), "clGetPlatformIDs"))
+        return;
+    if (num_platforms > MAX_PLATFORMS)
+        num_platforms = MAX_PLATFORMS;
+
+    for (cl_uint p = 0; p < num_platforms; p++) {
+        char platform_name[256] = "";
+        clGetPlatformInfo(platforms[p], CL_PLATFORM_NAME, sizeof(platform_name), platform_name, NULL);
+        printf("platform %u: %s\n", p, platform_name);
+
+        cl_uint num_devices = 0;
+        if (clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &num_devices) != CL_SUCCESS)
+            continue;
+        cl_device_id *devices = (cl_device_id *)malloc(sizeof(cl_device_id) * num_devices);
+        clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, num_devices, devices, NULL);
+        for (cl_uint d = 0; d < num_devices; d++) {
+            char device_name[256] = "";
+            cl_device_type device_type = 0;
+            cl_uint compute_units = 0;
+            clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+            clGetDeviceInfo(devices[d], CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, NULL);
+            clGetDeviceInfo(devices[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, NULL);
+            printf("  device %u: %s (%s, %u compute units)\n", d, device_name,
+                   device_type & CL_DEVICE_TYPE_GPU ? "gpu" : device_type & CL_DEVICE_TYPE_CPU ? "cpu" : "accelerator", compute_units);
+        }
+        free(devices);
+    }
+}
+
+static cl_int selectDevices(cl_device_type device_type, const char *name_filter, cl_uint max_devices,
+                            cl_platform_id *platform, cl_device_id *devices, cl_uint *num_devices){
+    //finds first platform with devices of given type whose name contains name_filter (case insensitive, NULL or "" matches all)
+    //and returns up to max_devices of them, CL_DEVICE_NOT_FOUND if there is no such device on any platform
+    cl_uint num_platforms = 0;
+    cl_platform_id platforms[MAX_PLATFORMS];
+    cl_int clStatus = clGetPlatformIDs(MAX_PLATFORMS, platforms, &num_platforms);
+    if (clStatus != CL_SUCCESS)
+        return clStatus;
+    if (num_platforms > MAX_PLATFORMS)
+        num_platforms = MAX_PLATFORMS;
+
+    for (cl_uint p = 0; p < num_platforms; p++) {
+        cl_uint num_platform_devices = 0;
+        if (clGetDeviceIDs(platforms[p], device_type, 0, NULL, &num_platform_devices) != CL_SUCCESS || num_platform_devices == 0)
+            continue;
+        cl_device_id *platform_devices = (cl_device_id *)malloc(sizeof(cl_device_id) * num_platform_devices);
+        clStatus = clGetDeviceIDs(platforms[p], device_type, num_platform_devices, platform_devices, NULL);
+        if (clStatus != CL_SUCCESS) {
+            free(platform_devices);
+            continue;
+        }
+
+        *num_devices = 0;
+        for (cl_uint d = 0; d < num_platform_devices && *num_devices < max_devices; d++) {
+            char device_name[256] = "";
+            clGetDeviceInfo(platform_devices[d], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+            if (name_filter == NULL || name_filter[0] == '\0' || strcasestr(device_name, name_filter) != NULL)
+                devices[(*num_devices)++] = platform_devices[d];
+        }
+        free(platform_devices);
+
+        if (*num_devices > 0) {
+            *platform = platforms[p];
+            return CL_SUCCESS;
+        }
+    }
+    return CL_DEVICE_NOT_FOUND;
+}
+
+static char *readKernelSource(const char *file_name){
+    //reads whole file into null terminated string, NULL if file can not be read
+    FILE *fp = fopen(file_name, "r");
+    if (!fp) {
+        fprintf(stderr, "Open file error: %s.\n", file_name);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *source_str = (char*)malloc(file_size + 1);
+    size_t source_size = fread(source_str, 1, file_size, fp);
+    source_str[source_size] = '\0';
+    fclose(fp);
+    return source_str;
+}
+
+static cl_int buildProgram(cl_context context, cl_uint num_devices, cl_device_id *devices, const char *source_str, cl_program *program){
+    //creates and builds program, build log is printed when build fails (log of successful build only has warnings)
+    cl_int clStatus;
+    *program = clCreateProgramWithSource(context, 1, &source_str, NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateProgramWithSource"))
+        return clStatus;
+
+    cl_int build_status = clBuildProgram(*program, num_devices, devices, NULL, NULL, NULL);
+    if (build_status != CL_SUCCESS) {
+        for (cl_uint d = 0; d < num_devices; d++) {
+            size_t build_log_len = 0;
+            clGetProgramBuildInfo(*program, devices[d], CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_len);
+            char *build_log = (char *)malloc(sizeof(char)*(build_log_len+1));
+            clGetProgramBuildInfo(*program, devices[d], CL_PROGRAM_BUILD_LOG, build_log_len, build_log, NULL);
+            build_log[build_log_len] = '\0';
+            fprintf(stderr, "%s\n", build_log);
+            free(build_log);
+        }
+        checkStatus(build_status, "clBuildProgram");
+    }
+    return build_status;
+}
+
+
+static size_t roundUpToLocalSize(size_t size, size_t local_size){
+    //global size has to be multiple of local size
+    size_t mod = size % local_size;
+    if (mod != 0)
+        return size + (local_size - mod);
+    return size;
+}
+
+#endif
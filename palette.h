@@ -0,0 +1,299 @@
+// Palettes: reading and writing palette files (centroids of one run as fixed palette or start of next run) and nearest
+// palette colour lookup for remapping without clustering.
+// Nearest colour is found in k-d tree of palette, and for images with constant alpha it is remembered in table indexed
+// by 24 bit colour, so every distinct colour is searched once for whole batch and most pixels are one table load.
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+
+// table holds index + 1 in 16 bits, 0 is colour not searched yet
+#define MAX_PALETTE_COLOURS 65535
+// Binary palette is text header "KMPAL <colours>\n" followed by R, G, B, A bytes of every colour
+#define PALETTE_MAGIC "KMPAL"
+#define PALETTE_LUT_SIZE (1 << 24)
+
+typedef struct {
+    // colours in engine layout (B, G, R, A), 4 ints per colour like centroids
+    int *colours;
+    int num_colours;
+} Palette;
+
+typedef struct {
+    // palette colour of this node, children are -1 when missing
+    int colour;
+    int split_channel;
+    int left;
+    int right;
+} KdNode;
+
+typedef struct {
+    Palette *palette;
+    // nodes are in order of build, root is node 0
+    KdNode *nodes;
+    // 24 bit colour to palette index + 1 for pixels with alpha lut_alpha, -1 when table is not used for current image
+    unsigned short *lut;
+    int lut_alpha;
+} PaletteLookup;
+
+static inline int addPaletteColour(Palette *palette, int *capacity, int red, int green, int blue, int alpha){
+    //returns 0 on success
+    if (palette->num_colours == MAX_PALETTE_COLOURS || red < 0 || red > 255 || green < 0 || green > 255 || blue < 0 || blue > 255 ||
+        alpha < 0 || alpha > 255)
+        return 1;
+    if (palette->num_colours == *capacity) {
+        *capacity = *capacity > 0 ? *capacity * 2 : 256;
+        palette->colours = (int *)realloc(palette->colours, *capacity * 4 * sizeof(int));
+    }
+    int *colour = palette->colours + palette->num_colours * 4;
+    colour[0] = blue;
+    colour[1] = green;
+    colour[2] = red;
+    colour[3] = alpha;
+    palette->num_colours++;
+    return 0;
+}
+
+static inline int parseJsonPalette(const char *text, Palette *palette, int *capacity){
+    //colours are arrays of 3 or 4 numbers (R, G, B and optional alpha) in "colours" array, returns 0 on success
+    const char *position = strstr(text, "\"colours\"");
+    position = position != NULL ? strchr(position, '[') : NULL;
+    if (position == NULL)
+        return 1;
+    position++;
+    while (1) {
+        position += strspn(position, " \t\r\n,");
+        if (*position == ']')
+            return 0;
+        if (*position != '[')
+            return 1;
+        int values[4] = {0, 0, 0, 255}, count = 0;
+        position++;
+        while (1) {
+            position += strspn(position, " \t\r\n,");
+            if (*position == ']')
+                break;
+            char *end;
+            long value = strtol(position, &end, 10);
+            if (end == position || count == 4)
+                return 1;
+            values[count++] = (int)value;
+            position = end;
+        }
+        position++;
+        if (count < 3 || addPaletteColour(palette, capacity, values[0], values[1], values[2], values[3]) != 0)
+            return 1;
+    }
+}
+
+static inline int parseHexPalette(char *text, Palette *palette, int *capacity, const char *file_name){
+    //one colour per line as hex RRGGBB or RRGGBBAA (optional leading '#'), empty lines and lines starting with ';' are
+    //skipped; returns 0 on success
+    int line_number = 0;
+    for (char *line = text; line != NULL && *line != '\0'; ) {
+        char *next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = '\0';
+        line_number++;
+        line += strspn(line, " \t");
+        line[strcspn(line, "\r")] = '\0';
+        if (line[0] == '#')
+            line++;
+        if (line[0] != '\0' && line[0] != ';') {
+            size_t digits = strspn(line, "0123456789abcdefABCDEF");
+            unsigned int value = strtoul(line, NULL, 16);
+            if (digits == 6)
+                value = value << 8 | 255;
+            if ((digits != 6 && digits != 8) || (line[digits] != '\0' && line[digits] != ' ' && line[digits] != '\t') ||
+                addPaletteColour(palette, capacity, value >> 24, value >> 16 & 255, value >> 8 & 255, value & 255) != 0) {
+                fprintf(stderr, "Invalid colour on line %d of palette %s.\n", line_number, file_name);
+                return 1;
+            }
+        }
+        line = next;
+    }
+    return 0;
+}
+
+static inline int readPalette(const char *file_name, Palette *palette){
+    //reads palette in any format writePalette writes: binary, JSON or hex text, recognised by content; returns 0 on
+    //success
+    memset(palette, 0, sizeof(Palette));
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Can not open palette %s.\n", file_name);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *text = (char *)malloc(size + 1);
+    int failed = text == NULL || fread(text, 1, size, fp) != (size_t)size;
+    fclose(fp);
+    int capacity = 0;
+    if (!failed) {
+        text[size] = '\0';
+        int count;
+        char newline;
+        const char *start = text + strspn(text, " \t\r\n");
+        if (sscanf(text, PALETTE_MAGIC " %d%c", &count, &newline) == 2 && newline == '\n') {
+            // binary: header line and RGBA bytes of every colour
+            const unsigned char *bytes = (const unsigned char *)strchr(text, '\n') + 1;
+            failed = count <= 0 || bytes + (long)count * 4 > (const unsigned char *)text + size;
+            for (int i = 0; i < count && !failed; i++)
+                failed = addPaletteColour(palette, &capacity, bytes[i * 4], bytes[i * 4 + 1], bytes[i * 4 + 2], bytes[i * 4 + 3]);
+        } else if (*start == '{') {
+            failed = parseJsonPalette(start, palette, &capacity);
+        } else {
+            failed = parseHexPalette(text, palette, &capacity, file_name);
+        }
+        if (failed)
+            fprintf(stderr, "Invalid palette %s.\n", file_name);
+    }
+    free(text);
+    if (!failed && palette->num_colours == 0) {
+        fprintf(stderr, "Palette %s has no colours.\n", file_name);
+        failed = 1;
+    }
+    if (failed) {
+        free(palette->colours);
+        memset(palette, 0, sizeof(Palette));
+    }
+    return failed;
+}
+
+static inline int writePalette(const char *file_name, int *colours, int num_colours){
+    //writes colours in engine layout as binary palette for .bin, JSON for .json and hex text otherwise; returns 0 on
+    //success
+    const char *extension = strrchr(file_name, '.') != NULL ? strrchr(file_name, '.') : "";
+    FILE *fp = fopen(file_name, "wb");
+    if (!fp) {
+        fprintf(stderr, "Can not write palette %s.\n", file_name);
+        return 1;
+    }
+    int failed = 0;
+    if (strcmp(extension, ".bin") == 0) {
+        fprintf(fp, PALETTE_MAGIC " %d\n", num_colours);
+        for (int i = 0; i < num_colours && !failed; i++) {
+            unsigned char rgba[4] = {(unsigned char)colours[i * 4 + 2], (unsigned char)colours[i * 4 + 1], (unsigned char)colours[i * 4],
+                                     (unsigned char)colours[i * 4 + 3]};
+            failed = fwrite(rgba, 1, 4, fp) != 4;
+        }
+    } else if (strcmp(extension, ".json") == 0) {
+        fprintf(fp, "{\"colours\": [");
+        for (int i = 0; i < num_colours; i++)
+            fprintf(fp, "%s\n  [%d, %d, %d, %d]", i > 0 ? "," : "", colours[i * 4 + 2], colours[i * 4 + 1], colours[i * 4], colours[i * 4 + 3]);
+        fprintf(fp, "\n]}\n");
+    } else {
+        for (int i = 0; i < num_colours; i++)
+            fprintf(fp, "#%02x%02x%02x%02x\n", colours[i * 4 + 2], colours[i * 4 + 1], colours[i * 4], colours[i * 4 + 3]);
+    }
+    failed |= fclose(fp) != 0;
+    if (failed)
+        fprintf(stderr, "Can not write palette %s.\n", file_name);
+    return failed;
+}
+
+static inline void freePalette(Palette *palette){
+    free(palette->colours);
+    memset(palette, 0, sizeof(Palette));
+}
+
+static inline int buildKdNodes(KdNode *nodes, int *num_nodes, int *colours, int *order, int count){
+    //builds subtree of colours in order[0, count) split at median of channel with largest spread, returns its node
+    if (count == 0)
+        return -1;
+    int split_channel = 0, largest_spread = -1;
+    for (int channel = 0; channel < 4; channel++) {
+        int minimum = INT_MAX, maximum = INT_MIN;
+        for (int i = 0; i < count; i++) {
+            minimum = std::min(minimum, colours[order[i] * 4 + channel]);
+            maximum = std::max(maximum, colours[order[i] * 4 + channel]);
+        }
+        if (maximum - minimum > largest_spread) {
+            largest_spread = maximum - minimum;
+            split_channel = channel;
+        }
+    }
+    std::sort(order, order + count, [colours, split_channel](int a, int b) {
+        return colours[a * 4 + split_channel] < colours[b * 4 + split_channel];
+    });
+    int median = count / 2;
+    int node = (*num_nodes)++;
+    nodes[node].colour = order[median];
+    nodes[node].split_channel = split_channel;
+    nodes[node].left = buildKdNodes(nodes, num_nodes, colours, order, median);
+    nodes[node].right = buildKdNodes(nodes, num_nodes, colours, order + median + 1, count - median - 1);
+    return node;
+}
+
+static inline void initPaletteLookup(PaletteLookup *lookup, Palette *palette){
+    memset(lookup, 0, sizeof(PaletteLookup));
+    lookup->palette = palette;
+    lookup->nodes = (KdNode *)malloc(palette->num_colours * sizeof(KdNode));
+    int *order = (int *)malloc(palette->num_colours * sizeof(int));
+    for (int i = 0; i < palette->num_colours; i++)
+        order[i] = i;
+    int num_nodes = 0;
+    buildKdNodes(lookup->nodes, &num_nodes, palette->colours, order, palette->num_colours);
+    free(order);
+    lookup->lut_alpha = -1;
+}
+
+static inline void preparePaletteLookup(PaletteLookup *lookup, int constant_alpha){
+    //called before every image with alpha all its pixels have (-1 if it differs), nearest colours found so far are
+    //kept while images have same alpha; table pages are only mapped when they are used
+    if (constant_alpha >= 0 && lookup->lut == NULL)
+        lookup->lut = (unsigned short *)calloc(PALETTE_LUT_SIZE, sizeof(unsigned short));
+    if (lookup->lut != NULL && constant_alpha >= 0 && constant_alpha != lookup->lut_alpha && lookup->lut_alpha >= 0)
+        memset(lookup->lut, 0, PALETTE_LUT_SIZE * sizeof(unsigned short));
+    lookup->lut_alpha = lookup->lut != NULL ? constant_alpha : -1;
+}
+
+static inline void searchKdTree(PaletteLookup *lookup, int node, unsigned char *pixel, int *best, int *best_distance){
+    //nearest colour in subtree, ties go to lower palette index like in linear search
+    if (node < 0)
+        return;
+    KdNode *kd = lookup->nodes + node;
+    int *colour = lookup->palette->colours + kd->colour * 4;
+    int distance = 0;
+    for (int channel = 0; channel < 4; channel++)
+        distance += (colour[channel] - pixel[channel]) * (colour[channel] - pixel[channel]);
+    if (distance < *best_distance || (distance == *best_distance && kd->colour < *best)) {
+        *best = kd->colour;
+        *best_distance = distance;
+    }
+    // near side first, far side only if splitting plane is not farther than best colour
+    int difference = pixel[kd->split_channel] - colour[kd->split_channel];
+    searchKdTree(lookup, difference < 0 ? kd->left : kd->right, pixel, best, best_distance);
+    if (difference * difference <= *best_distance)
+        searchKdTree(lookup, difference < 0 ? kd->right : kd->left, pixel, best, best_distance);
+}
+
+static inline int findPaletteColour(PaletteLookup *lookup, unsigned char *pixel){
+    //index of nearest palette colour, threads may search same colour at once, they store same value
+    unsigned short *entry = NULL;
+    if (lookup->lut_alpha >= 0) {
+        entry = lookup->lut + (pixel[0] | pixel[1] << 8 | pixel[2] << 16);
+        unsigned short found = __atomic_load_n(entry, __ATOMIC_RELAXED);
+        if (found != 0)
+            return found - 1;
+    }
+    int best = INT_MAX, best_distance = INT_MAX;
+    searchKdTree(lookup, 0, pixel, &best, &best_distance);
+    if (entry != NULL)
+        __atomic_store_n(entry, (unsigned short)(best + 1), __ATOMIC_RELAXED);
+    return best;
+}
+
+static inline void freePaletteLookup(PaletteLookup *lookup){
+    free(lookup->nodes);
+    free(lookup->lut);
+    memset(lookup, 0, sizeof(PaletteLookup));
+}
+
+#endif
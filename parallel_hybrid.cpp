@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstdlib>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include <CL/cl.h>
+#include "FreeImage.h"
+#include "opencl_utils.h"
+#include "args.h"
+
+#define MIN_DEVICE_RATIO 0.01
+#define MAX_DEVICE_RATIO 0.99
+
+void initCentroids(int *centroids, int num_of_clusters, unsigned char* imageIn, int imageSize){
+    int counter = 0;
+    //we use interval to select starting centroids from image, spreaded equally across
+    int interval = imageSize / num_of_clusters;
+    for(int i = 0; i < (num_of_clusters * 4); i = i + 4){
+        centroids[i] = imageIn[counter];
+        centroids[i + 1] = imageIn[counter+1];
+        centroids[i + 2] = imageIn[counter+2];
+        centroids[i + 3] = imageIn[counter+3];
+        counter = counter + (interval * 4);
+    }
+}
+
+void applyNewCentroidValue(int centroidIndex, int* centroids, long *centroids_sums){
+
+    // get sum of all colors for this centroid from centroids_sums
+    int blue = centroids_sums[centroidIndex*5];
+    int green = centroids_sums[centroidIndex*5 + 1];
+    int red = centroids_sums[centroidIndex*5 + 2];
+    int alpha = centroids_sums[centroidIndex*5 + 3];
+    int count = centroids_sums[centroidIndex*5 + 4];
+
+    // compute average for all non empty clusters
+    if(count > 0){
+        centroids[centroidIndex * 4] = blue / count;
+        centroids[centroidIndex * 4 + 1] = green / count;
+        centroids[centroidIndex * 4 + 2] = red / count;
+        centroids[centroidIndex * 4 + 3] = alpha / count;
+    }
+
+    // reset centroids_sums for next iteration
+    for (int i = 0; i < 5; i++)
+        centroids_sums[centroidIndex*5 + i] = 0;
+}
+
+int findClosestCentroid(int *centroids, int num_of_clusters, int blue, int green, int red, int alpha){
+    //squared distance picks same centroid as distance used by kernels, but without sqrt
+    int centroidIndex = 0;
+    int delta_blue = centroids[0] - blue;
+    int delta_green = centroids[1] - green;
+    int delta_red = centroids[2] - red;
+    int delta_alpha = centroids[3] - alpha;
+    int minimum_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+
+    for(int i = 4; i < (num_of_clusters * 4); i = i + 4){
+        delta_blue = centroids[i] - blue;
+        delta_green = centroids[i+1] - green;
+        delta_red = centroids[i+2] - red;
+        delta_alpha = centroids[i+3] - alpha;
+        int current_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+        if(current_distance < minimum_distance){
+            centroidIndex = i / 4;
+            minimum_distance = current_distance;
+        }
+    }
+    return centroidIndex;
+}
+
+long findClosestCentroidsHost(unsigned char *imageIn, int *centroids, int num_of_clusters, int first_point, int last_point,
+                              int *closest_centroid_indices, long *centroids_sums){
+    //host part of assignment, every thread sums to its own copy which are then merged to centroids_sums; returns number
+    //of pixels which changed centroid
+    long changed_pixels = 0;
+    #pragma omp parallel
+    {
+        long *thread_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+
+        #pragma omp for reduction(+:changed_pixels)
+        for(int point = first_point; point < last_point; point++){
+            int imageStartingPointIndex = point * 4;
+            int blue = imageIn[imageStartingPointIndex];
+            int green = imageIn[imageStartingPointIndex + 1];
+            int red = imageIn[imageStartingPointIndex + 2];
+            int alpha = imageIn[imageStartingPointIndex + 3];
+
+            int closest_centroid = findClosestCentroid(centroids, num_of_clusters, blue, green, red, alpha);
+            if (closest_centroid_indices[point] != closest_centroid)
+                changed_pixels++;
+            closest_centroid_indices[point] = closest_centroid;
+
+            thread_sums[closest_centroid*5] += blue;
+            thread_sums[closest_centroid*5 + 1] += green;
+            thread_sums[closest_centroid*5 + 2] += red;
+            thread_sums[closest_centroid*5 + 3] += alpha;
+            thread_sums[closest_centroid*5 + 4] += 1;
+        }
+
+        #pragma omp critical
+        for(int i = 0; i < num_of_clusters * 5; i++)
+            centroids_sums[i] += thread_sums[i];
+
+        free(thread_sums);
+    }
+    return changed_pixels;
+}
+
+void applyNewColoursToImage(unsigned char* image, int* closest_centroid_indices,  int size, int* centroids){
+    //for each pixel in image assign it new centroid colour
+    for(int i = 0; i < (size); i = i + 4){
+        //find colour centroid for this pixel
+        int closestCentroid = closest_centroid_indices[i/4];
+        //apply centroid colour to this pixel
+        image[i] = centroids[closestCentroid * 4];
+        image[i+1] = centroids[closestCentroid * 4 + 1];
+        image[i+2] = centroids[closestCentroid * 4 + 2];
+        image[i+3] = centroids[closestCentroid * 4 + 3];
+    }
+}
+
+double rebalanceDeviceRatio(double device_ratio, int device_pixels, double device_time, int host_pixels, double host_time){
+    //new ratio gives both sides time proportional to their measured throughput, averaged with old ratio to damp oscillations
+    if (device_pixels == 0 || host_pixels == 0 || device_time <= 0 || host_time <= 0)
+        return device_ratio;
+    double device_throughput = device_pixels / device_time;
+    double host_throughput = host_pixels / host_time;
+    double balanced_ratio = device_throughput / (device_throughput + host_throughput);
+    double new_ratio = (device_ratio + balanced_ratio) / 2;
+    if (new_ratio < MIN_DEVICE_RATIO)
+        new_ratio = MIN_DEVICE_RATIO;
+    if (new_ratio > MAX_DEVICE_RATIO)
+        new_ratio = MAX_DEVICE_RATIO;
+    return new_ratio;
+}
+
+typedef struct {
+    cl_context context;
+    cl_command_queue command_queue;
+    cl_program program;
+    cl_kernel kernel_find_closest_centroids;
+    cl_mem centroids_d;
+    cl_mem centroids_sums_d;
+    cl_mem closest_centroid_indices_d;
+    cl_mem image_in_d;
+    cl_mem changed_pixels_d;
+    int iteration_arg_index;
+} DeviceObjects;
+
+int releaseDeviceObjects(DeviceObjects *objects){
+    //releases everything that was created, always returns 1 so it can be returned on failure
+    if (objects->command_queue != NULL)
+        clFinish(objects->command_queue);
+    if (objects->kernel_find_closest_centroids != NULL)
+        clReleaseKernel(objects->kernel_find_closest_centroids);
+    if (objects->program != NULL)
+        clReleaseProgram(objects->program);
+    if (objects->centroids_d != NULL)
+        clReleaseMemObject(objects->centroids_d);
+    if (objects->centroids_sums_d != NULL)
+        clReleaseMemObject(objects->centroids_sums_d);
+    if (objects->closest_centroid_indices_d != NULL)
+        clReleaseMemObject(objects->closest_centroid_indices_d);
+    if (objects->image_in_d != NULL)
+        clReleaseMemObject(objects->image_in_d);
+    if (objects->changed_pixels_d != NULL)
+        clReleaseMemObject(objects->changed_pixels_d);
+    if (objects->command_queue != NULL)
+        clReleaseCommandQueue(objects->command_queue);
+    if (objects->context != NULL)
+        clReleaseContext(objects->context);
+    memset(objects, 0, sizeof(DeviceObjects));
+    return 1;
+}
+
+int setupDevice(DeviceObjects *objects, cl_device_type device_type, const char *device_name_filter, unsigned char *imageIn,
+                int num_pixels, int num_of_clusters, int num_of_iterations){
+    //creates everything device part needs, returns 0 on success and 1 (with everything released) on failure
+    cl_int clStatus;
+    memset(objects, 0, sizeof(DeviceObjects));
+
+    // Read kernel from file
+    char *source_str = readKernelSource("kernels.cl");
+    if (source_str == NULL)
+        return 1;
+
+    // Select device by type and name
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_uint num_devices = 0;
+    clStatus = selectDevices(device_type, device_name_filter, 1, &platform, &device, &num_devices);
+    if (clStatus != CL_SUCCESS) {
+        fprintf(stderr, "No suitable OpenCL device found (%s).\n", getErrorString(clStatus));
+        free(source_str);
+        return 1;
+    }
+
+    // Context
+    objects->context = clCreateContext(NULL, 1, &device, NULL, NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateContext")) {
+        free(source_str);
+        return releaseDeviceObjects(objects);
+    }
+
+    // Command queue, profiling gives device time of each iteration for rebalancing
+    objects->command_queue = clCreateCommandQueue(objects->context, device, CL_QUEUE_PROFILING_ENABLE, &clStatus);
+    if (checkStatus(clStatus, "clCreateCommandQueue")) {
+        free(source_str);
+        return releaseDeviceObjects(objects);
+    }
+
+    // Create and build a program
+    clStatus = buildProgram(objects->context, 1, &device, source_str, &objects->program);
+    free(source_str);
+    if (clStatus != CL_SUCCESS)
+        return releaseDeviceObjects(objects);
+
+    // Allocate memory on device, whole image is copied once since the split moves between iterations
+    cl_int buffers_status;
+    objects->centroids_d = clCreateBuffer(objects->context, CL_MEM_READ_WRITE, num_of_clusters * 4 * sizeof(int), NULL, &clStatus);
+    buffers_status = clStatus;
+    objects->centroids_sums_d = clCreateBuffer(objects->context, CL_MEM_READ_WRITE, num_of_clusters * 5 * sizeof(long), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    objects->closest_centroid_indices_d = clCreateBuffer(objects->context, CL_MEM_READ_WRITE, num_pixels * sizeof(int), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    objects->image_in_d = clCreateBuffer(objects->context, CL_MEM_READ_ONLY, num_pixels * 4 * sizeof(unsigned char), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    objects->changed_pixels_d = clCreateBuffer(objects->context, CL_MEM_READ_WRITE, num_of_iterations * sizeof(int), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    if (checkStatus(buffers_status, "clCreateBuffer"))
+        return releaseDeviceObjects(objects);
+
+    // No pixel has centroid yet, same as on host, so first iteration counts all of them as changed
+    clStatus = clEnqueueWriteBuffer(objects->command_queue, objects->image_in_d, CL_TRUE, 0, num_pixels * 4 * sizeof(unsigned char), imageIn, 0, NULL, NULL);
+    int init_zero_changed = 0;
+    int init_no_centroid = -1;
+    clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(objects->command_queue, objects->changed_pixels_d, &init_zero_changed, sizeof(int), 0, num_of_iterations * sizeof(int), 0, NULL, NULL));
+    clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(objects->command_queue, objects->closest_centroid_indices_d, &init_no_centroid, sizeof(int), 0, num_pixels * sizeof(int), 0, NULL, NULL));
+    clStatus = keepFirstError(clStatus, clFinish(objects->command_queue));
+    if (checkStatus(clStatus, "transfer to device"))
+        return releaseDeviceObjects(objects);
+
+    // Sums are reduced in local memory (version 3) when they fit there, otherwise with global atomics (version 2)
+    cl_ulong local_mem_size = 0;
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
+    int use_local_sums = num_of_clusters * 5 * sizeof(int) <= local_mem_size;
+    int device_pixels = 0;
+    int arg = 0;
+    objects->kernel_find_closest_centroids = clCreateKernel(objects->program, use_local_sums ? "find_closest_centroids_3" : "find_closest_centroids_2", &clStatus);
+    if (checkStatus(clStatus, "clCreateKernel"))
+        return releaseDeviceObjects(objects);
+    cl_kernel kernel = objects->kernel_find_closest_centroids;
+    clStatus = clSetKernelArg(kernel, arg++, sizeof(int), (void *)&num_of_clusters);
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(int), (void *)&device_pixels));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&objects->centroids_d));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&objects->centroids_sums_d));
+    if (use_local_sums)
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, num_of_clusters * 5 * sizeof(int), NULL));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&objects->closest_centroid_indices_d));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&objects->image_in_d));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&objects->changed_pixels_d));
+    objects->iteration_arg_index = arg;
+    if (checkStatus(clStatus, "clSetKernelArg"))
+        return releaseDeviceObjects(objects);
+
+    char device_name[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    printf("device:%s\n", device_name);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (getOption(argc, argv, "list-devices") != NULL) {
+        printDevices();
+        return 0;
+    }
+
+    //1st argument is image name including format, 2nd number of clusters and 3rd number of iterations
+    const char *image_name = getPositionalArg(argc, argv, 1);
+    const char *clusters_arg = getPositionalArg(argc, argv, 2);
+    const char *iterations_arg = getPositionalArg(argc, argv, 3);
+    if (iterations_arg == NULL) {
+        fprintf(stderr, "Usage: %s <image> <clusters> <iterations> [options]\n", argv[0]);
+        exit(1);
+    }
+
+    //Load image from file
+	FIBITMAP *imageLoad = FreeImage_Load(FIF_PNG, image_name, 0);
+    if (imageLoad == NULL) {
+        fprintf(stderr, "Can not load image %s.\n", image_name);
+        exit(1);
+    }
+	//Convert it to a 32-bit image
+    FIBITMAP *imageLoad32 = FreeImage_ConvertTo32Bits(imageLoad);
+
+    //Get image dimensions
+    int width = FreeImage_GetWidth(imageLoad32);
+	int height = FreeImage_GetHeight(imageLoad32);
+	int pitch = FreeImage_GetPitch(imageLoad32);
+    int num_pixels = width * height;
+
+	//Prepare room for a raw data copy of the image
+    unsigned char *imageIn = (unsigned char *)malloc(height*pitch * sizeof(unsigned char));
+
+    //Extract raw data from the image
+	FreeImage_ConvertToRawBits(imageIn, imageLoad32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+
+    //Free source image data free
+	FreeImage_Unload(imageLoad32);
+	FreeImage_Unload(imageLoad);
+
+    //get number of clusters from 2nd argument and num of iterations from 3rd argument
+    int num_of_clusters = atoi(clusters_arg);
+    int num_of_iterations = atoi(iterations_arg);
+
+    // Options: --ratio=<r> initial share of pixels for device (rebalanced every iteration unless --fixed-ratio), --local-size=<n>
+    double device_ratio = 0.5;
+    const char *ratio_arg = getOption(argc, argv, "ratio");
+    if (ratio_arg != NULL)
+        device_ratio = atof(ratio_arg);
+    //device always gets some share so that split can be rebalanced and host always keeps some
+    if (device_ratio < MIN_DEVICE_RATIO)
+        device_ratio = MIN_DEVICE_RATIO;
+    if (device_ratio > MAX_DEVICE_RATIO)
+        device_ratio = MAX_DEVICE_RATIO;
+    int rebalance = getOption(argc, argv, "fixed-ratio") == NULL;
+    size_t local_size = 256;
+    const char *local_size_arg = getOption(argc, argv, "local-size");
+    if (local_size_arg != NULL)
+        local_size = atoi(local_size_arg);
+
+    // Device options: --device-type=gpu|cpu|accelerator|default|all (gpu if not given), --device-name=<part of name>,
+    // --no-fallback exits instead of running on OpenMP threads only when no device can be used
+    cl_device_type device_type = parseDeviceType(getOption(argc, argv, "device-type"));
+    if (device_type == 0) {
+        fprintf(stderr, "Unknown device type %s, use gpu, cpu, accelerator, default or all.\n", getOption(argc, argv, "device-type"));
+        exit(1);
+    }
+    const char *device_name_filter = getOption(argc, argv, "device-name");
+    int fallback = getOption(argc, argv, "no-fallback") == NULL;
+
+    //centroid init array
+    int *centroids = (int*)malloc(num_of_clusters * 4 * sizeof(int));
+    initCentroids(centroids, num_of_clusters, imageIn, width * height);
+
+    //init arrays for keeping centroid sums of host and device part
+    long *centroids_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+    long *device_centroids_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+
+    //init array for keeping indices of closest centroid, -1 means pixel has no centroid yet
+    int *closest_centroid_indices = (int*)malloc(width * height * sizeof(int));
+    for (int point = 0; point < num_pixels; point++)
+        closest_centroid_indices[point] = -1;
+
+    // Device part, without usable OpenCL device all pixels go to host threads
+    DeviceObjects device;
+    int device_available = setupDevice(&device, device_type, device_name_filter, imageIn, num_pixels, num_of_clusters, num_of_iterations) == 0;
+    if (!device_available) {
+        if (!fallback)
+            exit(1);
+        fprintf(stderr, "Falling back to OpenMP.\n");
+        device_ratio = 0;
+    }
+
+    printf("%s clusters:%s threads:%d ratio:%.3f\n", image_name, clusters_arg, omp_get_max_threads(), device_ratio);
+
+    cl_int clStatus;
+    long init_zero = 0;
+    int device_pixels = 0;
+    int previous_device_pixels = 0;
+    int converged_iteration = -1;
+    for (int iteration = 0; iteration < (num_of_iterations); iteration++) {
+
+        // Start measuring time
+        struct timespec clock_start, clock_end, host_start, host_end;
+        clock_gettime(CLOCK_MONOTONIC, &clock_start);
+
+        // Device gets first part of pixels, host the rest
+        device_pixels = device_available ? (int)(device_ratio * num_pixels) : 0;
+        int host_pixels = num_pixels - device_pixels;
+
+        // Step 1a: device finds closest centroids for its part, sums and count of changed pixels are read back without waiting.
+        // Indices of pixels which moved between device and host since last iteration are copied first, so both sides
+        // count changes against centroid pixel had in last iteration
+        cl_event write_event = NULL, read_event = NULL, indices_event = NULL;
+        int device_failed = 0;
+        int device_changed_pixels = 0;
+        if (device_available) {
+            clStatus = CL_SUCCESS;
+            if (device_pixels > previous_device_pixels)
+                clStatus = keepFirstError(clStatus, clEnqueueWriteBuffer(device.command_queue, device.closest_centroid_indices_d, CL_FALSE, previous_device_pixels * sizeof(int),
+                                                                         (device_pixels - previous_device_pixels) * sizeof(int), closest_centroid_indices + previous_device_pixels, 0, NULL, NULL));
+            else if (device_pixels < previous_device_pixels)
+                clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(device.command_queue, device.closest_centroid_indices_d, CL_FALSE, device_pixels * sizeof(int),
+                                                                        (previous_device_pixels - device_pixels) * sizeof(int), closest_centroid_indices + device_pixels, 0, NULL, &indices_event));
+            // nothing is enqueued for centroids when device has no pixels, as only read of sums is waited for
+            if (device_pixels > 0) {
+                clStatus = keepFirstError(clStatus, clEnqueueWriteBuffer(device.command_queue, device.centroids_d, CL_FALSE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, &write_event));
+                clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(device.command_queue, device.centroids_sums_d, &init_zero, sizeof(long), 0, num_of_clusters * 5 * sizeof(long), 0, NULL, NULL));
+                size_t global_size_pixels = roundUpToLocalSize(device_pixels, local_size);
+                clStatus = keepFirstError(clStatus, clSetKernelArg(device.kernel_find_closest_centroids, 1, sizeof(int), (void *)&device_pixels));
+                clStatus = keepFirstError(clStatus, clSetKernelArg(device.kernel_find_closest_centroids, device.iteration_arg_index, sizeof(int), (void *)&iteration));
+                clStatus = keepFirstError(clStatus, clEnqueueNDRangeKernel(device.command_queue, device.kernel_find_closest_centroids, 1, NULL, &global_size_pixels, &local_size, 0, NULL, NULL));
+                clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(device.command_queue, device.changed_pixels_d, CL_FALSE, iteration * sizeof(int), sizeof(int), &device_changed_pixels, 0, NULL, NULL));
+                clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(device.command_queue, device.centroids_sums_d, CL_FALSE, 0, num_of_clusters * 5 * sizeof(long), device_centroids_sums, 0, NULL, &read_event));
+            }
+            clStatus = keepFirstError(clStatus, clFlush(device.command_queue));
+            // host part can start only once indices it took over from device are back
+            if (indices_event != NULL)
+                clStatus = keepFirstError(clStatus, clWaitForEvents(1, &indices_event));
+            if (checkStatus(clStatus, "device iteration")) {
+                // commands which were enqueued may still read centroids, so they are drained before host changes them
+                clFinish(device.command_queue);
+                device_failed = 1;
+                device_pixels = 0;
+            }
+        }
+
+        // Step 1b: meanwhile host threads do the rest
+        clock_gettime(CLOCK_MONOTONIC, &host_start);
+        long changed_pixels = findClosestCentroidsHost(imageIn, centroids, num_of_clusters, device_pixels, num_pixels, closest_centroid_indices, centroids_sums);
+        clock_gettime(CLOCK_MONOTONIC, &host_end);
+
+        // Step 2: merge partial sums and compute new centroids
+        if (device_pixels > 0 && checkStatus(clWaitForEvents(1, &read_event), "clWaitForEvents")) {
+            // Device part failed, host redoes it and device is not used anymore
+            findClosestCentroidsHost(imageIn, centroids, num_of_clusters, 0, device_pixels, closest_centroid_indices, centroids_sums);
+            device_failed = 1;
+            device_pixels = 0;
+        }
+        if (device_pixels > 0) {
+            for (int i = 0; i < num_of_clusters * 5; i++)
+                centroids_sums[i] += device_centroids_sums[i];
+            changed_pixels += device_changed_pixels;
+        }
+        for(int centroid = 0; centroid < (num_of_clusters); centroid++){
+            applyNewCentroidValue(centroid, centroids, centroids_sums);
+        }
+
+        // Stop measuring time
+        clock_gettime(CLOCK_MONOTONIC, &clock_end);
+        long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+        printf("%.4f %.3f\n", nanosecs/(1000.0*1000.0), (double)device_pixels / num_pixels);
+
+        // Step 3: move split according to measured throughput (device time from write of centroids to end of sums read)
+        if (device_failed) {
+            fprintf(stderr, "Device failed, continuing on OpenMP threads only.\n");
+            releaseDeviceObjects(&device);
+            device_available = 0;
+        }
+        else if (device_pixels > 0) {
+            cl_ulong device_start, device_end;
+            clStatus = clGetEventProfilingInfo(write_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &device_start, NULL);
+            clStatus = keepFirstError(clStatus, clGetEventProfilingInfo(read_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &device_end, NULL));
+            long host_nanosecs = ((((host_end.tv_sec - host_start.tv_sec)*1000*1000*1000) + host_end.tv_nsec) - (host_start.tv_nsec));
+            if (rebalance && clStatus == CL_SUCCESS)
+                device_ratio = rebalanceDeviceRatio(device_ratio, device_pixels, (double)(device_end - device_start), host_pixels, (double)host_nanosecs);
+        }
+        if (write_event != NULL)
+            clReleaseEvent(write_event);
+        if (read_event != NULL)
+            clReleaseEvent(read_event);
+        if (indices_event != NULL)
+            clReleaseEvent(indices_event);
+        previous_device_pixels = device_pixels;
+
+        // Stop once no pixel changed centroid, unless host had to redo part of device whose indices it did not have
+        if (!device_failed && changed_pixels == 0) {
+            converged_iteration = iteration;
+            break;
+        }
+    }
+    if (converged_iteration >= 0)
+        printf("converged in iteration %d\n", converged_iteration + 1);
+
+    // Copy device part of indices back to host, it is the part from last iteration
+    if (device_available) {
+        clStatus = clEnqueueReadBuffer(device.command_queue, device.closest_centroid_indices_d, CL_TRUE, 0, device_pixels * sizeof(int), closest_centroid_indices, 0, NULL, NULL);
+        if (checkStatus(clStatus, "clEnqueueReadBuffer")) {
+            // Indices are recomputed on host from final centroids, sums of this pass are not needed
+            findClosestCentroidsHost(imageIn, centroids, num_of_clusters, 0, device_pixels, closest_centroid_indices, centroids_sums);
+        }
+        releaseDeviceObjects(&device);
+    }
+
+    //apply new colours to input image
+    applyNewColoursToImage(imageIn, closest_centroid_indices, pitch*height, centroids);
+
+    // Save image
+	FIBITMAP *imageOutBitmap = FreeImage_ConvertFromRawBits(imageIn, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+	FreeImage_Save(FIF_PNG, imageOutBitmap, "output/test_hybrid.png", 0);
+	FreeImage_Unload(imageOutBitmap);
+}
@@ -4,10 +4,15 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <omp.h>
 #include <CL/cl.h>
 #include "FreeImage.h"
+#include "opencl_utils.h"
+#include "args.h"
 
-#define MAX_SOURCE_SIZE	(16384)
+#define TUNING_FILE "opencl_tuning.txt"
+#define TUNING_SAMPLE_PIXELS (1 << 20)
+#define TUNING_ITERATIONS 3
 
 void printImage(unsigned char *image, int size){
     //helper function for debugging purposes
@@ -58,236 +63,775 @@ void printClockResolution() {
     printf( "Resolution is %ld nano seconds.\n", res.tv_nsec );
 }
 
-int main(int argc, char *argv[]) {
+int getIterationArgIndex(int parallel_ver){
+    //iteration (index of changed pixels counter) is last argument of find closest centroids kernels
+    if (parallel_ver == 1)
+        return 6;
+    if (parallel_ver == 2)
+        return 7;
+    return 8;
+}
 
-    //Load image from file
-    //1st argument is image name including format
-	FIBITMAP *imageLoad = FreeImage_Load(FIF_PNG, argv[1], 0);
-	//Convert it to a 32-bit image
-    FIBITMAP *imageLoad32 = FreeImage_ConvertTo32Bits(imageLoad);
-	
-    //Get image dimensions
-    int width = FreeImage_GetWidth(imageLoad32);
-	int height = FreeImage_GetHeight(imageLoad32);
-	int pitch = FreeImage_GetPitch(imageLoad32);
-    int num_pixels = width * height;
+cl_int createKernels(cl_program program, int parallel_ver, int num_of_clusters, int num_pixels, cl_mem centroids_d, cl_mem centroids_sums_d,
+                   cl_mem closest_centroid_indices_d, cl_mem image_in_d, cl_mem changed_pixels_d,
+                   cl_kernel *kernel_find_closest_centroids_out, cl_kernel *kernel_update_centroids_out){
+    //returns CL_SUCCESS if all kernels were created and all arguments set, created kernels are returned also on failure so they can be released
+    cl_int clStatus;
+    cl_int kernels_status = CL_SUCCESS;
+    int iteration = 0;
+    cl_kernel kernel_find_closest_centroids = NULL, kernel_update_centroids = NULL;
 
-	//Prepare room for a raw data copy of the image
-    unsigned char *imageIn = (unsigned char *)malloc(height*pitch * sizeof(unsigned char));
+    if (parallel_ver == 1) {
+        kernel_find_closest_centroids = clCreateKernel(program, "find_closest_centroids", &clStatus);
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 0, sizeof(int), (void *)&num_of_clusters));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 1, sizeof(int), (void *)&num_pixels));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 2, sizeof(cl_mem), (void *)&centroids_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 3, sizeof(cl_mem), (void *)&closest_centroid_indices_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 4, sizeof(cl_mem), (void *)&image_in_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 5, sizeof(cl_mem), (void *)&changed_pixels_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 6, sizeof(int), (void *)&iteration));
+        kernels_status = keepFirstError(kernels_status, clStatus);
 
-    //Extract raw data from the image
-	FreeImage_ConvertToRawBits(imageIn, imageLoad32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+        kernel_update_centroids = clCreateKernel(program, "update_centroids", &clStatus);
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 0, sizeof(int), (void *)&num_of_clusters));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 1, sizeof(int), (void *)&num_pixels));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 2, sizeof(cl_mem), (void *)&centroids_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 3, sizeof(cl_mem), (void *)&closest_centroid_indices_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 4, sizeof(cl_mem), (void *)&image_in_d));
+        kernels_status = keepFirstError(kernels_status, clStatus);
+    }
 
-    //Free source image data free
-	FreeImage_Unload(imageLoad32);
-	FreeImage_Unload(imageLoad);
+    else if (parallel_ver == 2) {
+        kernel_find_closest_centroids = clCreateKernel(program, "find_closest_centroids_2", &clStatus);
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 0, sizeof(int), (void *)&num_of_clusters));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 1, sizeof(int), (void *)&num_pixels));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 2, sizeof(cl_mem), (void *)&centroids_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 3, sizeof(cl_mem), (void *)&centroids_sums_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 4, sizeof(cl_mem), (void *)&closest_centroid_indices_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 5, sizeof(cl_mem), (void *)&image_in_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 6, sizeof(cl_mem), (void *)&changed_pixels_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 7, sizeof(int), (void *)&iteration));
+        kernels_status = keepFirstError(kernels_status, clStatus);
 
-    //get number of clusters from 2nd argument and num of iterations from 3rd argument
-    int num_of_clusters = atoi(argv[2]);
-    int num_of_iterations = atoi(argv[3]);
+        kernel_update_centroids = clCreateKernel(program, "update_centroids_2", &clStatus);
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 0, sizeof(int), (void *)&num_of_clusters));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 1, sizeof(cl_mem), (void *)&centroids_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 2, sizeof(cl_mem), (void *)&centroids_sums_d));
+        kernels_status = keepFirstError(kernels_status, clStatus);
+    }
 
-    // Get version (of parallel opencl implementation) from optional 4th argument
-    int parallel_ver = 3;
-    if (argc > 4)
-        parallel_ver = atoi(argv[4]);
+    else if (parallel_ver == 3) {
+        kernel_find_closest_centroids = clCreateKernel(program, "find_closest_centroids_3", &clStatus);
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 0, sizeof(int), (void *)&num_of_clusters));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 1, sizeof(int), (void *)&num_pixels));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 2, sizeof(cl_mem), (void *)&centroids_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 3, sizeof(cl_mem), (void *)&centroids_sums_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 4, num_of_clusters * 5 * sizeof(int), NULL));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 5, sizeof(cl_mem), (void *)&closest_centroid_indices_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 6, sizeof(cl_mem), (void *)&image_in_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 7, sizeof(cl_mem), (void *)&changed_pixels_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, 8, sizeof(int), (void *)&iteration));
+        kernels_status = keepFirstError(kernels_status, clStatus);
 
-    // Get local size from optional 5th argument (default is 256)
-    size_t local_size = 256;
-    if (argc > 5)
-        local_size = atoi(argv[5]);
+        kernel_update_centroids = clCreateKernel(program, "update_centroids_2", &clStatus);
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 0, sizeof(int), (void *)&num_of_clusters));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 1, sizeof(cl_mem), (void *)&centroids_d));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_update_centroids, 2, sizeof(cl_mem), (void *)&centroids_sums_d));
+        kernels_status = keepFirstError(kernels_status, clStatus);
+    }
 
-    //centroid init array
-    int *centroids = (int*)malloc(num_of_clusters * 4 * sizeof(int));
-    initCentroids(centroids, num_of_clusters, imageIn, width * height);
+    *kernel_find_closest_centroids_out = kernel_find_closest_centroids;
+    *kernel_update_centroids_out = kernel_update_centroids;
+    if (parallel_ver < 1 || parallel_ver > 3)
+        kernels_status = CL_INVALID_KERNEL_NAME;
+    checkStatus(kernels_status, "clCreateKernel/clSetKernelArg");
+    return kernels_status;
+}
 
-    //init array for keeping indices of closest centroid
-    int *closest_centroid_indices = (int*)malloc(width * height * sizeof(int));
 
+double runIterations(cl_command_queue command_queue, cl_kernel kernel_find_closest_centroids, cl_kernel kernel_update_centroids,
+                     size_t global_size_pixels, size_t global_size_clusters, size_t local_size, int num_of_iterations){
+    //runs iterations same way as main loop and returns time of the fastest one in ms, -1 if configuration can not run
+    double best_time = -1;
+    for (int iteration = 0; iteration < num_of_iterations; iteration++) {
+        struct timespec clock_start, clock_end;
+        clock_gettime(CLOCK_MONOTONIC, &clock_start);
 
-    cl_int clStatus;
-	int n_pixels = height * width;
+        cl_int clStatus = clEnqueueNDRangeKernel(command_queue, kernel_find_closest_centroids, 1, NULL, &global_size_pixels, &local_size, 0, NULL, NULL);
+        clStatus = keepFirstError(clStatus, clEnqueueNDRangeKernel(command_queue, kernel_update_centroids, 1, NULL, &global_size_clusters, &local_size, 0, NULL, NULL));
+        clStatus = keepFirstError(clStatus, clFinish(command_queue));
+        if (clStatus != CL_SUCCESS)
+            return -1;
 
-    // Read kernel from file
-    FILE *fp;
-    char *source_str;
-    size_t source_size;
+        clock_gettime(CLOCK_MONOTONIC, &clock_end);
+        long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+        double time = nanosecs/(1000.0*1000.0);
+        if (best_time < 0 || time < best_time)
+            best_time = time;
+    }
+    return best_time;
+}
 
-    fp = fopen("kernels.cl", "r");
-    if (!fp) {
-		fprintf(stderr, "Open file error.\n");
-        exit(1);
+void getDeviceTuningName(cl_device_id device, char *device_name, size_t size){
+    //device name is used as key in tuning file, so whitespace is replaced
+    device_name[0] = '\0';
+    clGetDeviceInfo(device, CL_DEVICE_NAME, size, device_name, NULL);
+    device_name[size - 1] = '\0';
+    for (char *c = device_name; *c != '\0'; c++) {
+        if (*c == ' ' || *c == '\t' || *c == '\n')
+            *c = '_';
+    }
+}
+
+int getClustersRange(int num_of_clusters){
+    //tuning results are shared between all numbers of clusters up to next power of two
+    int clusters_range = 1;
+    while (clusters_range < num_of_clusters)
+        clusters_range *= 2;
+    return clusters_range;
+}
+
+int readTuning(const char *tuning_file, const char *device_name, int clusters_range, int parallel_ver, size_t *local_size, double *time){
+    //tuning file has one line per device, clusters range and version: <device> <clusters range> <version> <local size> <ms per iteration>
+    //local size 0 means that version can not run on this device
+    FILE *fp = fopen(tuning_file, "r");
+    if (!fp)
+        return 0;
+
+    int found = 0;
+    char line[512], line_device[256];
+    int line_range, line_ver;
+    size_t line_local_size;
+    double line_time;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%255s %d %d %zu %lf", line_device, &line_range, &line_ver, &line_local_size, &line_time) != 5)
+            continue;
+        if (strcmp(line_device, device_name) == 0 && line_range == clusters_range && line_ver == parallel_ver) {
+            *local_size = line_local_size;
+            *time = line_time;
+            found = 1;
+        }
     }
-    source_str = (char*)malloc(MAX_SOURCE_SIZE);
-    source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
-	source_str[source_size] = '\0';
     fclose(fp);
- 
-    // Get platforms
-    cl_uint num_platforms;
-    clStatus = clGetPlatformIDs(0, NULL, &num_platforms);
-    cl_platform_id *platforms = (cl_platform_id *)malloc(sizeof(cl_platform_id)*num_platforms);
-    clStatus = clGetPlatformIDs(num_platforms, platforms, NULL);
-
-    if (num_platforms == 0) {
-        fprintf(stderr, "No cl platforms. Is GPU available?\n");
-        exit(1);
+    return found;
+}
+
+void writeTuning(const char *tuning_file, const char *device_name, int clusters_range, int parallel_ver, size_t local_size, double time){
+    //keep all other entries and replace the one for this device, clusters range and version
+    char **lines = NULL;
+    int num_lines = 0;
+    char line[512], line_device[256];
+    int line_range, line_ver;
+
+    FILE *fp = fopen(tuning_file, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (sscanf(line, "%255s %d %d", line_device, &line_range, &line_ver) == 3
+                && strcmp(line_device, device_name) == 0 && line_range == clusters_range && line_ver == parallel_ver)
+                continue;
+            lines = (char **)realloc(lines, (num_lines + 1) * sizeof(char *));
+            lines[num_lines++] = strdup(line);
+        }
+        fclose(fp);
     }
 
-    // Get platform devices
-    cl_uint num_devices;
-    clStatus = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, NULL, &num_devices);
-    num_devices = 1; // limit to one device
-    cl_device_id *devices = (cl_device_id *)malloc(sizeof(cl_device_id)*num_devices);
-    clStatus = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, num_devices, devices, NULL);
+    fp = fopen(tuning_file, "w");
+    if (!fp) {
+        fprintf(stderr, "Can not write tuning file %s.\n", tuning_file);
+    } else {
+        for (int i = 0; i < num_lines; i++)
+            fputs(lines[i], fp);
+        fprintf(fp, "%s %d %d %zu %.4f\n", device_name, clusters_range, parallel_ver, local_size, time);
+        fclose(fp);
+    }
 
-    // Context
-    cl_context context = clCreateContext(NULL, num_devices, devices, NULL, NULL, &clStatus);
- 
-    // Command queue
-    cl_command_queue command_queue = clCreateCommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE, &clStatus);
+    for (int i = 0; i < num_lines; i++)
+        free(lines[i]);
+    free(lines);
+}
 
-    // Create and build a program
-    cl_program program = clCreateProgramWithSource(context,	1, (const char **)&source_str, NULL, &clStatus);
-    clStatus = clBuildProgram(program, 1, devices, NULL, NULL, NULL);
-
-	// Build log for kernel debugging
-	size_t build_log_len;
-	char *build_log;
-	clStatus = clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 0, NULL, &build_log_len);
-    if (build_log_len > 2) {
-        build_log =(char *)malloc(sizeof(char)*(build_log_len+1));
-        clStatus = clGetProgramBuildInfo(program, devices[0], CL_PROGRAM_BUILD_LOG, 
-                                        build_log_len, build_log, NULL);
-        printf("%s", build_log);
-        free(build_log);
+int fitsLocalMemory(cl_device_id device, int parallel_ver, int num_of_clusters){
+    //version 3 keeps sums of all clusters in local memory
+    cl_ulong local_mem_size = 0;
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
+    return parallel_ver != 3 || num_of_clusters * 5 * sizeof(int) <= local_mem_size;
+}
+
+size_t tuneLocalSize(cl_program program, cl_device_id device, cl_command_queue command_queue, int parallel_ver, int num_of_clusters, int num_pixels,
+                     int *centroids, cl_mem centroids_d, cl_mem centroids_sums_d, cl_mem closest_centroid_indices_d, cl_mem image_in_d,
+                     cl_mem changed_pixels_d, size_t *local_sizes, int num_local_sizes, double *best_time){
+    //benchmark version with all given local sizes on a sample of image and return the fastest one (0 if version can not run)
+    size_t best_local_size = 0;
+    *best_time = -1;
+    if (!fitsLocalMemory(device, parallel_ver, num_of_clusters))
+        return 0;
+
+    int num_sample_pixels = num_pixels < TUNING_SAMPLE_PIXELS ? num_pixels : TUNING_SAMPLE_PIXELS;
+    cl_kernel kernel_find_closest_centroids, kernel_update_centroids;
+    cl_int clStatus = createKernels(program, parallel_ver, num_of_clusters, num_sample_pixels, centroids_d, centroids_sums_d,
+                                    closest_centroid_indices_d, image_in_d, changed_pixels_d, &kernel_find_closest_centroids, &kernel_update_centroids);
+
+    if (clStatus == CL_SUCCESS) {
+        // Largest work group size supported by both kernels
+        size_t max_work_group_size = 0, kernel_work_group_size = 0;
+        clGetKernelWorkGroupInfo(kernel_find_closest_centroids, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_work_group_size, NULL);
+        clGetKernelWorkGroupInfo(kernel_update_centroids, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernel_work_group_size, NULL);
+        if (kernel_work_group_size < max_work_group_size)
+            max_work_group_size = kernel_work_group_size;
+
+        long init_zero = 0;
+        for (int i = 0; i < num_local_sizes; i++) {
+            size_t local_size = local_sizes[i];
+            if (local_size > max_work_group_size)
+                continue;
+
+            // Every configuration starts from the same centroids
+            clStatus = clEnqueueWriteBuffer(command_queue, centroids_d, CL_TRUE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, NULL);
+            clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(command_queue, centroids_sums_d, &init_zero, sizeof(long), 0, num_of_clusters * 5 * sizeof(long), 0, NULL, NULL));
+            if (checkStatus(clStatus, "clEnqueueWriteBuffer/clEnqueueFillBuffer"))
+                break;
+
+            size_t global_size_pixels = roundUpToLocalSize(num_sample_pixels, local_size);
+            size_t global_size_clusters = roundUpToLocalSize(num_of_clusters, local_size);
+            // First iteration is warmup
+            double time = runIterations(command_queue, kernel_find_closest_centroids, kernel_update_centroids, global_size_pixels, global_size_clusters, local_size, 1);
+            if (time >= 0)
+                time = runIterations(command_queue, kernel_find_closest_centroids, kernel_update_centroids,
+                                     global_size_pixels, global_size_clusters, local_size, TUNING_ITERATIONS);
+            if (time < 0) {
+                printf("tuning version:%d local_size:%zu failed\n", parallel_ver, local_size);
+                continue;
+            }
+            printf("tuning version:%d local_size:%zu %.4f\n", parallel_ver, local_size, time);
+
+            if (*best_time < 0 || time < *best_time) {
+                *best_time = time;
+                best_local_size = local_size;
+            }
+        }
+    }
+
+    if (kernel_find_closest_centroids != NULL)
+        clReleaseKernel(kernel_find_closest_centroids);
+    if (kernel_update_centroids != NULL)
+        clReleaseKernel(kernel_update_centroids);
+    return best_local_size;
+}
+
+int checkChangedPixels(cl_event read_event, int *changed_pixels, int first_iteration, int last_iteration){
+    //waits for counters of iterations [first_iteration, last_iteration) and returns first iteration in which no pixel changed (-1 if none)
+    clWaitForEvents(1, &read_event);
+    clReleaseEvent(read_event);
+    for (int iteration = first_iteration; iteration < last_iteration; iteration++) {
+        if (changed_pixels[iteration] == 0)
+            return iteration;
+    }
+    return -1;
+}
+
+cl_int runQueuedIterations(cl_command_queue command_queue, cl_kernel kernel_find_closest_centroids, cl_kernel kernel_update_centroids, int iteration_arg_index,
+                           size_t global_size_pixels, size_t global_size_clusters, size_t local_size, cl_mem changed_pixels_d, int num_of_iterations, int sync_interval){
+    //iterations are enqueued back to back in batches of sync_interval, counters of changed pixels of previous batch are checked
+    //while next batch is already running on device, so device does not wait for host
+    if (sync_interval <= 0 || sync_interval > num_of_iterations)
+        sync_interval = num_of_iterations;
+
+    cl_int clStatus = CL_SUCCESS;
+    int *changed_pixels = (int *)malloc(num_of_iterations * sizeof(int));
+    cl_event *start_events = (cl_event *)calloc(num_of_iterations, sizeof(cl_event));
+    cl_event *end_events = (cl_event *)calloc(num_of_iterations, sizeof(cl_event));
+
+    struct timespec clock_start, clock_end;
+    clock_gettime(CLOCK_MONOTONIC, &clock_start);
+
+    int num_enqueued = 0;
+    int converged_iteration = -1;
+    cl_event previous_read_event = NULL;
+    int previous_batch_start = 0;
+    while (num_enqueued < num_of_iterations && converged_iteration < 0) {
+        int batch_start = num_enqueued;
+        int batch_end = batch_start + sync_interval < num_of_iterations ? batch_start + sync_interval : num_of_iterations;
+
+        for (int iteration = batch_start; iteration < batch_end; iteration++) {
+            // Kernel arguments are captured at enqueue time, so every iteration counts to its own counter
+            clStatus = keepFirstError(clStatus, clSetKernelArg(kernel_find_closest_centroids, iteration_arg_index, sizeof(int), (void *)&iteration));
+            clStatus = keepFirstError(clStatus, clEnqueueNDRangeKernel(command_queue, kernel_find_closest_centroids, 1, NULL, &global_size_pixels, &local_size, 0, NULL, &start_events[iteration]));
+            clStatus = keepFirstError(clStatus, clEnqueueNDRangeKernel(command_queue, kernel_update_centroids, 1, NULL, &global_size_clusters, &local_size, 0, NULL, &end_events[iteration]));
+        }
+        cl_event read_event = NULL;
+        clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(command_queue, changed_pixels_d, CL_FALSE, batch_start * sizeof(int), (batch_end - batch_start) * sizeof(int),
+                                                                changed_pixels + batch_start, 0, NULL, &read_event));
+        clStatus = keepFirstError(clStatus, clFlush(command_queue));
+        num_enqueued = batch_end;
+
+        if (previous_read_event != NULL)
+            converged_iteration = checkChangedPixels(previous_read_event, changed_pixels, previous_batch_start, batch_start);
+        previous_read_event = read_event;
+        previous_batch_start = batch_start;
+        if (checkStatus(clStatus, "enqueue of queued iterations"))
+            break;
+    }
+
+    clStatus = keepFirstError(clStatus, clFinish(command_queue));
+    if (previous_read_event != NULL) {
+        if (converged_iteration < 0 && clStatus == CL_SUCCESS)
+            converged_iteration = checkChangedPixels(previous_read_event, changed_pixels, previous_batch_start, num_enqueued);
+        else
+            clReleaseEvent(previous_read_event);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &clock_end);
+
+    // Per iteration time is measured on device, from start of first kernel to end of second one
+    for (int iteration = 0; iteration < num_enqueued; iteration++) {
+        if (clStatus == CL_SUCCESS) {
+            cl_ulong time_start, time_end;
+            clGetEventProfilingInfo(start_events[iteration], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &time_start, NULL);
+            clGetEventProfilingInfo(end_events[iteration], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &time_end, NULL);
+            printf("%.2f\n", (time_end - time_start)/(1000.0*1000.0));
+        }
+        if (start_events[iteration] != NULL)
+            clReleaseEvent(start_events[iteration]);
+        if (end_events[iteration] != NULL)
+            clReleaseEvent(end_events[iteration]);
+    }
+    if (clStatus == CL_SUCCESS) {
+        long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+        if (converged_iteration >= 0)
+            printf("converged in iteration %d\n", converged_iteration + 1);
+        printf("total: %.2f\n", nanosecs/(1000.0*1000.0));
+    }
+
+    free(changed_pixels);
+    free(start_events);
+    free(end_events);
+    return clStatus;
+}
+
+typedef struct {
+    cl_context context;
+    cl_command_queue command_queue;
+    cl_program program;
+    cl_kernel kernel_find_closest_centroids;
+    cl_kernel kernel_update_centroids;
+    cl_mem centroids_d;
+    cl_mem centroids_sums_d;
+    cl_mem closest_centroid_indices_d;
+    cl_mem image_in_d;
+    cl_mem changed_pixels_d;
+} OpenCLObjects;
+
+int releaseOpenCLObjects(OpenCLObjects *objects){
+    //releases everything that was created, always returns 1 so it can be returned on failure
+    if (objects->command_queue != NULL)
+        clFinish(objects->command_queue);
+    if (objects->kernel_find_closest_centroids != NULL)
+        clReleaseKernel(objects->kernel_find_closest_centroids);
+    if (objects->kernel_update_centroids != NULL)
+        clReleaseKernel(objects->kernel_update_centroids);
+    if (objects->program != NULL)
+        clReleaseProgram(objects->program);
+    if (objects->centroids_d != NULL)
+        clReleaseMemObject(objects->centroids_d);
+    if (objects->centroids_sums_d != NULL)
+        clReleaseMemObject(objects->centroids_sums_d);
+    if (objects->closest_centroid_indices_d != NULL)
+        clReleaseMemObject(objects->closest_centroid_indices_d);
+    if (objects->image_in_d != NULL)
+        clReleaseMemObject(objects->image_in_d);
+    if (objects->changed_pixels_d != NULL)
+        clReleaseMemObject(objects->changed_pixels_d);
+    if (objects->command_queue != NULL)
+        clReleaseCommandQueue(objects->command_queue);
+    if (objects->context != NULL)
+        clReleaseContext(objects->context);
+    memset(objects, 0, sizeof(OpenCLObjects));
+    return 1;
+}
+
+int runOpenCL(const char *image_name, unsigned char *imageIn, int num_pixels, int num_of_clusters, int num_of_iterations,
+              int *centroids, int *closest_centroid_indices, cl_device_type device_type, const char *device_name_filter,
+              int parallel_ver, size_t local_size, int sync_interval, int retune, const char *tuning_file){
+    //runs all iterations on OpenCL device, returns 0 on success and 1 if no suitable device was found or any OpenCL call failed
+    cl_int clStatus;
+    OpenCLObjects objects;
+    memset(&objects, 0, sizeof(OpenCLObjects));
+
+    // Read kernel from file
+    char *source_str = readKernelSource("kernels.cl");
+    if (source_str == NULL)
+        return 1;
+
+    // Select device by type and name
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_uint num_devices = 0;
+    clStatus = selectDevices(device_type, device_name_filter, 1, &platform, &device, &num_devices);
+    if (clStatus != CL_SUCCESS) {
+        fprintf(stderr, "No suitable OpenCL device found (%s).\n", getErrorString(clStatus));
+        free(source_str);
         return 1;
     }
+    char device_name[256] = "";
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    if (parallel_ver != 0 && !fitsLocalMemory(device, parallel_ver, num_of_clusters)) {
+        fprintf(stderr, "Version %d needs more local memory than %s has for %d clusters.\n", parallel_ver, device_name, num_of_clusters);
+        free(source_str);
+        return 1;
+    }
+
+    // Context
+    objects.context = clCreateContext(NULL, 1, &device, NULL, NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateContext")) {
+        free(source_str);
+        return releaseOpenCLObjects(&objects);
+    }
 
-	// Set global size (pixels kernel) to multiple of local size 
-    size_t global_size_pixels = num_pixels;
-    int mod = num_pixels % local_size;
-    if (mod != 0)
-        global_size_pixels = num_pixels + (local_size - mod);
+    // Command queue
+    objects.command_queue = clCreateCommandQueue(objects.context, device, CL_QUEUE_PROFILING_ENABLE, &clStatus);
+    if (checkStatus(clStatus, "clCreateCommandQueue")) {
+        free(source_str);
+        return releaseOpenCLObjects(&objects);
+    }
 
-	// Set global size (clusters kernel) to multiple of local size 
-	size_t global_size_clusters = num_of_clusters;
-    mod = num_of_clusters % local_size;
-    if (mod != 0)
-        global_size_clusters = num_of_clusters + (local_size - mod);
-    
+    // Create and build a program
+    clStatus = buildProgram(objects.context, 1, &device, source_str, &objects.program);
+    free(source_str);
+    if (clStatus != CL_SUCCESS)
+        return releaseOpenCLObjects(&objects);
 
     // Allocate memory on device
-	cl_mem centroids_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_of_clusters * 4 * sizeof(int), NULL, &clStatus);
-    cl_mem centroids_sums_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_of_clusters * 5 * sizeof(long), NULL, &clStatus);
-	cl_mem closest_centroid_indices_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_pixels * sizeof(int), NULL, &clStatus);
-    cl_mem image_in_d = clCreateBuffer(context, CL_MEM_READ_ONLY, num_pixels * 4 * sizeof(unsigned char), NULL, &clStatus);
-    //cl_mem debug_out_d = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &clStatus);
-	
-	// Transfer data to device
-	clStatus = clEnqueueWriteBuffer(command_queue, centroids_d, CL_TRUE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, NULL);
-	clStatus = clEnqueueWriteBuffer(command_queue, image_in_d, CL_TRUE, 0, num_pixels * 4 * sizeof(unsigned char), imageIn, 0, NULL, NULL);
+    cl_context context = objects.context;
+    cl_command_queue command_queue = objects.command_queue;
+    objects.centroids_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_of_clusters * 4 * sizeof(int), NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateBuffer (centroids)"))
+        return releaseOpenCLObjects(&objects);
+    objects.centroids_sums_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_of_clusters * 5 * sizeof(long), NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateBuffer (centroids sums)"))
+        return releaseOpenCLObjects(&objects);
+    objects.closest_centroid_indices_d = clCreateBuffer(context, CL_MEM_READ_WRITE, num_pixels * sizeof(int), NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateBuffer (closest centroid indices)"))
+        return releaseOpenCLObjects(&objects);
+    objects.image_in_d = clCreateBuffer(context, CL_MEM_READ_ONLY, num_pixels * 4 * sizeof(unsigned char), NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateBuffer (image)"))
+        return releaseOpenCLObjects(&objects);
+    // One counter of pixels which changed centroid per iteration
+    objects.changed_pixels_d = clCreateBuffer(context, CL_MEM_READ_WRITE, (num_of_iterations + 1) * sizeof(int), NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateBuffer (changed pixels)"))
+        return releaseOpenCLObjects(&objects);
+    cl_mem centroids_d = objects.centroids_d;
+    cl_mem centroids_sums_d = objects.centroids_sums_d;
+    cl_mem closest_centroid_indices_d = objects.closest_centroid_indices_d;
+    cl_mem image_in_d = objects.image_in_d;
+    cl_mem changed_pixels_d = objects.changed_pixels_d;
+
+    // Transfer data to device, allocation failures of lazily allocating drivers show up here
+    clStatus = clEnqueueWriteBuffer(command_queue, centroids_d, CL_TRUE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, NULL);
+    clStatus = keepFirstError(clStatus, clEnqueueWriteBuffer(command_queue, image_in_d, CL_TRUE, 0, num_pixels * 4 * sizeof(unsigned char), imageIn, 0, NULL, NULL));
     long init_zero = 0;
-    clStatus = clEnqueueFillBuffer(command_queue, centroids_sums_d, &init_zero, sizeof(long), 0, num_of_clusters * 5 * sizeof(long), 0, NULL, NULL);
-  
+    clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(command_queue, centroids_sums_d, &init_zero, sizeof(long), 0, num_of_clusters * 5 * sizeof(long), 0, NULL, NULL));
+    // No pixel has centroid yet, so in first iteration all of them change
+    int init_no_centroid = -1;
+    int init_zero_changed = 0;
+    clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(command_queue, closest_centroid_indices_d, &init_no_centroid, sizeof(int), 0, num_pixels * sizeof(int), 0, NULL, NULL));
+    clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(command_queue, changed_pixels_d, &init_zero_changed, sizeof(int), 0, (num_of_iterations + 1) * sizeof(int), 0, NULL, NULL));
+    clStatus = keepFirstError(clStatus, clFinish(command_queue));
+    if (checkStatus(clStatus, "transfer to device"))
+        return releaseOpenCLObjects(&objects);
+
+    // Pick version and local size which were not given, tuning results are stored per device and clusters range
+    if (parallel_ver == 0 || local_size == 0) {
+        char device_tuning_name[256];
+        getDeviceTuningName(device, device_tuning_name, sizeof(device_tuning_name));
+        int clusters_range = getClustersRange(num_of_clusters);
+
+        size_t all_local_sizes[] = {32, 64, 128, 256, 512, 1024};
+        int num_all_local_sizes = sizeof(all_local_sizes) / sizeof(size_t);
+        size_t *local_sizes = all_local_sizes;
+        int num_local_sizes = num_all_local_sizes;
+        if (local_size != 0) {
+            local_sizes = &local_size;
+            num_local_sizes = 1;
+        }
+
+        double best_time = -1;
+        size_t best_local_size = 0;
+        int best_ver = 0;
+        for (int ver = 1; ver <= 3; ver++) {
+            if (parallel_ver != 0 && ver != parallel_ver)
+                continue;
+
+            size_t ver_local_size = 0;
+            double ver_time = -1;
+            if (retune || local_size != 0 || !readTuning(tuning_file, device_tuning_name, clusters_range, ver, &ver_local_size, &ver_time)) {
+                ver_local_size = tuneLocalSize(objects.program, device, command_queue, ver, num_of_clusters, num_pixels, centroids, centroids_d, centroids_sums_d,
+                                               closest_centroid_indices_d, image_in_d, changed_pixels_d, local_sizes, num_local_sizes, &ver_time);
+                // Only complete sweeps over local sizes are stored
+                if (local_size == 0)
+                    writeTuning(tuning_file, device_tuning_name, clusters_range, ver, ver_local_size, ver_time);
+            }
+
+            if (ver_local_size != 0 && (best_time < 0 || ver_time < best_time)) {
+                best_time = ver_time;
+                best_local_size = ver_local_size;
+                best_ver = ver;
+            }
+        }
+
+        if (best_ver == 0) {
+            fprintf(stderr, "No kernel version can run with %d clusters on %s.\n", num_of_clusters, device_name);
+            return releaseOpenCLObjects(&objects);
+        }
+        parallel_ver = best_ver;
+        local_size = best_local_size;
+
+        // Tuning changed centroids on device, start again from initial ones
+        clStatus = clEnqueueWriteBuffer(command_queue, centroids_d, CL_TRUE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, NULL);
+        clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(command_queue, centroids_sums_d, &init_zero, sizeof(long), 0, num_of_clusters * 5 * sizeof(long), 0, NULL, NULL));
+        clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(command_queue, closest_centroid_indices_d, &init_no_centroid, sizeof(int), 0, num_pixels * sizeof(int), 0, NULL, NULL));
+        clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(command_queue, changed_pixels_d, &init_zero_changed, sizeof(int), 0, (num_of_iterations + 1) * sizeof(int), 0, NULL, NULL));
+        if (checkStatus(clStatus, "reset after tuning"))
+            return releaseOpenCLObjects(&objects);
+    }
+
+    // Set global sizes (pixels and clusters kernel) to multiple of local size
+    size_t global_size_pixels = roundUpToLocalSize(num_pixels, local_size);
+    size_t global_size_clusters = roundUpToLocalSize(num_of_clusters, local_size);
+
     // Create kernels and set arguments
-    cl_kernel kernel_find_closest_centroids, kernel_update_centroids;
+    clStatus = createKernels(objects.program, parallel_ver, num_of_clusters, num_pixels, centroids_d, centroids_sums_d, closest_centroid_indices_d,
+                             image_in_d, changed_pixels_d, &objects.kernel_find_closest_centroids, &objects.kernel_update_centroids);
+    if (clStatus != CL_SUCCESS)
+        return releaseOpenCLObjects(&objects);
+    cl_kernel kernel_find_closest_centroids = objects.kernel_find_closest_centroids;
+    cl_kernel kernel_update_centroids = objects.kernel_update_centroids;
 
-    if (parallel_ver == 1) {
-        kernel_find_closest_centroids = clCreateKernel(program, "find_closest_centroids", &clStatus);
-        clStatus = clSetKernelArg(kernel_find_closest_centroids, 0, sizeof(int), (void *)&num_of_clusters);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 1, sizeof(int), (void *)&num_pixels);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 2, sizeof(cl_mem), (void *)&centroids_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 3, sizeof(cl_mem), (void *)&closest_centroid_indices_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 4, sizeof(cl_mem), (void *)&image_in_d);
+    printf("%s clusters:%d device:%s version:%d local_size:%zu\n", image_name, num_of_clusters, device_name, parallel_ver, local_size);
 
-        kernel_update_centroids = clCreateKernel(program, "update_centroids", &clStatus);
-        clStatus = clSetKernelArg(kernel_update_centroids, 0, sizeof(int), (void *)&num_of_clusters);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 1, sizeof(int), (void *)&num_pixels);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 2, sizeof(cl_mem), (void *)&centroids_d);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 3, sizeof(cl_mem), (void *)&closest_centroid_indices_d);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 4, sizeof(cl_mem), (void *)&image_in_d);
+    // Main loop
+    if (sync_interval >= 0) {
+        clStatus = runQueuedIterations(command_queue, kernel_find_closest_centroids, kernel_update_centroids, getIterationArgIndex(parallel_ver),
+                                       global_size_pixels, global_size_clusters, local_size, changed_pixels_d, num_of_iterations, sync_interval);
+        if (clStatus != CL_SUCCESS)
+            return releaseOpenCLObjects(&objects);
     }
+    else {
+        for (int iteration = 0; iteration < (num_of_iterations); iteration++) {
 
-    else if (parallel_ver == 2) {
-        kernel_find_closest_centroids = clCreateKernel(program, "find_closest_centroids_2", &clStatus);
-        clStatus = clSetKernelArg(kernel_find_closest_centroids, 0, sizeof(int), (void *)&num_of_clusters);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 1, sizeof(int), (void *)&num_pixels);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 2, sizeof(cl_mem), (void *)&centroids_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 3, sizeof(cl_mem), (void *)&centroids_sums_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 4, sizeof(cl_mem), (void *)&closest_centroid_indices_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 5, sizeof(cl_mem), (void *)&image_in_d);
-
-        kernel_update_centroids = clCreateKernel(program, "update_centroids_2", &clStatus);
-        clStatus = clSetKernelArg(kernel_update_centroids, 0, sizeof(int), (void *)&num_of_clusters);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 1, sizeof(cl_mem), (void *)&centroids_d);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 2, sizeof(cl_mem), (void *)&centroids_sums_d);
+            // Start measuring time
+            struct timespec clock_start, clock_end;
+            clock_gettime(CLOCK_MONOTONIC, &clock_start);
+        
+            // Step 1: go through all points and find closest centroid
+            clStatus = clSetKernelArg(kernel_find_closest_centroids, getIterationArgIndex(parallel_ver), sizeof(int), (void *)&iteration);
+            clStatus = keepFirstError(clStatus, clEnqueueNDRangeKernel(command_queue, kernel_find_closest_centroids, 1, NULL, &global_size_pixels, &local_size, 0, NULL, NULL));
+
+            // Step 2: for each centroid compute average which will be new centroid
+            clStatus = keepFirstError(clStatus, clEnqueueNDRangeKernel(command_queue, kernel_update_centroids, 1, NULL, &global_size_clusters, &local_size, 0, NULL, NULL));
+
+            // Wait for kernels to finish
+            clStatus = keepFirstError(clStatus, clFlush(command_queue));
+            clStatus = keepFirstError(clStatus, clFinish(command_queue));
+            if (checkStatus(clStatus, "iteration"))
+                return releaseOpenCLObjects(&objects);
+
+            // Stop measuring time
+            clock_gettime(CLOCK_MONOTONIC, &clock_end);
+            long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+            printf("%.2f\n", nanosecs/(1000.0*1000.0));
+        }
     }
 
-    else if (parallel_ver == 3) {
-        kernel_find_closest_centroids = clCreateKernel(program, "find_closest_centroids_3", &clStatus);
-        clStatus = clSetKernelArg(kernel_find_closest_centroids, 0, sizeof(int), (void *)&num_of_clusters);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 1, sizeof(int), (void *)&num_pixels);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 2, sizeof(cl_mem), (void *)&centroids_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 3, sizeof(cl_mem), (void *)&centroids_sums_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 4, num_of_clusters * 5 * sizeof(int), NULL);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 5, sizeof(cl_mem), (void *)&closest_centroid_indices_d);
-        clStatus |= clSetKernelArg(kernel_find_closest_centroids, 6, sizeof(cl_mem), (void *)&image_in_d);
+    // Copy data back to host
+    clStatus = clEnqueueReadBuffer(command_queue, centroids_d, CL_TRUE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, NULL);
+    clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(command_queue, closest_centroid_indices_d, CL_TRUE, 0, num_pixels * sizeof(int), closest_centroid_indices, 0, NULL, NULL));
+    if (checkStatus(clStatus, "clEnqueueReadBuffer"))
+        return releaseOpenCLObjects(&objects);
 
-        kernel_update_centroids = clCreateKernel(program, "update_centroids_2", &clStatus);
-        clStatus = clSetKernelArg(kernel_update_centroids, 0, sizeof(int), (void *)&num_of_clusters);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 1, sizeof(cl_mem), (void *)&centroids_d);
-        clStatus |= clSetKernelArg(kernel_update_centroids, 2, sizeof(cl_mem), (void *)&centroids_sums_d);
+    // release & free
+    releaseOpenCLObjects(&objects);
+    return 0;
+}
+
+int findClosestCentroid(int *centroids, int num_of_clusters, int blue, int green, int red, int alpha){
+    //squared distance picks same centroid as distance used by kernels, but without sqrt
+    int centroidIndex = 0;
+    int delta_blue = centroids[0] - blue;
+    int delta_green = centroids[1] - green;
+    int delta_red = centroids[2] - red;
+    int delta_alpha = centroids[3] - alpha;
+    int minimum_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+
+    for(int i = 4; i < (num_of_clusters * 4); i = i + 4){
+        delta_blue = centroids[i] - blue;
+        delta_green = centroids[i+1] - green;
+        delta_red = centroids[i+2] - red;
+        delta_alpha = centroids[i+3] - alpha;
+        int current_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+        if(current_distance < minimum_distance){
+            centroidIndex = i / 4;
+            minimum_distance = current_distance;
+        }
     }
+    return centroidIndex;
+}
 
-    printf("%s clusters:%s version:%s\n", argv[1], argv[2], argv[4]);
+void runOpenMP(const char *image_name, unsigned char *imageIn, int num_pixels, int num_of_clusters, int num_of_iterations,
+               int *centroids, int *closest_centroid_indices){
+    //fallback when OpenCL can not be used, same iterations on host threads with per-thread centroid sums
+    long *centroids_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+    printf("%s clusters:%d device:openmp threads:%d\n", image_name, num_of_clusters, omp_get_max_threads());
 
-    // Main loop
     for (int iteration = 0; iteration < (num_of_iterations); iteration++) {
+        double iteration_start = omp_get_wtime();
+
+        //step 1: go through all points and find closest centroid
+        #pragma omp parallel
+        {
+            long *thread_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+
+            #pragma omp for
+            for(int point = 0; point < num_pixels; point++){
+                int imageStartingPointIndex = point * 4;
+                int blue = imageIn[imageStartingPointIndex];
+                int green = imageIn[imageStartingPointIndex + 1];
+                int red = imageIn[imageStartingPointIndex + 2];
+                int alpha = imageIn[imageStartingPointIndex + 3];
+
+                int closest_centroid = findClosestCentroid(centroids, num_of_clusters, blue, green, red, alpha);
+                closest_centroid_indices[point] = closest_centroid;
+
+                thread_sums[closest_centroid*5] += blue;
+                thread_sums[closest_centroid*5 + 1] += green;
+                thread_sums[closest_centroid*5 + 2] += red;
+                thread_sums[closest_centroid*5 + 3] += alpha;
+                thread_sums[closest_centroid*5 + 4] += 1;
+            }
+
+            #pragma omp critical
+            for(int i = 0; i < num_of_clusters * 5; i++)
+                centroids_sums[i] += thread_sums[i];
+
+            free(thread_sums);
+        }
+
+        //step 2: for each centroid compute average which will be new centroid
+        for(int centroid = 0; centroid < (num_of_clusters); centroid++){
+            long count = centroids_sums[centroid*5 + 4];
+            if(count > 0){
+                for(int channel = 0; channel < 4; channel++)
+                    centroids[centroid*4 + channel] = centroids_sums[centroid*5 + channel] / count;
+            }
+            for(int i = 0; i < 5; i++)
+                centroids_sums[centroid*5 + i] = 0;
+        }
+
+        printf("%.2f\n", (omp_get_wtime() - iteration_start) * 1000.0);
+    }
+    free(centroids_sums);
+}
 
-        // Start measuring time
-        struct timespec clock_start, clock_end;
-        clock_gettime(CLOCK_MONOTONIC, &clock_start);
-        
-        // Step 1: go through all points and find closest centroid
-	    clStatus = clEnqueueNDRangeKernel(command_queue, kernel_find_closest_centroids, 1, NULL, &global_size_pixels, &local_size, 0, NULL, NULL);
+int main(int argc, char *argv[]) {
 
-        // Step 2: for each centroid compute average which will be new centroid
-	    clStatus = clEnqueueNDRangeKernel(command_queue, kernel_update_centroids, 1, NULL, &global_size_clusters, &local_size, 0, NULL, NULL);
+    if (getOption(argc, argv, "list-devices") != NULL) {
+        printDevices();
+        return 0;
+    }
 
-        // Wait for kernels to finish
-        clStatus = clFlush(command_queue);
-        clStatus = clFinish(command_queue);
+    //1st argument is image name including format, 2nd number of clusters and 3rd number of iterations
+    const char *image_name = getPositionalArg(argc, argv, 1);
+    const char *clusters_arg = getPositionalArg(argc, argv, 2);
+    const char *iterations_arg = getPositionalArg(argc, argv, 3);
+    if (iterations_arg == NULL) {
+        fprintf(stderr, "Usage: %s <image> <clusters> <iterations> [1|2|3|auto] [<local size>|auto] [options]\n", argv[0]);
+        exit(1);
+    }
 
-        // Stop measuring time
-        clock_gettime(CLOCK_MONOTONIC, &clock_end);
-        long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
-        printf("%.2f\n", nanosecs/(1000.0*1000.0));
+    //Load image from file
+	FIBITMAP *imageLoad = FreeImage_Load(FIF_PNG, image_name, 0);
+    if (imageLoad == NULL) {
+        fprintf(stderr, "Can not load image %s.\n", image_name);
+        exit(1);
     }
+	//Convert it to a 32-bit image
+    FIBITMAP *imageLoad32 = FreeImage_ConvertTo32Bits(imageLoad);
+	
+    //Get image dimensions
+    int width = FreeImage_GetWidth(imageLoad32);
+	int height = FreeImage_GetHeight(imageLoad32);
+	int pitch = FreeImage_GetPitch(imageLoad32);
+    int num_pixels = width * height;
 
-    // Copy data back to host
-	clStatus = clEnqueueReadBuffer(command_queue, centroids_d, CL_TRUE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, NULL);
-	clStatus = clEnqueueReadBuffer(command_queue, closest_centroid_indices_d, CL_TRUE, 0, num_pixels * sizeof(int), closest_centroid_indices, 0, NULL, NULL);
+	//Prepare room for a raw data copy of the image
+    unsigned char *imageIn = (unsigned char *)malloc(height*pitch * sizeof(unsigned char));
 
-    // Copy and print debug var
-    /*
-    int debug_var = -1;
-    clStatus = clEnqueueReadBuffer(command_queue, debug_out_d, CL_TRUE, 0, sizeof(int), &debug_var, 0, NULL, NULL);
-    printf("GPU debug var: %d\n", debug_var);
-    */
+    //Extract raw data from the image
+	FreeImage_ConvertToRawBits(imageIn, imageLoad32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
 
-    // release & free
-    clStatus = clFlush(command_queue);
-    clStatus = clFinish(command_queue);
-    clStatus = clReleaseKernel(kernel_find_closest_centroids);
-    clStatus = clReleaseKernel(kernel_update_centroids);
-    clStatus = clReleaseProgram(program);
-    clStatus = clReleaseMemObject(centroids_d);
-    clStatus = clReleaseMemObject(closest_centroid_indices_d);
-    clStatus = clReleaseMemObject(image_in_d);
-    clStatus = clReleaseCommandQueue(command_queue);
-    clStatus = clReleaseContext(context);
-	free(devices);
-    free(platforms);
+    //Free source image data free
+	FreeImage_Unload(imageLoad32);
+	FreeImage_Unload(imageLoad);
+
+    //get number of clusters from 2nd argument and num of iterations from 3rd argument
+    int num_of_clusters = atoi(clusters_arg);
+    int num_of_iterations = atoi(iterations_arg);
+
+    // Get version (of parallel opencl implementation) from optional 4th argument
+    // and local size from optional 5th argument, "auto" (default) uses tuned configuration for this device
+    int parallel_ver = 0;
+    const char *version_arg = getPositionalArg(argc, argv, 4);
+    if (version_arg != NULL && strcmp(version_arg, "auto") != 0)
+        parallel_ver = atoi(version_arg);
+
+    size_t local_size = 0;
+    const char *local_size_arg = getPositionalArg(argc, argv, 5);
+    if (local_size_arg != NULL && strcmp(local_size_arg, "auto") != 0)
+        local_size = atoi(local_size_arg);
+
+    if (parallel_ver < 0 || parallel_ver > 3) {
+        fprintf(stderr, "Unknown version %d, use 1, 2, 3 or auto.\n", parallel_ver);
+        exit(1);
+    }
+
+    // Optional --sync-interval=<n> queues all iterations back to back and host only checks device counters of changed pixels
+    // every n iterations (0 means only after last iteration), stopping once no pixel changes centroid
+    int sync_interval = -1;
+    const char *sync_interval_arg = getOption(argc, argv, "sync-interval");
+    if (sync_interval_arg != NULL)
+        sync_interval = atoi(sync_interval_arg);
+
+    // Tuning options: --retune ignores stored results, --tuning-file=<file> changes where they are stored
+    int retune = getOption(argc, argv, "retune") != NULL;
+    const char *tuning_file = getOption(argc, argv, "tuning-file");
+    if (tuning_file == NULL || tuning_file[0] == '\0')
+        tuning_file = TUNING_FILE;
+
+    // Device options: --device-type=gpu|cpu|accelerator|default|all (gpu if not given), --device-name=<part of name>,
+    // --no-fallback exits instead of running on OpenMP threads when OpenCL fails
+    cl_device_type device_type = parseDeviceType(getOption(argc, argv, "device-type"));
+    if (device_type == 0) {
+        fprintf(stderr, "Unknown device type %s, use gpu, cpu, accelerator, default or all.\n", getOption(argc, argv, "device-type"));
+        exit(1);
+    }
+    const char *device_name_filter = getOption(argc, argv, "device-name");
+    int fallback = getOption(argc, argv, "no-fallback") == NULL;
+
+    //centroid init array
+    int *centroids = (int*)malloc(num_of_clusters * 4 * sizeof(int));
+    initCentroids(centroids, num_of_clusters, imageIn, width * height);
+
+    //init array for keeping indices of closest centroid
+    int *closest_centroid_indices = (int*)malloc(width * height * sizeof(int));
+
+    if (runOpenCL(image_name, imageIn, num_pixels, num_of_clusters, num_of_iterations, centroids, closest_centroid_indices,
+                  device_type, device_name_filter, parallel_ver, local_size, sync_interval, retune, tuning_file) != 0) {
+        if (!fallback)
+            exit(1);
+        // Start again from the same centroids, OpenCL may have failed in the middle of iterations
+        fprintf(stderr, "Falling back to OpenMP.\n");
+        initCentroids(centroids, num_of_clusters, imageIn, width * height);
+        runOpenMP(image_name, imageIn, num_pixels, num_of_clusters, num_of_iterations, centroids, closest_centroid_indices);
+    }
 
     //apply new colours to input image
     applyNewColoursToImage(imageIn, closest_centroid_indices, pitch*height, num_of_clusters, centroids);
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstdlib>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include <CL/cl.h>
+#include "FreeImage.h"
+#include "opencl_utils.h"
+#include "args.h"
+
+#define MAX_DEVICES 16
+
+void printImage(unsigned char *image, int size){
+    //helper function for debugging purposes
+    for(int i = 0; i < (size); i = i + 4){
+        int image_position = i / 4;
+        printf("index: %d, B: %d, G: %d, R: %d, A: %d \n", image_position, image[i], image[i+1], image[i+2], image[i+3]);
+    }
+}
+
+void printArrayWithStep4(int* arrayToPrint, int size){
+    //helper function for debugging purposes
+    for(int c = 0; c < (size); c = c + 4){
+        printf("%d %d %d %d \n", arrayToPrint[c], arrayToPrint[c+1], arrayToPrint[c+2], arrayToPrint[c+3]);
+    }
+}
+
+void initCentroids(int *centroids, int num_of_clusters, unsigned char* imageIn, int imageSize){
+    int counter = 0;
+    //we use interval to select starting centroids from image, spreaded equally across
+    int interval = imageSize / num_of_clusters;
+    for(int i = 0; i < (num_of_clusters * 4); i = i + 4){
+        centroids[i] = imageIn[counter];
+        centroids[i + 1] = imageIn[counter+1];
+        centroids[i + 2] = imageIn[counter+2];
+        centroids[i + 3] = imageIn[counter+3];
+        counter = counter + (interval * 4);
+    }
+}
+
+void applyNewCentroidValue(int centroidIndex, int* centroids, long *centroids_sums){
+
+    // get sum of all colors for this centroid from centroids_sums
+    int blue = centroids_sums[centroidIndex*5];
+    int green = centroids_sums[centroidIndex*5 + 1];
+    int red = centroids_sums[centroidIndex*5 + 2];
+    int alpha = centroids_sums[centroidIndex*5 + 3];
+    int count = centroids_sums[centroidIndex*5 + 4];
+
+    // compute average for all non empty clusters
+    if(count > 0){
+        centroids[centroidIndex * 4] = blue / count;
+        centroids[centroidIndex * 4 + 1] = green / count;
+        centroids[centroidIndex * 4 + 2] = red / count;
+        centroids[centroidIndex * 4 + 3] = alpha / count;
+    }
+
+    // reset centroids_sums for next iteration
+    for (int i = 0; i < 5; i++)
+        centroids_sums[centroidIndex*5 + i] = 0;
+}
+
+int findClosestCentroid(int *centroids, int num_of_clusters, int blue, int green, int red, int alpha){
+    //squared distance picks same centroid as distance used by kernels, but without sqrt
+    int centroidIndex = 0;
+    int delta_blue = centroids[0] - blue;
+    int delta_green = centroids[1] - green;
+    int delta_red = centroids[2] - red;
+    int delta_alpha = centroids[3] - alpha;
+    int minimum_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+
+    for(int i = 4; i < (num_of_clusters * 4); i = i + 4){
+        delta_blue = centroids[i] - blue;
+        delta_green = centroids[i+1] - green;
+        delta_red = centroids[i+2] - red;
+        delta_alpha = centroids[i+3] - alpha;
+        int current_distance = delta_blue * delta_blue + delta_green * delta_green + delta_red * delta_red + delta_alpha * delta_alpha;
+        if(current_distance < minimum_distance){
+            centroidIndex = i / 4;
+            minimum_distance = current_distance;
+        }
+    }
+    return centroidIndex;
+}
+
+long findClosestCentroidsHost(unsigned char *imageIn, int *centroids, int num_of_clusters, int first_point, int last_point,
+                              int *closest_centroid_indices, long *centroids_sums){
+    //host assignment used when no device can be used, every thread sums to its own copy which are then merged to centroids_sums;
+    //returns number of pixels which changed centroid
+    long changed_pixels = 0;
+    #pragma omp parallel
+    {
+        long *thread_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+
+        #pragma omp for reduction(+:changed_pixels)
+        for(int point = first_point; point < last_point; point++){
+            int imageStartingPointIndex = point * 4;
+            int blue = imageIn[imageStartingPointIndex];
+            int green = imageIn[imageStartingPointIndex + 1];
+            int red = imageIn[imageStartingPointIndex + 2];
+            int alpha = imageIn[imageStartingPointIndex + 3];
+
+            int closest_centroid = findClosestCentroid(centroids, num_of_clusters, blue, green, red, alpha);
+            if (closest_centroid_indices[point] != closest_centroid)
+                changed_pixels++;
+            closest_centroid_indices[point] = closest_centroid;
+
+            thread_sums[closest_centroid*5] += blue;
+            thread_sums[closest_centroid*5 + 1] += green;
+            thread_sums[closest_centroid*5 + 2] += red;
+            thread_sums[closest_centroid*5 + 3] += alpha;
+            thread_sums[closest_centroid*5 + 4] += 1;
+        }
+
+        #pragma omp critical
+        for(int i = 0; i < num_of_clusters * 5; i++)
+            centroids_sums[i] += thread_sums[i];
+
+        free(thread_sums);
+    }
+    return changed_pixels;
+}
+
+void applyNewColoursToImage(unsigned char* image, int* closest_centroid_indices,  int size, int* centroids){
+    //for each pixel in image assign it new centroid colour
+    for(int i = 0; i < (size); i = i + 4){
+        //find colour centroid for this pixel
+        int closestCentroid = closest_centroid_indices[i/4];
+        //apply centroid colour to this pixel
+        image[i] = centroids[closestCentroid * 4];
+        image[i+1] = centroids[closestCentroid * 4 + 1];
+        image[i+2] = centroids[closestCentroid * 4 + 2];
+        image[i+3] = centroids[closestCentroid * 4 + 3];
+    }
+}
+
+cl_uint splitToSubDevices(cl_device_id *devices, cl_uint num_devices, cl_uint compute_units_per_sub_device, int *is_sub_device){
+    //replaces every device which can be partitioned with its sub-devices of given number of compute units,
+    //devices which can not be partitioned are kept whole
+    cl_device_id split_devices[MAX_DEVICES];
+    cl_uint num_split_devices = 0;
+    cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)compute_units_per_sub_device, 0};
+
+    for (cl_uint d = 0; d < num_devices; d++) {
+        cl_uint num_sub_devices = 0;
+        cl_int clStatus = clCreateSubDevices(devices[d], properties, MAX_DEVICES - num_split_devices, split_devices + num_split_devices, &num_sub_devices);
+        if (clStatus != CL_SUCCESS || num_sub_devices == 0) {
+            char device_name[256] = "";
+            clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+            fprintf(stderr, "Device %s can not be partitioned (%s), using it whole.\n", device_name, getErrorString(clStatus));
+            is_sub_device[num_split_devices] = 0;
+            split_devices[num_split_devices++] = devices[d];
+        }
+        else {
+            for (cl_uint s = 0; s < num_sub_devices; s++)
+                is_sub_device[num_split_devices + s] = 1;
+            num_split_devices += num_sub_devices;
+        }
+        if (num_split_devices == MAX_DEVICES)
+            break;
+    }
+
+    memcpy(devices, split_devices, num_split_devices * sizeof(cl_device_id));
+    return num_split_devices;
+}
+
+typedef struct {
+    cl_device_id device;
+    cl_command_queue command_queue;
+    cl_kernel kernel_find_closest_centroids;
+    cl_mem centroids_d;
+    cl_mem centroids_sums_d;
+    cl_mem closest_centroid_indices_d;
+    cl_mem image_in_d;
+    cl_mem changed_pixels_d;
+    int first_point;
+    int num_points;
+    int iteration_arg_index;
+    long *centroids_sums;
+    int changed_pixels;
+    cl_event read_event;
+} DevicePart;
+
+typedef struct {
+    cl_context context;
+    cl_program program;
+    cl_uint num_devices;
+    int is_sub_device[MAX_DEVICES];
+    DevicePart parts[MAX_DEVICES];
+} MultiDevice;
+
+int releaseMultiDevice(MultiDevice *multi){
+    //releases everything that was created, always returns 1 so it can be returned on failure
+    for (cl_uint d = 0; d < multi->num_devices; d++) {
+        DevicePart *part = &multi->parts[d];
+        if (part->command_queue != NULL)
+            clFinish(part->command_queue);
+        if (part->read_event != NULL)
+            clReleaseEvent(part->read_event);
+        if (part->kernel_find_closest_centroids != NULL)
+            clReleaseKernel(part->kernel_find_closest_centroids);
+        if (part->centroids_d != NULL)
+            clReleaseMemObject(part->centroids_d);
+        if (part->centroids_sums_d != NULL)
+            clReleaseMemObject(part->centroids_sums_d);
+        if (part->closest_centroid_indices_d != NULL)
+            clReleaseMemObject(part->closest_centroid_indices_d);
+        if (part->image_in_d != NULL)
+            clReleaseMemObject(part->image_in_d);
+        if (part->changed_pixels_d != NULL)
+            clReleaseMemObject(part->changed_pixels_d);
+        if (part->command_queue != NULL)
+            clReleaseCommandQueue(part->command_queue);
+        free(part->centroids_sums);
+    }
+    if (multi->program != NULL)
+        clReleaseProgram(multi->program);
+    if (multi->context != NULL)
+        clReleaseContext(multi->context);
+    for (cl_uint d = 0; d < multi->num_devices; d++) {
+        if (multi->is_sub_device[d])
+            clReleaseDevice(multi->parts[d].device);
+    }
+    memset(multi, 0, sizeof(MultiDevice));
+    return 1;
+}
+
+cl_int setupDevicePart(MultiDevice *multi, DevicePart *part, unsigned char *imageIn, int num_of_clusters, int num_of_iterations){
+    //creates queue, buffers and kernel for one device, which only keeps its own range of pixels
+    cl_int clStatus, buffers_status;
+    part->command_queue = clCreateCommandQueue(multi->context, part->device, 0, &clStatus);
+    if (checkStatus(clStatus, "clCreateCommandQueue"))
+        return clStatus;
+
+    // Device with empty range still gets buffers of one pixel so that kernel arguments are valid
+    size_t num_points = part->num_points > 0 ? part->num_points : 1;
+    part->centroids_d = clCreateBuffer(multi->context, CL_MEM_READ_ONLY, num_of_clusters * 4 * sizeof(int), NULL, &clStatus);
+    buffers_status = clStatus;
+    part->centroids_sums_d = clCreateBuffer(multi->context, CL_MEM_READ_WRITE, num_of_clusters * 5 * sizeof(long), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    part->closest_centroid_indices_d = clCreateBuffer(multi->context, CL_MEM_READ_WRITE, num_points * sizeof(int), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    part->image_in_d = clCreateBuffer(multi->context, CL_MEM_READ_ONLY, num_points * 4 * sizeof(unsigned char), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    part->changed_pixels_d = clCreateBuffer(multi->context, CL_MEM_READ_WRITE, num_of_iterations * sizeof(int), NULL, &clStatus);
+    buffers_status = keepFirstError(buffers_status, clStatus);
+    if (checkStatus(buffers_status, "clCreateBuffer"))
+        return buffers_status;
+
+    // Image part is copied once, indices start without centroid
+    int init_no_centroid = -1;
+    int init_zero_changed = 0;
+    clStatus = CL_SUCCESS;
+    if (part->num_points > 0)
+        clStatus = keepFirstError(clStatus, clEnqueueWriteBuffer(part->command_queue, part->image_in_d, CL_TRUE, 0, part->num_points * 4 * sizeof(unsigned char),
+                                                                 imageIn + (size_t)part->first_point * 4, 0, NULL, NULL));
+    clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(part->command_queue, part->closest_centroid_indices_d, &init_no_centroid, sizeof(int), 0, num_points * sizeof(int), 0, NULL, NULL));
+    clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(part->command_queue, part->changed_pixels_d, &init_zero_changed, sizeof(int), 0, num_of_iterations * sizeof(int), 0, NULL, NULL));
+    clStatus = keepFirstError(clStatus, clFinish(part->command_queue));
+    if (checkStatus(clStatus, "transfer to device"))
+        return clStatus;
+
+    // Sums are reduced in local memory (version 3) when they fit there, otherwise with global atomics (version 2)
+    cl_ulong local_mem_size = 0;
+    clGetDeviceInfo(part->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &local_mem_size, NULL);
+    int use_local_sums = num_of_clusters * 5 * sizeof(int) <= local_mem_size;
+    part->kernel_find_closest_centroids = clCreateKernel(multi->program, use_local_sums ? "find_closest_centroids_3" : "find_closest_centroids_2", &clStatus);
+    if (checkStatus(clStatus, "clCreateKernel"))
+        return clStatus;
+    cl_kernel kernel = part->kernel_find_closest_centroids;
+    int arg = 0;
+    clStatus = clSetKernelArg(kernel, arg++, sizeof(int), (void *)&num_of_clusters);
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(int), (void *)&part->num_points));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&part->centroids_d));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&part->centroids_sums_d));
+    if (use_local_sums)
+        clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, num_of_clusters * 5 * sizeof(int), NULL));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&part->closest_centroid_indices_d));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&part->image_in_d));
+    clStatus = keepFirstError(clStatus, clSetKernelArg(kernel, arg++, sizeof(cl_mem), (void *)&part->changed_pixels_d));
+    part->iteration_arg_index = arg;
+    checkStatus(clStatus, "clSetKernelArg");
+    return clStatus;
+}
+
+int setupMultiDevice(MultiDevice *multi, cl_device_type device_type, const char *device_name_filter, cl_uint max_devices,
+                     cl_uint compute_units_per_sub_device, unsigned char *imageIn, int num_pixels, int num_of_clusters, int num_of_iterations){
+    //selects devices and splits pixels between them proportionally to their compute units, returns 0 on success and 1 on failure
+    cl_int clStatus;
+    memset(multi, 0, sizeof(MultiDevice));
+
+    // Read kernel from file
+    char *source_str = readKernelSource("kernels.cl");
+    if (source_str == NULL)
+        return 1;
+
+    // Devices are taken from one platform so they can share context and program
+    cl_platform_id platform;
+    cl_device_id devices[MAX_DEVICES];
+    cl_uint num_devices = 0;
+    if (max_devices == 0 || max_devices > MAX_DEVICES)
+        max_devices = MAX_DEVICES;
+    clStatus = selectDevices(device_type, device_name_filter, max_devices, &platform, devices, &num_devices);
+    if (clStatus != CL_SUCCESS) {
+        fprintf(stderr, "No suitable OpenCL device found (%s).\n", getErrorString(clStatus));
+        free(source_str);
+        return 1;
+    }
+    if (compute_units_per_sub_device > 0)
+        num_devices = splitToSubDevices(devices, num_devices, compute_units_per_sub_device, multi->is_sub_device);
+    multi->num_devices = num_devices;
+    for (cl_uint d = 0; d < num_devices; d++)
+        multi->parts[d].device = devices[d];
+
+    // Context
+    multi->context = clCreateContext(NULL, num_devices, devices, NULL, NULL, &clStatus);
+    if (checkStatus(clStatus, "clCreateContext")) {
+        free(source_str);
+        return releaseMultiDevice(multi);
+    }
+
+    // Create and build a program for all devices
+    clStatus = buildProgram(multi->context, num_devices, devices, source_str, &multi->program);
+    free(source_str);
+    if (clStatus != CL_SUCCESS)
+        return releaseMultiDevice(multi);
+
+    // Split pixels proportionally to compute units, last device gets the remainder
+    cl_uint compute_units[MAX_DEVICES];
+    cl_uint total_compute_units = 0;
+    for (cl_uint d = 0; d < num_devices; d++) {
+        compute_units[d] = 1;
+        clGetDeviceInfo(devices[d], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units[d], NULL);
+        if (compute_units[d] == 0)
+            compute_units[d] = 1;
+        total_compute_units += compute_units[d];
+    }
+    int first_point = 0;
+    for (cl_uint d = 0; d < num_devices; d++) {
+        DevicePart *part = &multi->parts[d];
+        part->first_point = first_point;
+        part->num_points = d == num_devices - 1 ? num_pixels - first_point : (int)((long)num_pixels * compute_units[d] / total_compute_units);
+        part->centroids_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+        first_point += part->num_points;
+
+        if (setupDevicePart(multi, part, imageIn, num_of_clusters, num_of_iterations) != CL_SUCCESS)
+            return releaseMultiDevice(multi);
+
+        char device_name[256] = "";
+        clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+        printf("device %u: %s compute_units:%u pixels:%d\n", d, device_name, compute_units[d], part->num_points);
+    }
+    return 0;
+}
+
+cl_int runMultiDeviceIteration(MultiDevice *multi, int *centroids, int num_of_clusters, long *centroids_sums, long *changed_pixels,
+                               size_t local_size, int iteration){
+    //every device assigns its pixels and sums them, partial sums of all devices are added to centroids_sums and counts of
+    //pixels which changed centroid to changed_pixels
+    cl_int clStatus = CL_SUCCESS;
+    long init_zero = 0;
+
+    // Enqueue work on all devices first, so they all run at the same time
+    for (cl_uint d = 0; d < multi->num_devices; d++) {
+        DevicePart *part = &multi->parts[d];
+        if (part->num_points == 0)
+            continue;
+        size_t global_size_pixels = roundUpToLocalSize(part->num_points, local_size);
+        clStatus = keepFirstError(clStatus, clEnqueueWriteBuffer(part->command_queue, part->centroids_d, CL_FALSE, 0, num_of_clusters * 4 * sizeof(int), centroids, 0, NULL, NULL));
+        clStatus = keepFirstError(clStatus, clEnqueueFillBuffer(part->command_queue, part->centroids_sums_d, &init_zero, sizeof(long), 0, num_of_clusters * 5 * sizeof(long), 0, NULL, NULL));
+        clStatus = keepFirstError(clStatus, clSetKernelArg(part->kernel_find_closest_centroids, part->iteration_arg_index, sizeof(int), (void *)&iteration));
+        clStatus = keepFirstError(clStatus, clEnqueueNDRangeKernel(part->command_queue, part->kernel_find_closest_centroids, 1, NULL, &global_size_pixels, &local_size, 0, NULL, NULL));
+        clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(part->command_queue, part->changed_pixels_d, CL_FALSE, iteration * sizeof(int), sizeof(int), &part->changed_pixels, 0, NULL, NULL));
+        clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(part->command_queue, part->centroids_sums_d, CL_FALSE, 0, num_of_clusters * 5 * sizeof(long), part->centroids_sums, 0, NULL, &part->read_event));
+        clStatus = keepFirstError(clStatus, clFlush(part->command_queue));
+    }
+
+    // Reduce partial sums in order of devices, so result does not depend on which device finishes first
+    for (cl_uint d = 0; d < multi->num_devices; d++) {
+        DevicePart *part = &multi->parts[d];
+        if (part->read_event == NULL)
+            continue;
+        clStatus = keepFirstError(clStatus, clWaitForEvents(1, &part->read_event));
+        clReleaseEvent(part->read_event);
+        part->read_event = NULL;
+        for (int i = 0; i < num_of_clusters * 5; i++)
+            centroids_sums[i] += part->centroids_sums[i];
+        *changed_pixels += part->changed_pixels;
+    }
+    return clStatus;
+}
+
+cl_int readMultiDeviceIndices(MultiDevice *multi, int *closest_centroid_indices){
+    //every device copies indices of its range back to host
+    cl_int clStatus = CL_SUCCESS;
+    for (cl_uint d = 0; d < multi->num_devices; d++) {
+        DevicePart *part = &multi->parts[d];
+        if (part->num_points > 0)
+            clStatus = keepFirstError(clStatus, clEnqueueReadBuffer(part->command_queue, part->closest_centroid_indices_d, CL_FALSE, 0, part->num_points * sizeof(int),
+                                                                    closest_centroid_indices + part->first_point, 0, NULL, NULL));
+    }
+    for (cl_uint d = 0; d < multi->num_devices; d++)
+        clStatus = keepFirstError(clStatus, clFinish(multi->parts[d].command_queue));
+    return clStatus;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (getOption(argc, argv, "list-devices") != NULL) {
+        printDevices();
+        return 0;
+    }
+
+    //1st argument is image name including format, 2nd number of clusters and 3rd number of iterations
+    const char *image_name = getPositionalArg(argc, argv, 1);
+    const char *clusters_arg = getPositionalArg(argc, argv, 2);
+    const char *iterations_arg = getPositionalArg(argc, argv, 3);
+    if (iterations_arg == NULL) {
+        fprintf(stderr, "Usage: %s <image> <clusters> <iterations> [options]\n", argv[0]);
+        exit(1);
+    }
+
+    //Load image from file
+	FIBITMAP *imageLoad = FreeImage_Load(FIF_PNG, image_name, 0);
+    if (imageLoad == NULL) {
+        fprintf(stderr, "Can not load image %s.\n", image_name);
+        exit(1);
+    }
+	//Convert it to a 32-bit image
+    FIBITMAP *imageLoad32 = FreeImage_ConvertTo32Bits(imageLoad);
+
+    //Get image dimensions
+    int width = FreeImage_GetWidth(imageLoad32);
+	int height = FreeImage_GetHeight(imageLoad32);
+	int pitch = FreeImage_GetPitch(imageLoad32);
+    int num_pixels = width * height;
+
+	//Prepare room for a raw data copy of the image
+    unsigned char *imageIn = (unsigned char *)malloc(height*pitch * sizeof(unsigned char));
+
+    //Extract raw data from the image
+	FreeImage_ConvertToRawBits(imageIn, imageLoad32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+
+    //Free source image data free
+	FreeImage_Unload(imageLoad32);
+	FreeImage_Unload(imageLoad);
+
+    //get number of clusters from 2nd argument and num of iterations from 3rd argument
+    int num_of_clusters = atoi(clusters_arg);
+    int num_of_iterations = atoi(iterations_arg);
+
+    // Device options: --device-type=gpu|cpu|accelerator|default|all (gpu if not given), --device-name=<part of name>,
+    // --max-devices=<n> (all if not given), --sub-devices=<compute units> splits every device to sub-devices of that many compute units,
+    // --local-size=<n>, --no-fallback exits instead of running on OpenMP threads when no device can be used
+    cl_device_type device_type = parseDeviceType(getOption(argc, argv, "device-type"));
+    if (device_type == 0) {
+        fprintf(stderr, "Unknown device type %s, use gpu, cpu, accelerator, default or all.\n", getOption(argc, argv, "device-type"));
+        exit(1);
+    }
+    const char *device_name_filter = getOption(argc, argv, "device-name");
+    cl_uint max_devices = 0;
+    const char *max_devices_arg = getOption(argc, argv, "max-devices");
+    if (max_devices_arg != NULL)
+        max_devices = atoi(max_devices_arg);
+    cl_uint compute_units_per_sub_device = 0;
+    const char *sub_devices_arg = getOption(argc, argv, "sub-devices");
+    if (sub_devices_arg != NULL)
+        compute_units_per_sub_device = atoi(sub_devices_arg);
+    size_t local_size = 256;
+    const char *local_size_arg = getOption(argc, argv, "local-size");
+    if (local_size_arg != NULL)
+        local_size = atoi(local_size_arg);
+    int fallback = getOption(argc, argv, "no-fallback") == NULL;
+
+    //centroid init array
+    int *centroids = (int*)malloc(num_of_clusters * 4 * sizeof(int));
+    initCentroids(centroids, num_of_clusters, imageIn, width * height);
+
+    //init array for keeping centroid sums reduced from all devices
+    long *centroids_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+
+    //init array for keeping indices of closest centroid, -1 means pixel has no centroid yet
+    int *closest_centroid_indices = (int*)malloc(width * height * sizeof(int));
+    for (int point = 0; point < num_pixels; point++)
+        closest_centroid_indices[point] = -1;
+
+    MultiDevice multi;
+    int devices_available = setupMultiDevice(&multi, device_type, device_name_filter, max_devices, compute_units_per_sub_device,
+                                             imageIn, num_pixels, num_of_clusters, num_of_iterations) == 0;
+    if (!devices_available) {
+        if (!fallback)
+            exit(1);
+        fprintf(stderr, "Falling back to OpenMP.\n");
+    }
+
+    if (devices_available)
+        printf("%s clusters:%s devices:%u\n", image_name, clusters_arg, multi.num_devices);
+    else
+        printf("%s clusters:%s device:openmp threads:%d\n", image_name, clusters_arg, omp_get_max_threads());
+
+    int converged_iteration = -1;
+    for (int iteration = 0; iteration < (num_of_iterations); iteration++) {
+
+        // Start measuring time
+        struct timespec clock_start, clock_end;
+        clock_gettime(CLOCK_MONOTONIC, &clock_start);
+
+        // Step 1: go through all points and find closest centroid, on all devices or on host threads
+        long changed_pixels = 0;
+        if (devices_available && checkStatus(runMultiDeviceIteration(&multi, centroids, num_of_clusters, centroids_sums, &changed_pixels, local_size, iteration), "iteration")) {
+            // Sums of failed iteration are partial, host redoes whole iteration and devices are not used anymore
+            fprintf(stderr, "Devices failed, continuing on OpenMP threads.\n");
+            releaseMultiDevice(&multi);
+            devices_available = 0;
+            memset(centroids_sums, 0, num_of_clusters * 5 * sizeof(long));
+            changed_pixels = 0;
+        }
+        if (!devices_available)
+            changed_pixels = findClosestCentroidsHost(imageIn, centroids, num_of_clusters, 0, num_pixels, closest_centroid_indices, centroids_sums);
+
+        // Step 2: for each centroid compute average which will be new centroid
+        for(int centroid = 0; centroid < (num_of_clusters); centroid++){
+            applyNewCentroidValue(centroid, centroids, centroids_sums);
+        }
+
+        // Stop measuring time
+        clock_gettime(CLOCK_MONOTONIC, &clock_end);
+        long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+        printf("%.4f\n", nanosecs/(1000.0*1000.0));
+
+        // Stop once no pixel changed centroid
+        if (changed_pixels == 0) {
+            converged_iteration = iteration;
+            break;
+        }
+    }
+    if (converged_iteration >= 0)
+        printf("converged in iteration %d\n", converged_iteration + 1);
+
+    // Copy indices from last iteration back to host
+    if (devices_available) {
+        if (checkStatus(readMultiDeviceIndices(&multi, closest_centroid_indices), "clEnqueueReadBuffer")) {
+            // Indices are recomputed on host from final centroids, sums of this pass are not needed
+            findClosestCentroidsHost(imageIn, centroids, num_of_clusters, 0, num_pixels, closest_centroid_indices, centroids_sums);
+        }
+        releaseMultiDevice(&multi);
+    }
+
+    //apply new colours to input image
+    applyNewColoursToImage(imageIn, closest_centroid_indices, pitch*height, centroids);
+
+    // Save image
+	FIBITMAP *imageOutBitmap = FreeImage_ConvertFromRawBits(imageIn, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
+	FreeImage_Save(FIF_PNG, imageOutBitmap, "output/test_opencl_multi.png", 0);
+	FreeImage_Unload(imageOutBitmap);
+}
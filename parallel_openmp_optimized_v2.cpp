@@ -2,10 +2,33 @@
 #include <stdlib.h>
 #include <cstdlib>
 #include <string.h>
+#include <limits.h>
 #include <math.h>
 #include <time.h>
+#include <unistd.h>
 #include <omp.h>
+#include <algorithm>
 #include "FreeImage.h"
+#include "image_io.h"
+#include "instrumentation.h"
+#include "cost_model.h"
+#include "numa_utils.h"
+#include "arena.h"
+#include "tile_scheduler.h"
+#include "png_io.h"
+#include "colour_space.h"
+#include "palette.h"
+#include "frame_cache.h"
+#include "dither.h"
+#include "kd_filter.h"
+#include "bisect.h"
+#include "args.h"
+
+// Pixels sampled to estimate number of distinct colours for --algorithm=auto, default batch of minibatch algorithm
+#define DISTINCT_SAMPLE_SIZE 65536
+#define DEFAULT_BATCH_SIZE 16384
+// Fraction of pixels which may change centroid in last iteration of frame of sequence, unless --tolerance is given
+#define DEFAULT_SEQUENCE_TOLERANCE 0.001
 
 void printImage(unsigned char *image, int size){
     //helper function for debugging purposes
@@ -59,117 +82,1027 @@ void applyNewCentroidValue(int centroidIndex, int* centroids, long *centroids_su
         centroids_sums[centroidIndex*5 + i] = 0;
 }
 
-int findClosestCentroid(int *centroids, int num_of_clusters, int blue, int green, int red, int alpha){
-    //we init index and distance to 1st centroid, than compute for the remaining ones
+template <int CHANNELS>
+int findClosestCentroidSquared(int *centroids, int num_of_clusters, unsigned char *point){
+    //closest centroid by squared integer distance, which is in same order as distance, comparing only first CHANNELS
+    //channels (3 for images with constant alpha, which all centroids then share); ties go to lower index
     int centroidIndex = 0;
-    float minimum_distance = sqrt(pow((float)(centroids[0] - blue), 2.0) + pow((float)(centroids[1] - green), 2.0) + pow((float)(centroids[2] - red), 2.0)
-        + pow((float)(centroids[3] - alpha), 2.0));
-
-    for(int i = 4; i < (num_of_clusters * 4); i = i + 4){
-        float current_distance = sqrt(pow((float)(centroids[i] - blue), 2.0) + pow((float)(centroids[i+1] - green), 2.0) + pow((float)(centroids[i+2] - red), 2.0)
-            + pow((float)(centroids[i+3] - alpha), 2.0));
-        if(current_distance < minimum_distance){
-            centroidIndex = i / 4;
+    int minimum_distance = INT_MAX;
+    for (int i = 0; i < num_of_clusters; i++) {
+        int *centroid = centroids + i * 4;
+        int current_distance = 0;
+        for (int channel = 0; channel < CHANNELS; channel++)
+            current_distance += (centroid[channel] - point[channel]) * (centroid[channel] - point[channel]);
+        if (current_distance < minimum_distance) {
+            centroidIndex = i;
             minimum_distance = current_distance;
         }
     }
     return centroidIndex;
 }
 
-void applyNewColoursToImage(unsigned char* image, int* closest_centroid_indices,  int size, int num_of_clusters, int* centroids){
-    //for each pixel in image assign it new centroid colour
-    for(int i = 0; i < (size); i = i + 4){
-        //find colour centroid for this pixel
-        int closestCentroid = closest_centroid_indices[i/4];
-        //apply centroid colour to this pixel
-        image[i] = centroids[closestCentroid * 4];
-        image[i+1] = centroids[closestCentroid * 4 + 1];
-        image[i+2] = centroids[closestCentroid * 4 + 2];
-        image[i+3] = centroids[closestCentroid * 4 + 3];
+template <int CHANNELS>
+int findClosestCentroidPruned(int *centroids, int num_of_clusters, int *centroid_distances, unsigned char *point, int current, long *evaluations){
+    //starts from current centroid and skips centroids c with d(best, c) > 2 d(pixel, best), which can not be closer,
+    //distances are squared so condition is d^2(best, c) > 4 d^2(pixel, best); ties go to lower index as in findClosestCentroidSquared
+    int centroidIndex = current >= 0 ? current : 0;
+    int *centroid = centroids + centroidIndex * 4;
+    int minimum_distance = 0;
+    for (int channel = 0; channel < CHANNELS; channel++)
+        minimum_distance += (centroid[channel] - point[channel]) * (centroid[channel] - point[channel]);
+    long point_evaluations = 1;
+
+    for (int i = 0; i < num_of_clusters; i++) {
+        if (i == centroidIndex || centroid_distances[centroidIndex * num_of_clusters + i] > 4 * minimum_distance)
+            continue;
+        centroid = centroids + i * 4;
+        int current_distance = 0;
+        for (int channel = 0; channel < CHANNELS; channel++)
+            current_distance += (centroid[channel] - point[channel]) * (centroid[channel] - point[channel]);
+        point_evaluations++;
+        if (current_distance < minimum_distance || (current_distance == minimum_distance && i < centroidIndex)) {
+            centroidIndex = i;
+            minimum_distance = current_distance;
+        }
     }
+    *evaluations += point_evaluations;
+    return centroidIndex;
 }
 
-int main(int argc, char *argv[]){
+template <int CHANNELS>
+void assignPoints(unsigned char *points, int *point_weights, int *point_indices, long range_start, long range_end, int *centroids,
+                  int num_of_clusters, int *centroid_distances, long *sums, long *reassigned_pixels, long *sse, long *evaluations){
+    //assigns points of range to closest centroids (pruned when centroid_distances are given) and adds them to sums,
+    //alpha is neither compared nor summed with 3 channels
+    for (long point = range_start; point < range_end; point++) {
+        unsigned char *colour_in = points + point * 4;
+        int weight = point_weights != NULL ? point_weights[point] : 1;
+
+        int closest_centroid;
+        if (centroid_distances != NULL) {
+            closest_centroid = findClosestCentroidPruned<CHANNELS>(centroids, num_of_clusters, centroid_distances, colour_in, point_indices[point], evaluations);
+        } else {
+            closest_centroid = findClosestCentroidSquared<CHANNELS>(centroids, num_of_clusters, colour_in);
+            *evaluations += num_of_clusters;
+        }
+        if (point_indices[point] != closest_centroid)
+            *reassigned_pixels += weight;
+        point_indices[point] = closest_centroid;
+
+        // squared error to assigned centroid gives inertia of this iteration without another pass
+        int *colour = centroids + closest_centroid * 4;
+        int error = 0;
+        for (int channel = 0; channel < CHANNELS; channel++)
+            error += (colour_in[channel] - colour[channel]) * (colour_in[channel] - colour[channel]);
+        *sse += (long)weight * error;
+
+        // also save colors to sums of this thread which will be used to update centroids
+        long *sum = sums + closest_centroid * 5;
+        for (int channel = 0; channel < CHANNELS; channel++)
+            sum[channel] += (long)colour_in[channel] * weight;
+        sum[4] += weight;
+    }
+}
+
+template <int CHANNELS>
+void sumAssignedPoints(unsigned char *points, int *point_indices, long range_start, long range_end, int *centroids, long *sums, long *sse){
+    //adds points of range to sums of centroids they already have, without searching for closest one
+    for (long point = range_start; point < range_end; point++) {
+        unsigned char *colour_in = points + point * 4;
+        int *colour = centroids + point_indices[point] * 4;
+        long *sum = sums + point_indices[point] * 5;
+        int error = 0;
+        for (int channel = 0; channel < CHANNELS; channel++) {
+            error += (colour_in[channel] - colour[channel]) * (colour_in[channel] - colour[channel]);
+            sum[channel] += colour_in[channel];
+        }
+        *sse += error;
+        sum[4]++;
+    }
+}
+
+template <int CHANNELS>
+void assignChangedPoints(unsigned char *points, int *point_indices, long range_start, long range_end, int *centroids, int num_of_clusters,
+                         int *centroid_distances, long *sums, unsigned char *changed_tiles, long tile_size, long *reassigned_pixels,
+                         long *sse, long *evaluations){
+    //assigns pixels of range which are in changed tiles of frame, pixels of other tiles keep centroid from previous frame
+    for (long start = range_start; start < range_end; ) {
+        long tile = start / tile_size;
+        long end = (tile + 1) * tile_size < range_end ? (tile + 1) * tile_size : range_end;
+        if (changed_tiles[tile])
+            assignPoints<CHANNELS>(points, NULL, point_indices, start, end, centroids, num_of_clusters, centroid_distances, sums,
+                                   reassigned_pixels, sse, evaluations);
+        else
+            sumAssignedPoints<CHANNELS>(points, point_indices, start, end, centroids, sums, sse);
+        start = end;
+    }
+}
+
+int getConstantAlpha(unsigned char *image, int num_pixels){
+    //returns alpha which all pixels have (255 for opaque image), -1 if it differs
+    int alpha = image[3];
+    int differs = 0;
+    #pragma omp parallel for schedule(static) reduction(|:differs)
+    for (int point = 0; point < num_pixels; point++)
+        differs |= image[(long)point * 4 + 3] != alpha;
+    return differs ? -1 : alpha;
+}
+
+void computeCentroidDistances(int *centroids, int num_of_clusters, int *centroid_distances){
+    //squared distances between all pairs of centroids, used for pruning
+    for (int a = 0; a < num_of_clusters; a++) {
+        for (int b = 0; b < num_of_clusters; b++) {
+            int distance = 0;
+            for (int channel = 0; channel < 4; channel++)
+                distance += (centroids[a * 4 + channel] - centroids[b * 4 + channel]) * (centroids[a * 4 + channel] - centroids[b * 4 + channel]);
+            centroid_distances[a * num_of_clusters + b] = distance;
+        }
+    }
+}
+
+int buildColourHistogram(unsigned char *image, int num_pixels, unsigned int *colours, int *weights, int *pixel_colours){
+    //distinct colours of image are sorted copy of pixels without duplicates, weights are their counts and pixel_colours
+    //maps every pixel to its colour, returns number of distinct colours
+    memcpy(colours, image, (size_t)num_pixels * 4);
+    std::sort(colours, colours + num_pixels);
+
+    int num_colours = 0;
+    for (int i = 0; i < num_pixels; i++) {
+        if (num_colours > 0 && colours[num_colours - 1] == colours[i]) {
+            weights[num_colours - 1]++;
+        } else {
+            colours[num_colours] = colours[i];
+            weights[num_colours++] = 1;
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int point = 0; point < num_pixels; point++) {
+        unsigned int colour;
+        memcpy(&colour, image + (long)point * 4, 4);
+        pixel_colours[point] = std::lower_bound(colours, colours + num_colours, colour) - colours;
+    }
+    return num_colours;
+}
+
+// SSIM is computed on luma of non-overlapping blocks of this size, constants are for 8 bit values
+#define SSIM_BLOCK 8
+#define SSIM_C1 (0.01 * 255 * 0.01 * 255)
+#define SSIM_C2 (0.03 * 255 * 0.03 * 255)
+
+double getLuma(unsigned char *pixel){
+    return 0.114 * pixel[0] + 0.587 * pixel[1] + 0.299 * pixel[2];
+}
+
+double applyNewColoursToImage(unsigned char* image, int* closest_centroid_indices, int width, int height, int pitch, int* centroids, double *ssim,
+                              TileScheduler *scheduler, PaletteLookup *lookup){
+    //for each pixel in image assign it new centroid colour, returns sum of squared errors against original image
+    //and computes mean SSIM over blocks of SSIM_BLOCK rows and columns when ssim is not NULL, all in one pass;
+    //rows of blocks are split statically or, with scheduler, in tiles of one row of blocks which can be stolen;
+    //with lookup pixels get nearest palette colour (centroids are palette) and indices are not used
+    int block_columns = (width + SSIM_BLOCK - 1) / SSIM_BLOCK;
+    int block_rows = (height + SSIM_BLOCK - 1) / SSIM_BLOCK;
+    long sse = 0;
+    double ssim_sum = 0;
+    if (scheduler != NULL)
+        resetTileScheduler(scheduler, block_rows, 1, omp_get_max_threads());
+
+    #pragma omp parallel reduction(+:sse, ssim_sum)
+    {
+        // sums of original luma, new luma, their squares and product for every block in current row of blocks
+        double *block_stats = ssim != NULL ? (double *)malloc(block_columns * 5 * sizeof(double)) : NULL;
+        int thread = omp_get_thread_num();
+        long range_start, range_end;
+        int has_range = scheduler != NULL ? nextTile(scheduler, thread, &range_start, &range_end) : getStaticRange(block_rows, &range_start, &range_end);
+
+        for (; has_range; has_range = scheduler != NULL && nextTile(scheduler, thread, &range_start, &range_end))
+        for (int block_row = range_start; block_row < range_end; block_row++) {
+            if (block_stats != NULL)
+                memset(block_stats, 0, block_columns * 5 * sizeof(double));
+            int row_end = (block_row + 1) * SSIM_BLOCK < height ? (block_row + 1) * SSIM_BLOCK : height;
+
+            for (int y = block_row * SSIM_BLOCK; y < row_end; y++) {
+                for (int x = 0; x < width; x++) {
+                    unsigned char *pixel = image + (long)y * pitch + x * 4;
+                    //find colour centroid for this pixel
+                    int closestCentroid = lookup != NULL ? findPaletteColour(lookup, pixel) : closest_centroid_indices[(long)y * width + x];
+                    int *colour = centroids + closestCentroid * 4;
+
+                    double luma_before = block_stats != NULL ? getLuma(pixel) : 0;
+                    for (int channel = 0; channel < 4; channel++) {
+                        int error = pixel[channel] - colour[channel];
+                        sse += error * error;
+                        //apply centroid colour to this pixel
+                        pixel[channel] = colour[channel];
+                    }
+
+                    if (block_stats != NULL) {
+                        double luma_after = getLuma(pixel);
+                        double *stats = block_stats + (x / SSIM_BLOCK) * 5;
+                        stats[0] += luma_before;
+                        stats[1] += luma_after;
+                        stats[2] += luma_before * luma_before;
+                        stats[3] += luma_after * luma_after;
+                        stats[4] += luma_before * luma_after;
+                    }
+                }
+            }
+
+            for (int block = 0; block_stats != NULL && block < block_columns; block++) {
+                int block_width = (block + 1) * SSIM_BLOCK < width ? SSIM_BLOCK : width - block * SSIM_BLOCK;
+                double n = (double)block_width * (row_end - block_row * SSIM_BLOCK);
+                double *stats = block_stats + block * 5;
+                double mean_before = stats[0] / n, mean_after = stats[1] / n;
+                double variance_before = stats[2] / n - mean_before * mean_before;
+                double variance_after = stats[3] / n - mean_after * mean_after;
+                double covariance = stats[4] / n - mean_before * mean_after;
+                ssim_sum += (2 * mean_before * mean_after + SSIM_C1) * (2 * covariance + SSIM_C2) /
+                            ((mean_before * mean_before + mean_after * mean_after + SSIM_C1) * (variance_before + variance_after + SSIM_C2));
+            }
+        }
+        free(block_stats);
+    }
+
+    if (ssim != NULL)
+        *ssim = ssim_sum / ((double)block_rows * block_columns);
+    return sse;
+}
+
+typedef struct {
+    // options which are same for all images of batch
+    int num_of_clusters;
+    int num_of_iterations;
+    int algorithm;
+    int auto_algorithm;
+    int auto_threads;
+    int max_threads;
+    int batch_size;
+    const char *cost_model_file;
+    const char *quality;
+    int ssim;
+    int numa;
+    // NULL for static schedule
+    TileScheduler *scheduler;
+    long tile_size;
+    // png files are read and written by all threads, level is zlib compression level of output
+    int parallel_png;
+    int png_level;
+    // space in which pixels are clustered
+    int colour_space;
+    // fixed palette which images are remapped to without clustering, NULL if there is none
+    PaletteLookup *palette_lookup;
+    // file final centroids are written to, centroids are kept as start of next image with warm_start and iterations
+    // stop when at most tolerance of pixels changed centroid (-1 is never)
+    const char *export_palette;
+    int warm_start;
+    double tolerance;
+
+    // state kept between images: measurements, arena which is reset for every image, thread layout and centroid replicas;
+    // with --numa buffers placed by first touch come from placed_arena, which gives its pages back on every reset
+    Instrumentation inst;
+    Arena arena;
+    Arena placed_arena;
+    NumaLayout layout;
+    int **node_centroids;
+    // size of last image, for report
+    int width;
+    int height;
+    // initial centroids in clustering space (from --init-palette or previous image), first warm_count are used
+    int *warm_centroids;
+    int warm_count;
+    // tile hashes and centroid indices of previous frame of sequence, NULL when images are not sequence
+    FrameCache *frame_cache;
+    // centroids start from bisecting clusters, which stops early at target PSNR when it is above 0; active_clusters
+    // is number of clusters it left, used by next images which start from its centroids
+    int hierarchical;
+    double target_psnr;
+    int active_clusters;
+    // dither mode of remap and its threshold matrix (size by size, NULL for error diffusion)
+    int dither;
+    float *dither_thresholds;
+    int dither_size;
+} Engine;
+
+int saveOutputImage(Engine *engine, unsigned char *imageIn, int width, int height, int pitch, const char *output_name){
+    //saves image in format given by extension of output name and prints its quality, returns 0 on success
+    Instrumentation *inst = &engine->inst;
+    double phase_start = phaseStart(inst);
+    const char *extension = strrchr(output_name, '.') != NULL ? strrchr(output_name, '.') : "";
+    if (engine->parallel_png && strcasecmp(extension, ".png") == 0) {
+        if (writePngImage(output_name, imageIn, width, height, pitch, engine->png_level) != 0)
+            return 1;
+    } else if (saveImage(output_name, imageIn, width, height, pitch) != 0) {
+        return 1;
+    }
+    phaseEnd(inst, PHASE_ENCODE, phase_start, (long)height * pitch);
+
+    if (engine->quality != NULL) {
+        printf("psnr: %.4f", getPsnr(inst->output_sse, inst->num_values));
+        if (engine->ssim)
+            printf(" ssim: %.4f", inst->output_ssim);
+        printf("\n");
+    }
+    return 0;
+}
+
+void getOutputName(const char *image_name, const char *output_format, char *output_name, size_t size){
+    //output name is image name without directory and extension
+    const char *base_name = strrchr(image_name, '/') != NULL ? strrchr(image_name, '/') + 1 : image_name;
+    snprintf(output_name, size, "output/%.*s_v2.%s", (int)strcspn(base_name, "."), base_name, output_format);
+}
+
+int clusterImage(Engine *engine, const char *image_name, const char *output_name){
+    //clusters one image and saves it, returns 0 on success; all buffers come from arena and are valid until next image
+    Instrumentation *inst = &engine->inst;
+    Arena *arena = &engine->arena;
+    resetArena(arena);
+    resetArena(&engine->placed_arena);
+    //hierarchical start may end with fewer clusters, images which start warm from it keep using that many
+    int num_of_clusters = engine->hierarchical && engine->warm_count == 0 ? engine->num_of_clusters : engine->active_clusters;
+    int num_of_iterations = engine->num_of_iterations;
+    int algorithm = engine->algorithm;
+    int auto_algorithm = engine->auto_algorithm;
+    int auto_threads = engine->auto_threads;
+    int max_threads = engine->max_threads;
+    int batch_size = engine->batch_size;
+    const char *cost_model_file = engine->cost_model_file;
+    const char *quality = engine->quality;
+    int ssim = engine->ssim;
+    int numa = engine->numa;
+    //pages reused from previous image are already on node of thread which touched them then
+    Arena *placed_arena = numa ? &engine->placed_arena : arena;
+    TileScheduler *scheduler = engine->scheduler;
+    int colour_space = engine->colour_space;
+
     //Load image from file
-    //1st argument is image name including format
-	FIBITMAP *imageLoad = FreeImage_Load(FIF_PNG, argv[1], 0);
-	//Convert it to a 32-bit image
-    FIBITMAP *imageLoad32 = FreeImage_ConvertTo32Bits(imageLoad);
-	
-    //Get image dimensions
-    int width = FreeImage_GetWidth(imageLoad32);
-	int height = FreeImage_GetHeight(imageLoad32);
-	int pitch = FreeImage_GetPitch(imageLoad32);
-
-	//Prepare room for a raw data copy of the image
-    unsigned char *imageIn = (unsigned char *)malloc(height*pitch * sizeof(unsigned char));
-
-    //Extract raw data from the image
-	FreeImage_ConvertToRawBits(imageIn, imageLoad32, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-
-    //Free source image data free
-	FreeImage_Unload(imageLoad32);
-	FreeImage_Unload(imageLoad);
-
-    //get number of clusters from 2nd argument and num of iterations from 3rd argument
-    int num_of_clusters = atoi(argv[2]);
-    int num_of_iterations = atoi(argv[3]); 
+    //raw images (see generate_image) and 8 bit PNM are read without decoding, png is decoded and converted in one
+    //parallel pass when it can be, other formats (and PNM with other maxval) are detected and decoded by FreeImage;
+    //image data is allocated from arena
+    int width, height, pitch;
+    unsigned char *imageIn = NULL;
+    double phase_start = phaseStart(inst);
+    if (isRawImage(image_name)) {
+        imageIn = readRawImage(image_name, &width, &height, &pitch, arenaAllocator, arena);
+        if (imageIn == NULL)
+            return 1;
+        phaseEnd(inst, PHASE_DECODE, phase_start, getFileSize(image_name));
+    } else if (isPnmImage(image_name) && (imageIn = readPnmImage(image_name, &width, &height, &pitch, arenaAllocator, arena)) != NULL) {
+        phaseEnd(inst, PHASE_DECODE, phase_start, getFileSize(image_name));
+    } else if (engine->parallel_png && isPngImage(image_name) &&
+               (imageIn = readPngImage(image_name, &width, &height, &pitch, arenaAllocator, arena)) != NULL) {
+        phaseEnd(inst, PHASE_DECODE, phase_start, getFileSize(image_name));
+    } else {
+        FIBITMAP *imageLoad = decodeImage(image_name);
+        if (imageLoad == NULL)
+            return 1;
+        phaseEnd(inst, PHASE_DECODE, phase_start, getFileSize(image_name));
+        phase_start = phaseStart(inst);
+        imageIn = convertImage(imageLoad, &width, &height, &pitch, arenaAllocator, arena);
+        if (imageIn == NULL)
+            return 1;
+        phaseEnd(inst, PHASE_CONVERT, phase_start, (long)height * pitch);
+    }
+    int num_pixels = width * height;
+    inst->num_values = (long)num_pixels * 4;
+    engine->width = width;
+    engine->height = height;
+
+    if (engine->palette_lookup != NULL) {
+        //fixed palette: no clustering, every pixel gets nearest palette colour during remap, time of which is printed
+        //in place of iteration times
+        struct timespec clock_start, clock_end;
+        clock_gettime(CLOCK_MONOTONIC, &clock_start);
+        phase_start = phaseStart(inst);
+        inst->iterations_done = 0;
+        preparePaletteLookup(engine->palette_lookup, getConstantAlpha(imageIn, num_pixels));
+        int *palette_indices = NULL;
+        if (engine->dither != DITHER_NONE) {
+            palette_indices = (int*)arenaAlloc(arena, (size_t)num_pixels * sizeof(int));
+            ditherImage(engine->dither, imageIn, width, height, pitch, engine->palette_lookup, engine->dither_thresholds,
+                        engine->dither_size, palette_indices);
+        }
+        inst->output_sse = applyNewColoursToImage(imageIn, palette_indices, width, height, pitch, engine->palette_lookup->palette->colours,
+                                                  ssim ? &inst->output_ssim : NULL, scheduler, palette_indices != NULL ? NULL : engine->palette_lookup);
+        phaseEnd(inst, PHASE_REMAP, phase_start, (long)num_pixels * 8);
+        clock_gettime(CLOCK_MONOTONIC, &clock_end);
+        long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
+        printf("%s palette:%d\n%.4f\n", image_name, engine->palette_lookup->palette->num_colours, nanosecs/(1000.0*1000.0));
+        return saveOutputImage(engine, imageIn, width, height, pitch, output_name);
+    }
+
+    if (auto_algorithm || auto_threads) {
+        CostModel model;
+        initCostModel(&model);
+        readCostModel(cost_model_file, &model);
+        Workload work = {num_pixels, estimateDistinctColours(imageIn, num_pixels, DISTINCT_SAMPLE_SIZE), num_of_clusters, num_of_iterations, batch_size};
+        Choice choice;
+        chooseConfiguration(&model, &work, auto_algorithm ? -1 : algorithm, max_threads, auto_threads, 0, 0, &choice, stderr);
+        algorithm = choice.algorithm;
+        if (auto_threads)
+            omp_set_num_threads(choice.threads);
+        printf("auto algorithm:%s threads:%d predicted:%.4f distinct:%ld\n", algorithm_names[algorithm], omp_get_max_threads(),
+               choice.predicted_ms, work.distinct_colours);
+    }
+
+    //in other colour space pixels are clustered in converted copy and image itself is only remapped, with colours
+    //of centroids converted back
+    unsigned char *clusterIn = imageIn;
+    if (colour_space != COLOUR_SPACE_BGRA) {
+        phase_start = phaseStart(inst);
+        clusterIn = (unsigned char*)arenaAlloc(placed_arena, (size_t)num_pixels * 4);
+        if (clusterIn == NULL)
+            return 1;
+        convertToColourSpace(imageIn, clusterIn, num_pixels, colour_space);
+        phaseEnd(inst, PHASE_CONVERT, phase_start, (long)num_pixels * 8);
+    }
 
     //centroid init array
-    int *centroids = (int*)malloc(num_of_clusters * 4 * sizeof(int));
-    initCentroids(centroids, num_of_clusters, imageIn, width * height);
+    phase_start = phaseStart(inst);
+    NumaLayout *layout = &engine->layout;
+    if (numa) {
+        // layout is kept for whole batch, unless automatic number of threads changed
+        if (engine->node_centroids == NULL || layout->num_threads != omp_get_max_threads()) {
+            if (engine->node_centroids != NULL) {
+                freeNodeReplicas(layout, (void**)engine->node_centroids);
+                freeNumaLayout(layout);
+            }
+            initNumaLayout(layout, getenv("OMP_PROC_BIND") == NULL);
+            engine->node_centroids = (int**)allocateNodeReplicas(layout, num_of_clusters * 4 * sizeof(int));
+            printf("numa nodes:%d threads:%d bound:%s\n", layout->num_nodes, layout->num_threads, getenv("OMP_PROC_BIND") == NULL ? "yes" : "OMP_PROC_BIND");
+        }
+        // image was filled by one thread, copy it so every thread's part of it is on its node (converted image was
+        // already written by them)
+        unsigned char *imagePlaced = clusterIn == imageIn ? (unsigned char*)arenaAlloc(placed_arena, (size_t)num_pixels * 4) : NULL;
+        if (imagePlaced != NULL) {
+            placeCopy(imagePlaced, imageIn, num_pixels, 4);
+            imageIn = clusterIn = imagePlaced;
+        }
+    }
+    int **node_centroids = engine->node_centroids;
+    int *centroids = (int*)arenaAlloc(arena, num_of_clusters * 4 * sizeof(int));
+    initCentroids(centroids, num_of_clusters, clusterIn, width * height);
+    //warm start replaces them with given palette or centroids of previous image, if palette is smaller rest stay
+    memcpy(centroids, engine->warm_centroids, engine->warm_count * 4 * sizeof(int));
+    //hierarchical start splits clusters of image instead, unless there are warm centroids; it may end with fewer
+    //clusters, which are then used for rest of image
+    if (engine->hierarchical && engine->warm_count == 0) {
+        double psnr;
+        num_of_clusters = bisectCentroids(centroids, num_of_clusters, clusterIn, num_pixels, engine->target_psnr, &psnr, arena);
+        printf("hierarchical clusters:%d psnr:%.4f\n", num_of_clusters, psnr);
+        engine->active_clusters = num_of_clusters;
+    }
+
+    //images with same alpha in all pixels (opaque photos) are clustered on 3 channels, all centroids keep that alpha
+    int constant_alpha = getConstantAlpha(clusterIn, num_pixels);
+    for (int centroid = 0; centroid < num_of_clusters && constant_alpha >= 0; centroid++)
+        centroids[centroid * 4 + 3] = constant_alpha;
 
     //init array for keeping centroid current sums (sums of colors and number of points in centroid)
-    long *centroids_sums = (long*)calloc(num_of_clusters * 5, sizeof(long));
+    long *centroids_sums = (long*)arenaCalloc(arena, num_of_clusters * 5 * sizeof(long));
 
-    //init array for keeping indices of closest centroid
-    int *closest_centroid_indices = (int*)malloc(width * height * sizeof(int));
+    //init array for keeping indices of closest centroid, no pixel has centroid yet
+    //filled with same static schedule as assignment, so with --numa (fresh pages) they are first touched by thread
+    //which uses them
+    //frames of sequence keep indices of previous frame, its pixels in tiles which did not change keep their centroid
+    FrameCache *frame_cache = engine->frame_cache;
+    int reuse_indices = 0;
+    long num_changed_tiles = 0;
+    int *closest_centroid_indices;
+    if (frame_cache != NULL) {
+        closest_centroid_indices = prepareFrameCache(frame_cache, num_pixels, engine->tile_size, num_of_clusters);
+        if (closest_centroid_indices == NULL)
+            return 1;
+        num_changed_tiles = updateTileHashes(frame_cache, clusterIn);
+        reuse_indices = frame_cache->valid && (algorithm == ALGORITHM_LLOYD || algorithm == ALGORITHM_PRUNED);
+        frame_cache->valid = 0;
+    } else {
+        closest_centroid_indices = (int*)arenaAlloc(placed_arena, (size_t)num_pixels * sizeof(int));
+    }
+    if (!reuse_indices) {
+        #pragma omp parallel for schedule(static)
+        for (int point = 0; point < num_pixels; point++)
+            closest_centroid_indices[point] = -1;
+    }
 
-    printf("%s clusters:%s\n", argv[1], argv[2]);
+    //points which are clustered: pixels, or distinct colours with their counts as weights for histogram algorithm
+    unsigned char *points = clusterIn;
+    int num_points = num_pixels;
+    int *point_weights = NULL;
+    int *point_indices = closest_centroid_indices;
+    unsigned int *colours = NULL;
+    int *pixel_colours = NULL;
+    FilterTree filter_tree;
+    if (algorithm == ALGORITHM_HISTOGRAM || algorithm == ALGORITHM_FILTERING) {
+        colours = (unsigned int*)arenaAlloc(arena, (size_t)num_pixels * sizeof(unsigned int));
+        point_weights = (int*)arenaAlloc(arena, (size_t)num_pixels * sizeof(int));
+        pixel_colours = (int*)arenaAlloc(arena, (size_t)num_pixels * sizeof(int));
+        num_points = buildColourHistogram(clusterIn, num_pixels, colours, point_weights, pixel_colours);
+        points = (unsigned char*)colours;
+        point_indices = (int*)arenaAlloc(arena, (size_t)num_points * sizeof(int));
+        for (int point = 0; point < num_points; point++)
+            point_indices[point] = -1;
+        //filtering reorders colours so every node of tree has consecutive range of them
+        if (algorithm == ALGORITHM_FILTERING)
+            buildFilterTree(&filter_tree, colours, point_weights, num_points, pixel_colours, num_pixels, omp_get_max_threads(), arena);
+    }
+
+    //pruning needs distances between centroids, minibatch keeps exact centroids and number of pixels each has seen
+    int *centroid_distances = algorithm == ALGORITHM_PRUNED ? (int*)arenaAlloc(arena, (size_t)num_of_clusters * num_of_clusters * sizeof(int)) : NULL;
+    double *minibatch_centroids = NULL;
+    long *minibatch_counts = NULL;
+    int *batch_pixels = NULL;
+    int *batch_indices = NULL;
+    if (algorithm == ALGORITHM_MINIBATCH) {
+        if (batch_size > num_pixels)
+            batch_size = num_pixels;
+        minibatch_centroids = (double*)arenaAlloc(arena, num_of_clusters * 4 * sizeof(double));
+        for (int i = 0; i < num_of_clusters * 4; i++)
+            minibatch_centroids[i] = centroids[i];
+        minibatch_counts = (long*)arenaCalloc(arena, num_of_clusters * sizeof(long));
+        batch_pixels = (int*)arenaAlloc(arena, batch_size * sizeof(int));
+        batch_indices = (int*)arenaAlloc(arena, batch_size * sizeof(int));
+    }
+    phaseEnd(inst, PHASE_INIT, phase_start, (long)num_pixels * sizeof(int));
+
+    //every thread sums to its own copy, which are reduced after assignment, copies start on separate cache lines (pages
+    //with --numa) and every thread clears its own, so with --numa it is first touched on node of that thread
+    int num_threads = omp_get_max_threads();
+    long sums_alignment = numa ? PAGE_SIZE : ARENA_ALIGNMENT;
+    long sums_stride = (num_of_clusters * 5 * sizeof(long) + sums_alignment - 1) / sums_alignment * sums_alignment / sizeof(long);
+    long *thread_sums = (long*)arenaAlloc(placed_arena, num_threads * sums_stride * sizeof(long));
+    #pragma omp parallel num_threads(num_threads)
+    memset(thread_sums + omp_get_thread_num() * sums_stride, 0, sums_stride * sizeof(long));
+    //filtering keeps candidate centroids of every level of tree on path to current node
+    long candidates_stride = algorithm == ALGORITHM_FILTERING ? (long)num_of_clusters * (filter_tree.depth + 2) : 0;
+    int *filter_candidates = algorithm == ALGORITHM_FILTERING ? (int*)arenaAlloc(arena, num_threads * candidates_stride * sizeof(int)) : NULL;
+
+    if (frame_cache != NULL)
+        printf("%s clusters:%d changed tiles:%ld/%ld\n", image_name, num_of_clusters, num_changed_tiles, frame_cache->num_tiles);
+    else
+        printf("%s clusters:%d\n", image_name, num_of_clusters);
 
     for(int iteration = 0; iteration < (num_of_iterations); iteration++){
         // Start measuring time
         struct timespec clock_start, clock_end;
         clock_gettime(CLOCK_MONOTONIC, &clock_start);
 
-        //step 1: go through all points and find closest centroid
-        #pragma omp parallel for
-        for(int point = 0; point < (width*height); point++){
-            int imageStartingPointIndex = point * 4;
-            int blue = imageIn[imageStartingPointIndex];
-            int green = imageIn[imageStartingPointIndex + 1];
-            int red = imageIn[imageStartingPointIndex + 2];
-            int alpha = imageIn[imageStartingPointIndex + 3];
-
-            int closest_centroid = findClosestCentroid(centroids, num_of_clusters, blue, green, red, alpha);
-            closest_centroid_indices[point] = closest_centroid;
-
-            // also save colors to centroids_sums which will be used to update centroids
-            centroids_sums[closest_centroid*5] += blue;
-            centroids_sums[closest_centroid*5 + 1] += green;
-            centroids_sums[closest_centroid*5 + 2] += red;
-            centroids_sums[closest_centroid*5 + 3] += alpha;
-            centroids_sums[closest_centroid*5 + 4] += 1;
-        }
-        //step 2: for each centroid compute average which will be new centroid        
-        for(int centroid = 0; centroid < (num_of_clusters); centroid++){
-            applyNewCentroidValue(centroid, centroids, centroids_sums);
+        long reassigned_pixels = 0;
+        long sse = 0;
+        long evaluations = 0;
+        if (algorithm == ALGORITHM_MINIBATCH) {
+            //step 1: assign random batch of pixels, sampled pixels only depend on iteration
+            phase_start = phaseStart(inst);
+            #pragma omp parallel reduction(+:reassigned_pixels, sse)
+            {
+                int thread = omp_get_thread_num();
+                long thread_perf_start[NUM_PERF_EVENTS];
+                threadPerfStart(inst, thread, thread_perf_start);
+                #pragma omp for schedule(static)
+                for (int sample = 0; sample < batch_size; sample++) {
+                    int point = sampleHash(iteration + 1, sample) % num_pixels;
+                    unsigned char *pixel = clusterIn + (long)point * 4;
+                    int closest_centroid = constant_alpha >= 0 ? findClosestCentroidSquared<3>(centroids, num_of_clusters, pixel)
+                                                               : findClosestCentroidSquared<4>(centroids, num_of_clusters, pixel);
+                    if (closest_centroid_indices[point] != closest_centroid)
+                        reassigned_pixels++;
+                    int *colour = centroids + closest_centroid * 4;
+                    for (int channel = 0; channel < 4; channel++)
+                        sse += (pixel[channel] - colour[channel]) * (pixel[channel] - colour[channel]);
+                    batch_pixels[sample] = point;
+                    batch_indices[sample] = closest_centroid;
+                }
+                threadPerfEnd(inst, PHASE_ASSIGN, thread, thread_perf_start);
+            }
+            phaseEnd(inst, PHASE_ASSIGN, phase_start, (long)batch_size * (4 + 2 * sizeof(int)));
+            // pixels outside of batch are not assigned in this iteration
+            addDistanceEvaluations(inst, (long)batch_size * num_of_clusters, num_pixels, num_of_clusters);
+            // error of batch is scaled to whole image so it is comparable with other algorithms
+            sse = (long)((double)sse * num_pixels / batch_size);
+
+            //step 2: move centroids towards batch pixels with learning rate 1 / pixels seen by centroid, in batch order
+            phase_start = phaseStart(inst);
+            for (int sample = 0; sample < batch_size; sample++) {
+                int centroid = batch_indices[sample];
+                closest_centroid_indices[batch_pixels[sample]] = centroid;
+                unsigned char *pixel = clusterIn + (long)batch_pixels[sample] * 4;
+                double rate = 1.0 / ++minibatch_counts[centroid];
+                for (int channel = 0; channel < 4; channel++)
+                    minibatch_centroids[centroid * 4 + channel] += rate * (pixel[channel] - minibatch_centroids[centroid * 4 + channel]);
+            }
+            for (int i = 0; i < num_of_clusters * 4; i++)
+                centroids[i] = (int)(minibatch_centroids[i] + 0.5);
+            phaseEnd(inst, PHASE_UPDATE, phase_start, (long)batch_size * (4 + 2 * sizeof(int)));
+        } else {
+            if (algorithm == ALGORITHM_PRUNED)
+                computeCentroidDistances(centroids, num_of_clusters, centroid_distances);
+            if (numa)
+                updateNodeReplicas(layout, (void**)node_centroids, centroids, num_of_clusters * 4 * sizeof(int));
+
+            //step 1: go through all points and find closest centroid, in first iteration of frame of sequence only
+            //points of changed tiles
+            unsigned char *changed_tiles = iteration == 0 && reuse_indices ? frame_cache->changed_tiles : NULL;
+            phase_start = phaseStart(inst);
+            if (scheduler != NULL)
+                resetTileScheduler(scheduler, num_points, engine->tile_size, num_threads);
+            #pragma omp parallel reduction(+:reassigned_pixels, sse, evaluations)
+            {
+                int thread = omp_get_thread_num();
+                long *sums = thread_sums + thread * sums_stride;
+                int *thread_centroids = numa ? node_centroids[layout->thread_node[thread]] : centroids;
+                long thread_pixels = 0;
+                long thread_perf_start[NUM_PERF_EVENTS];
+                threadPerfStart(inst, thread, thread_perf_start);
+                double thread_start = omp_get_wtime();
+
+                // filtering deals subtrees dynamically, every one starts with all centroids as candidates
+                if (algorithm == ALGORITHM_FILTERING) {
+                    int *candidates = filter_candidates + thread * candidates_stride;
+                    for (int centroid = 0; centroid < num_of_clusters; centroid++)
+                        candidates[centroid] = centroid;
+                    #pragma omp for schedule(dynamic, 1) nowait
+                    for (int task = 0; task < filter_tree.num_tasks; task++) {
+                        int node = filter_tree.tasks[task];
+                        if (constant_alpha >= 0)
+                            filterNode<3>(&filter_tree, node, points, point_weights, point_indices, thread_centroids, candidates, num_of_clusters,
+                                          sums, &reassigned_pixels, &sse, &evaluations);
+                        else
+                            filterNode<4>(&filter_tree, node, points, point_weights, point_indices, thread_centroids, candidates, num_of_clusters,
+                                          sums, &reassigned_pixels, &sse, &evaluations);
+                        thread_pixels += filter_tree.nodes[node].end - filter_tree.nodes[node].start;
+                    }
+                }
+
+                // thread goes through its static part, or takes tiles from its deque and steals when it runs out
+                long range_start, range_end;
+                int has_range = 0;
+                if (algorithm != ALGORITHM_FILTERING)
+                    has_range = scheduler != NULL ? nextTile(scheduler, thread, &range_start, &range_end) : getStaticRange(num_points, &range_start, &range_end);
+                for (; has_range; has_range = scheduler != NULL && nextTile(scheduler, thread, &range_start, &range_end)) {
+                    if (changed_tiles != NULL && constant_alpha >= 0)
+                        assignChangedPoints<3>(points, point_indices, range_start, range_end, thread_centroids, num_of_clusters,
+                                               algorithm == ALGORITHM_PRUNED ? centroid_distances : NULL, sums, changed_tiles,
+                                               frame_cache->tile_size, &reassigned_pixels, &sse, &evaluations);
+                    else if (changed_tiles != NULL)
+                        assignChangedPoints<4>(points, point_indices, range_start, range_end, thread_centroids, num_of_clusters,
+                                               algorithm == ALGORITHM_PRUNED ? centroid_distances : NULL, sums, changed_tiles,
+                                               frame_cache->tile_size, &reassigned_pixels, &sse, &evaluations);
+                    else if (constant_alpha >= 0)
+                        assignPoints<3>(points, point_weights, point_indices, range_start, range_end, thread_centroids, num_of_clusters,
+                                        algorithm == ALGORITHM_PRUNED ? centroid_distances : NULL, sums, &reassigned_pixels, &sse, &evaluations);
+                    else
+                        assignPoints<4>(points, point_weights, point_indices, range_start, range_end, thread_centroids, num_of_clusters,
+                                        algorithm == ALGORITHM_PRUNED ? centroid_distances : NULL, sums, &reassigned_pixels, &sse, &evaluations);
+                    thread_pixels += range_end - range_start;
+                }
+
+                addThreadLoad(inst, thread, (omp_get_wtime() - thread_start) * 1000.0, thread_pixels);
+                threadPerfEnd(inst, PHASE_ASSIGN, thread, thread_perf_start);
+            }
+            phaseEnd(inst, PHASE_ASSIGN, phase_start, (long)num_points * (4 + 2 * sizeof(int)));
+            addDistanceEvaluations(inst, evaluations, num_points, num_of_clusters);
+
+            //step 2: add sums of all threads
+            phase_start = phaseStart(inst);
+            for (int thread = 0; thread < num_threads; thread++) {
+                long *sums = thread_sums + thread * sums_stride;
+                for (int i = 0; i < num_of_clusters * 5; i++) {
+                    centroids_sums[i] += sums[i];
+                    sums[i] = 0;
+                }
+            }
+            phaseEnd(inst, PHASE_REDUCE, phase_start, (long)num_threads * num_of_clusters * 5 * sizeof(long) * 2);
+
+            //step 3: for each centroid compute average which will be new centroid
+            phase_start = phaseStart(inst);
+            for(int centroid = 0; centroid < (num_of_clusters); centroid++){
+                applyNewCentroidValue(centroid, centroids, centroids_sums);
+                // alpha was not summed, it is same for all pixels
+                if (constant_alpha >= 0)
+                    centroids[centroid * 4 + 3] = constant_alpha;
+            }
+            phaseEnd(inst, PHASE_UPDATE, phase_start, (long)num_of_clusters * (5 * sizeof(long) + 4 * sizeof(int)));
         }
+        inst->reassigned_pixels[iteration] = reassigned_pixels;
+        inst->iteration_sse[iteration] = sse;
 
         // Stop measuring time
         clock_gettime(CLOCK_MONOTONIC, &clock_end);
         long nanosecs = ((((clock_end.tv_sec - clock_start.tv_sec)*1000*1000*1000) + clock_end.tv_nsec) - (clock_start.tv_nsec));
-        printf("%.4f\n", nanosecs/(1000.0*1000.0));
+        inst->iteration_time_ms[iteration] = nanosecs/(1000.0*1000.0);
+        if (quality != NULL)
+            printf("%.4f %.0f %.4f\n", nanosecs/(1000.0*1000.0), (double)sse, getPsnr(sse, inst->num_values));
+        else
+            printf("%.4f\n", nanosecs/(1000.0*1000.0));
+
+        // first iteration assigns all pixels (unless they kept centroids of previous frame), later ones only move those
+        // near borders of clusters
+        inst->iterations_done = iteration + 1;
+        if (engine->tolerance >= 0 && (iteration > 0 || reuse_indices) &&
+            reassigned_pixels <= engine->tolerance * (algorithm == ALGORITHM_MINIBATCH ? batch_size : num_pixels))
+            break;
+    }
+    if (engine->warm_start) {
+        memcpy(engine->warm_centroids, centroids, num_of_clusters * 4 * sizeof(int));
+        engine->warm_count = num_of_clusters;
+    }
+
+    //pixels get centroid of their colour, minibatch did not assign all pixels yet
+    phase_start = phaseStart(inst);
+    if (algorithm == ALGORITHM_HISTOGRAM || algorithm == ALGORITHM_FILTERING) {
+        #pragma omp parallel for schedule(static)
+        for (int point = 0; point < num_pixels; point++)
+            closest_centroid_indices[point] = point_indices[pixel_colours[point]];
+    } else if (algorithm == ALGORITHM_MINIBATCH) {
+        #pragma omp parallel for schedule(static)
+        for (int point = 0; point < num_pixels; point++) {
+            unsigned char *pixel = clusterIn + (long)point * 4;
+            closest_centroid_indices[point] = constant_alpha >= 0 ? findClosestCentroidSquared<3>(centroids, num_of_clusters, pixel)
+                                                                  : findClosestCentroidSquared<4>(centroids, num_of_clusters, pixel);
+        }
+        addDistanceEvaluations(inst, (long)num_pixels * num_of_clusters, num_pixels, num_of_clusters);
     }
 
     //apply new colours to input image
-    applyNewColoursToImage(imageIn, closest_centroid_indices, pitch*height, num_of_clusters, centroids);
+    int *output_colours = centroids;
+    if (colour_space != COLOUR_SPACE_BGRA) {
+        output_colours = (int*)arenaAlloc(arena, num_of_clusters * 4 * sizeof(int));
+        convertCentroidsToBgra(centroids, num_of_clusters, colour_space, output_colours);
+    }
+    if (engine->export_palette != NULL && writePalette(engine->export_palette, output_colours, num_of_clusters) != 0)
+        return 1;
+    //dithering picks among colours of centroids by itself, indices of clustering are kept for next frame of sequence
+    int *output_indices = closest_centroid_indices;
+    if (engine->dither != DITHER_NONE) {
+        Palette centroid_palette = {output_colours, num_of_clusters};
+        PaletteLookup centroid_lookup;
+        initPaletteLookup(&centroid_lookup, &centroid_palette);
+        preparePaletteLookup(&centroid_lookup, getConstantAlpha(imageIn, num_pixels));
+        output_indices = (int*)arenaAlloc(arena, (size_t)num_pixels * sizeof(int));
+        ditherImage(engine->dither, imageIn, width, height, pitch, &centroid_lookup, engine->dither_thresholds, engine->dither_size, output_indices);
+        freePaletteLookup(&centroid_lookup);
+    }
+    inst->output_sse = applyNewColoursToImage(imageIn, output_indices, width, height, pitch, output_colours, ssim ? &inst->output_ssim : NULL,
+                                              scheduler, NULL);
+    phaseEnd(inst, PHASE_REMAP, phase_start, (long)num_pixels * (4 + sizeof(int)));
+    if (scheduler != NULL)
+        inst->tile_steals = getTileSteals(scheduler);
+    if (frame_cache != NULL)
+        frame_cache->valid = 1;
 
     //printf("IMAGE: \n");
     //printImage(imageIn, width * height);
 
     // Save image
-	FIBITMAP *imageOutBitmap = FreeImage_ConvertFromRawBits(imageIn, width, height, pitch, 32, FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK, TRUE);
-	FreeImage_Save(FIF_PNG, imageOutBitmap, "output/test_openmp_second_v2.png", 0);
-	FreeImage_Unload(imageOutBitmap);
-}
\ No newline at end of file
+    return saveOutputImage(engine, imageIn, width, height, pitch, output_name);
+}
+
+int main(int argc, char *argv[]){
+    // Optional --report=<file> writes per-phase times and counters as JSON, --profile prints them to stderr,
+    // --perf adds hardware counters (cycles, instructions, cache misses, branch misses) of every phase and thread,
+    // --quality prints sum of squared errors and PSNR after time of every iteration and quality of output image,
+    // --quality=ssim also computes SSIM of output image
+    Engine engine;
+    memset(&engine, 0, sizeof(Engine));
+    const char *report_file = getOption(argc, argv, "report");
+    int profile = getOption(argc, argv, "profile") != NULL;
+    int perf = getOption(argc, argv, "perf") != NULL;
+    engine.quality = getOption(argc, argv, "quality");
+    engine.ssim = engine.quality != NULL && strcmp(engine.quality, "ssim") == 0;
+
+    // --algorithm=lloyd|pruned|histogram|minibatch|filtering|auto (default lloyd), --batch-size=<n> pixels per minibatch iteration,
+    // --threads=<n>|auto, auto picks what cost model (--cost-model=<file>, see kmeans_auto) predicts to be fastest
+    const char *arg = getOption(argc, argv, "algorithm");
+    engine.auto_algorithm = arg != NULL && strcmp(arg, "auto") == 0;
+    engine.algorithm = arg == NULL || engine.auto_algorithm ? ALGORITHM_LLOYD : parseAlgorithm(arg);
+    if (engine.algorithm < 0) {
+        fprintf(stderr, "Unknown algorithm %s, use lloyd, pruned, histogram, minibatch, filtering or auto.\n", arg);
+        exit(1);
+    }
+    arg = getOption(argc, argv, "batch-size");
+    engine.batch_size = arg != NULL && atoi(arg) > 0 ? atoi(arg) : DEFAULT_BATCH_SIZE;
+    arg = getOption(argc, argv, "threads");
+    engine.auto_threads = arg != NULL && strcmp(arg, "auto") == 0;
+    if (arg != NULL && !engine.auto_threads && atoi(arg) > 0)
+        omp_set_num_threads(atoi(arg));
+    engine.cost_model_file = getOption(argc, argv, "cost-model");
+    if (engine.cost_model_file == NULL || engine.cost_model_file[0] == '\0')
+        engine.cost_model_file = COST_MODEL_FILE;
+
+    // --numa places image and indices on nodes of threads which process them, keeps copy of centroids on every node
+    // and binds threads to cpus (spread over all allowed cpus) unless OMP_PROC_BIND already does it
+    engine.numa = getOption(argc, argv, "numa") != NULL;
+
+    // --huge-pages[=thp|hugetlb] backs arena with huge pages, --batch=<file> also clusters images listed in file (one per
+    // line) after first one, reusing arena; output of batch images is output/<name>_v2.<output format>
+    arg = getOption(argc, argv, "huge-pages");
+    int huge_pages = arg != NULL ? parseHugePages(arg) : HUGE_PAGES_NONE;
+    if (huge_pages < 0) {
+        fprintf(stderr, "Unknown huge pages mode %s, use none, thp or hugetlb.\n", arg);
+        exit(1);
+    }
+    initArena(&engine.arena, huge_pages);
+    initArena(&engine.placed_arena, huge_pages);
+    engine.placed_arena.release_pages = 1;
+    const char *batch_file = getOption(argc, argv, "batch");
+
+    // --schedule=steal splits assignment and remap to tiles (--tile-size=<n> points, default 4096) which idle threads
+    // steal from others, for uneven work of pruning and histogram; default static keeps fixed split of every loop
+    arg = getOption(argc, argv, "schedule");
+    if (arg != NULL && strcmp(arg, "static") != 0 && strcmp(arg, "steal") != 0) {
+        fprintf(stderr, "Unknown schedule %s, use static or steal.\n", arg);
+        exit(1);
+    }
+    int steal = arg != NULL && strcmp(arg, "steal") == 0;
+    TileScheduler scheduler;
+    arg = getOption(argc, argv, "tile-size");
+    engine.tile_size = arg != NULL && atol(arg) > 0 ? atol(arg) : DEFAULT_TILE_SIZE;
+
+    // png is read and written by all threads (zlib compression in independent bands), --png=freeimage uses FreeImage
+    // instead, --png-level=<0-9> sets compression level (default 6, same as FreeImage)
+    arg = getOption(argc, argv, "png");
+    engine.parallel_png = arg == NULL || strcmp(arg, "freeimage") != 0;
+    arg = getOption(argc, argv, "png-level");
+    engine.png_level = arg != NULL && atoi(arg) >= 0 && atoi(arg) <= 9 && arg[0] != '\0' ? atoi(arg) : PNG_DEFAULT_LEVEL;
+
+    //1st argument is image name (or name pattern of --sequence), number of clusters is 2nd argument and num of
+    //iterations 3rd argument
+    const char *input_name = getPositionalArg(argc, argv, 1);
+    const char *clusters_arg = getPositionalArg(argc, argv, 2);
+    const char *iterations_arg = getPositionalArg(argc, argv, 3);
+    if (iterations_arg == NULL) {
+        fprintf(stderr, "Usage: %s <image> <clusters> <iterations> [options]\n", argv[0]);
+        exit(1);
+    }
+    engine.num_of_clusters = atoi(clusters_arg);
+    engine.num_of_iterations = atoi(iterations_arg);
+    engine.active_clusters = engine.num_of_clusters;
+
+    // with automatic number of threads any number up to number of processors can be picked
+    engine.max_threads = engine.auto_threads && omp_get_num_procs() > omp_get_max_threads() ? omp_get_num_procs() : omp_get_max_threads();
+    initInstrumentation(&engine.inst, engine.num_of_iterations, engine.max_threads);
+    if (steal) {
+        if (initTileScheduler(&scheduler, engine.max_threads) != 0) {
+            fprintf(stderr, "Can not allocate tile scheduler.\n");
+            exit(1);
+        }
+        engine.scheduler = &scheduler;
+    }
+    if (perf)
+        enablePerfCounters(&engine.inst);
+
+    // --colour-space=oklab|lab clusters in perceptual colour space (default bgra), error and PSNR printed after every
+    // iteration are then measured in that space, those of output image are in sRGB as always
+    arg = getOption(argc, argv, "colour-space");
+    engine.colour_space = arg != NULL ? parseColourSpace(arg) : COLOUR_SPACE_BGRA;
+    if (engine.colour_space < 0) {
+        fprintf(stderr, "Unknown colour space %s, use bgra, oklab or lab.\n", arg);
+        exit(1);
+    }
+
+    // --hierarchical[=<target psnr>] starts from clusters made by splitting cluster with largest error in two until
+    // there are enough of them (few passes over image per level of splits, n log k overall), iterations then refine
+    // them; with target PSNR splitting stops once error of clusters is that low, so image gets smallest palette of that
+    // quality
+    arg = getOption(argc, argv, "hierarchical");
+    engine.hierarchical = arg != NULL;
+    engine.target_psnr = arg != NULL ? atof(arg) : 0;
+
+    // --dither=floyd-steinberg|ordered|blue-noise dithers remapped image (default none), in BGRA like palette
+    arg = getOption(argc, argv, "dither");
+    engine.dither = arg != NULL ? parseDitherMode(arg) : DITHER_NONE;
+    if (engine.dither < 0) {
+        fprintf(stderr, "Unknown dither mode %s, use none, floyd-steinberg, ordered or blue-noise.\n", arg);
+        exit(1);
+    }
+    engine.dither_thresholds = buildDitherMatrix(engine.dither, &engine.dither_size);
+
+    // --palette=<file> skips clustering and remaps images to nearest colours of fixed palette (hex RRGGBB[AA] per
+    // line, JSON or binary as written by --export-palette), compared in BGRA whatever colour space is given; number
+    // of clusters and iterations are then ignored
+    const char *palette_file = getOption(argc, argv, "palette");
+    Palette palette;
+    PaletteLookup palette_lookup;
+    if (palette_file != NULL) {
+        if (readPalette(palette_file, &palette) != 0)
+            exit(1);
+        initPaletteLookup(&palette_lookup, &palette);
+        engine.palette_lookup = &palette_lookup;
+    }
+
+    // --export-palette=<file> writes final centroids in sRGB (binary for .bin, JSON for .json, hex text otherwise, for
+    // batch it is palette of last image), --init-palette=<file> starts from colours of such file instead of pixels,
+    // --warm-start starts every batch image from centroids of previous one and --tolerance=<fraction> stops iterating
+    // once at most that fraction of pixels changed centroid, so similar images need one or two iterations
+    engine.export_palette = getOption(argc, argv, "export-palette");
+    engine.warm_start = getOption(argc, argv, "warm-start") != NULL;
+    arg = getOption(argc, argv, "tolerance");
+    engine.tolerance = arg != NULL ? atof(arg) : -1;
+    engine.warm_centroids = (int*)calloc(engine.num_of_clusters > 0 ? engine.num_of_clusters * 4 : 1, sizeof(int));
+    if (getOption(argc, argv, "init-palette") != NULL) {
+        // palette is in sRGB, it is converted to space of clustering like pixels are
+        Palette init_palette;
+        if (readPalette(getOption(argc, argv, "init-palette"), &init_palette) != 0)
+            exit(1);
+        engine.warm_count = init_palette.num_colours < engine.num_of_clusters ? init_palette.num_colours : engine.num_of_clusters;
+        unsigned char *colours = (unsigned char*)malloc(engine.warm_count * 4);
+        for (int i = 0; i < engine.warm_count * 4; i++)
+            colours[i] = init_palette.colours[i];
+        if (engine.colour_space != COLOUR_SPACE_BGRA)
+            convertToColourSpace(colours, colours, engine.warm_count, engine.colour_space);
+        for (int i = 0; i < engine.warm_count * 4; i++)
+            engine.warm_centroids[i] = colours[i];
+        free(colours);
+        freePalette(&init_palette);
+    }
+
+    // --output-format=<extension> (default png) writes output in other format, for example jpg, tif, pam, ppm or raw
+    const char *output_format = getOption(argc, argv, "output-format");
+    if (output_format == NULL || output_format[0] == '\0')
+        output_format = "png";
+
+    // --sequence[=<first frame>] takes 1st argument as printf pattern of numbered frames (for example
+    // frames/frame_%04d.png), frames from first one (default 1) until first missing one are clustered in order and
+    // each is written as soon as it is done; every frame starts from centroids of previous one, only its tiles which
+    // changed are assigned in first iteration and iterations stop at tolerance (default 0.001)
+    const char *sequence = getOption(argc, argv, "sequence");
+    FrameCache frame_cache;
+    memset(&frame_cache, 0, sizeof(FrameCache));
+    if (sequence != NULL && !isFramePattern(input_name)) {
+        fprintf(stderr, "Sequence %s must have exactly one %%d conversion (for example frames/frame_%%04d.png).\n", input_name);
+        exit(1);
+    }
+    if (sequence != NULL) {
+        engine.frame_cache = &frame_cache;
+        engine.warm_start = 1;
+        if (engine.tolerance < 0)
+            engine.tolerance = DEFAULT_SEQUENCE_TOLERANCE;
+    }
+
+    //1st argument is image name including format, which is detected from its content
+    char output_name[1200];
+    int failed = 0;
+    if (sequence != NULL) {
+        int num_frames = 0;
+        char frame_name[1024], previous_name[1024] = "";
+        for (int frame = sequence[0] != '\0' ? atoi(sequence) : 1; !failed; frame++) {
+            // sequence also ends when name is too long or does not change (number wider than int)
+            int length = snprintf(frame_name, sizeof(frame_name), input_name, frame);
+            if (length < 0 || length >= (int)sizeof(frame_name) || strcmp(frame_name, previous_name) == 0)
+                break;
+            if (access(frame_name, R_OK) != 0)
+                break;
+            strcpy(previous_name, frame_name);
+            getOutputName(frame_name, output_format, output_name, sizeof(output_name));
+            failed = clusterImage(&engine, frame_name, output_name);
+            num_frames++;
+        }
+        if (num_frames == 0) {
+            fprintf(stderr, "No frames found for %s.\n", input_name);
+            failed = 1;
+        }
+        printf("frames:%d\n", num_frames);
+    } else {
+        snprintf(output_name, sizeof(output_name), "output/test_openmp_second_v2.%s", output_format);
+        failed = clusterImage(&engine, input_name, output_name);
+    }
+
+    FILE *fp = batch_file != NULL ? fopen(batch_file, "r") : NULL;
+    if (batch_file != NULL && fp == NULL) {
+        fprintf(stderr, "Can not open batch file %s.\n", batch_file);
+        failed = 1;
+    }
+    char image_name[1024];
+    while (fp != NULL && !failed && fgets(image_name, sizeof(image_name), fp)) {
+        image_name[strcspn(image_name, "\r\n")] = '\0';
+        if (image_name[0] == '\0')
+            continue;
+        getOutputName(image_name, output_format, output_name, sizeof(output_name));
+        failed = clusterImage(&engine, image_name, output_name);
+    }
+    if (fp != NULL)
+        fclose(fp);
+    if (batch_file != NULL)
+        printf("arena mapped: %zu bytes\n", engine.arena.mapped + engine.placed_arena.mapped);
+
+    if (profile || perf)
+        printInstrumentationSummary(&engine.inst, stderr);
+    if (report_file != NULL)
+        writeInstrumentationReport(&engine.inst, report_file, input_name, engine.width, engine.height, engine.active_clusters);
+    if (engine.node_centroids != NULL) {
+        freeNodeReplicas(&engine.layout, (void**)engine.node_centroids);
+        freeNumaLayout(&engine.layout);
+    }
+    if (engine.scheduler != NULL)
+        freeTileScheduler(engine.scheduler);
+    if (engine.palette_lookup != NULL) {
+        freePaletteLookup(engine.palette_lookup);
+        freePalette(&palette);
+    }
+    free(engine.warm_centroids);
+    free(engine.dither_thresholds);
+    freeFrameCache(&frame_cache);
+    freeArena(&engine.arena);
+    freeArena(&engine.placed_arena);
+    freeInstrumentation(&engine.inst);
+    return failed;
+}
@@ -0,0 +1,586 @@
+// Parallel PNG reading and writing with zlib, for the ends of the pipeline which FreeImage does on one thread.
+// Writer splits image to bands of rows which threads filter and deflate independently (every band ends with full
+// flush, so compressed bands are simply concatenated, like in pigz) and lists where bands start in private kmBD chunk.
+// Reader inflates bands of such files in parallel; other files are inflated by one thread while the rest convert
+// rows which are already decoded to engine layout. Only 8 bit, not interlaced images are read, for others reader
+// returns NULL and image should be decoded with FreeImage.
+#ifndef PNG_IO_H
+#define PNG_IO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <omp.h>
+#include <zlib.h>
+#include "image_io.h"
+
+#define PNG_SIGNATURE "\x89PNG\r\n\x1a\n"
+#define PNG_DEFAULT_LEVEL 6
+// bands are at least this big (bytes of filtered rows), so compression does not suffer much from dictionary resets
+#define PNG_MIN_BAND_BYTES (256L * 1024)
+// rows converted at once while other thread is still inflating
+#define PNG_CONVERT_ROWS 32
+#define PNG_MAX_BANDS 4096
+
+enum PngFilter {
+    PNG_FILTER_NONE,
+    PNG_FILTER_SUB,
+    PNG_FILTER_UP,
+    PNG_FILTER_AVERAGE,
+    PNG_FILTER_PAETH,
+    NUM_PNG_FILTERS
+};
+
+typedef struct {
+    int width;
+    int height;
+    int colour_type;
+    // bytes per pixel and per row (without filter byte)
+    int channels;
+    long row_bytes;
+    // palette in engine layout, alpha from tRNS
+    unsigned char palette[256 * 4];
+    // zlib stream of all IDAT chunks
+    unsigned char *stream;
+    long stream_size;
+    // from kmBD chunk: first row and offset in stream of every band, 0 bands if file has no such chunk
+    int num_bands;
+    unsigned int *band_rows;
+    unsigned int *band_offsets;
+} PngInfo;
+
+static inline unsigned int readPngInt(const unsigned char *bytes){
+    return (unsigned int)bytes[0] << 24 | (unsigned int)bytes[1] << 16 | (unsigned int)bytes[2] << 8 | bytes[3];
+}
+
+static inline void storePngInt(unsigned char *bytes, unsigned int value){
+    bytes[0] = value >> 24;
+    bytes[1] = value >> 16;
+    bytes[2] = value >> 8;
+    bytes[3] = value;
+}
+
+static inline int isPngImage(const char *file_name){
+    //checks signature at start of file
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp)
+        return 0;
+    char signature[8];
+    size_t read = fread(signature, 1, 8, fp);
+    fclose(fp);
+    return read == 8 && memcmp(signature, PNG_SIGNATURE, 8) == 0;
+}
+
+static inline int paethPredictor(int left, int up, int up_left){
+    int p = left + up - up_left;
+    int pa = abs(p - left), pb = abs(p - up), pc = abs(p - up_left);
+    if (pa <= pb && pa <= pc)
+        return left;
+    return pb <= pc ? up : up_left;
+}
+
+static inline void filterPngRow(unsigned char *out, const unsigned char *row, const unsigned char *previous, int filter, long length, int bpp){
+    //previous is NULL for first row of band, filters then use zeros for row above like in first row of image, so up
+    //is same as none and paeth same as sub
+    if (previous == NULL && filter >= PNG_FILTER_UP) {
+        if (filter == PNG_FILTER_AVERAGE) {
+            for (long i = 0; i < length; i++)
+                out[i] = row[i] - (i >= bpp ? row[i - bpp] : 0) / 2;
+            return;
+        }
+        filter = filter == PNG_FILTER_UP ? PNG_FILTER_NONE : PNG_FILTER_SUB;
+    }
+    switch (filter) {
+    case PNG_FILTER_SUB:
+        for (long i = 0; i < length; i++)
+            out[i] = row[i] - (i >= bpp ? row[i - bpp] : 0);
+        break;
+    case PNG_FILTER_UP:
+        for (long i = 0; i < length; i++)
+            out[i] = row[i] - previous[i];
+        break;
+    case PNG_FILTER_AVERAGE:
+        for (long i = 0; i < length; i++)
+            out[i] = row[i] - ((i >= bpp ? row[i - bpp] : 0) + previous[i]) / 2;
+        break;
+    case PNG_FILTER_PAETH:
+        for (long i = 0; i < length; i++)
+            out[i] = row[i] - (i >= bpp ? paethPredictor(row[i - bpp], previous[i], previous[i - bpp]) : previous[i]);
+        break;
+    default:
+        memcpy(out, row, length);
+    }
+}
+
+static inline int unfilterPngRow(unsigned char *out, const unsigned char *in, const unsigned char *previous, int filter, long length, int bpp){
+    //inverse of filterPngRow, returns 1 if filter is not valid
+    if (filter >= NUM_PNG_FILTERS)
+        return 1;
+    if (previous == NULL && filter >= PNG_FILTER_UP) {
+        if (filter == PNG_FILTER_AVERAGE) {
+            for (long i = 0; i < length; i++)
+                out[i] = in[i] + (i >= bpp ? out[i - bpp] : 0) / 2;
+            return 0;
+        }
+        filter = filter == PNG_FILTER_UP ? PNG_FILTER_NONE : PNG_FILTER_SUB;
+    }
+    switch (filter) {
+    case PNG_FILTER_SUB:
+        for (long i = 0; i < length; i++)
+            out[i] = in[i] + (i >= bpp ? out[i - bpp] : 0);
+        break;
+    case PNG_FILTER_UP:
+        for (long i = 0; i < length; i++)
+            out[i] = in[i] + previous[i];
+        break;
+    case PNG_FILTER_AVERAGE:
+        for (long i = 0; i < length; i++)
+            out[i] = in[i] + ((i >= bpp ? out[i - bpp] : 0) + previous[i]) / 2;
+        break;
+    case PNG_FILTER_PAETH:
+        for (long i = 0; i < length; i++)
+            out[i] = in[i] + (i >= bpp ? paethPredictor(out[i - bpp], previous[i], previous[i - bpp]) : previous[i]);
+        break;
+    default:
+        memcpy(out, in, length);
+    }
+    return 0;
+}
+
+static inline long getFilterCost(const unsigned char *filtered, long length){
+    //sum of absolute values of filtered bytes as signed numbers, same heuristic as libpng uses to pick filter
+    long cost = 0;
+    for (long i = 0; i < length; i++)
+        cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+    return cost;
+}
+
+static inline int writePngChunk(FILE *fp, const char *type, const unsigned char *data, long length){
+    //returns 0 on success
+    unsigned char header[8];
+    storePngInt(header, length);
+    memcpy(header + 4, type, 4);
+    uLong crc = crc32(crc32(0, (const Bytef *)type, 4), data, length);
+    unsigned char footer[4];
+    storePngInt(footer, crc);
+    return fwrite(header, 1, 8, fp) != 8 || (length > 0 && fwrite(data, 1, length, fp) != (size_t)length) || fwrite(footer, 1, 4, fp) != 4;
+}
+
+static inline int writePngImage(const char *file_name, unsigned char *image, int width, int height, int pitch, int level){
+    //writes image in engine layout as RGBA png, compressed by all threads; returns 0 on success
+    long row_bytes = (long)width * 4;
+    long stride = row_bytes + 1;
+    int num_threads = omp_get_max_threads();
+    long band_rows = (height + num_threads - 1) / num_threads;
+    if (band_rows * stride < PNG_MIN_BAND_BYTES)
+        band_rows = (PNG_MIN_BAND_BYTES + stride - 1) / stride;
+    if ((height + band_rows - 1) / band_rows > PNG_MAX_BANDS)
+        band_rows = (height + PNG_MAX_BANDS - 1) / PNG_MAX_BANDS;
+    int num_bands = (height + band_rows - 1) / band_rows;
+
+    // compressed data of every band, with room for zlib header before first one and adler32 after last one
+    unsigned char **band_data = (unsigned char **)calloc(num_bands, sizeof(unsigned char *));
+    long *band_size = (long *)calloc(num_bands, sizeof(long));
+    uLong *band_adler = (uLong *)calloc(num_bands, sizeof(uLong));
+    long *band_filtered_size = (long *)calloc(num_bands, sizeof(long));
+    int failed = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+    for (int band = 0; band < num_bands; band++) {
+        int row_start = band * band_rows;
+        int row_end = row_start + band_rows < height ? row_start + band_rows : height;
+        long filtered_size = (row_end - row_start) * stride;
+        unsigned char *filtered = (unsigned char *)malloc(filtered_size);
+        // current and previous row in RGBA and filtered candidate
+        unsigned char *rows = (unsigned char *)malloc(3 * row_bytes);
+        if (filtered == NULL || rows == NULL) {
+            free(filtered);
+            free(rows);
+            failed = 1;
+            continue;
+        }
+        unsigned char *previous = rows, *current = rows + row_bytes, *candidate = rows + 2 * row_bytes;
+
+        for (int y = row_start; y < row_end; y++) {
+            unsigned char *pixel = image + (long)y * pitch;
+            for (long x = 0; x < row_bytes; x += 4) {
+                current[x] = pixel[x + 2];
+                current[x + 1] = pixel[x + 1];
+                current[x + 2] = pixel[x];
+                current[x + 3] = pixel[x + 3];
+            }
+            // first row of band can only use filters which do not need row above it, so bands are decoded independently
+            unsigned char *out = filtered + (y - row_start) * stride;
+            long best_cost = -1;
+            int num_filters = y == row_start ? PNG_FILTER_UP : NUM_PNG_FILTERS;
+            for (int filter = 0; filter < num_filters; filter++) {
+                filterPngRow(candidate, current, y == row_start ? NULL : previous, filter, row_bytes, 4);
+                long cost = getFilterCost(candidate, row_bytes);
+                if (best_cost < 0 || cost < best_cost) {
+                    best_cost = cost;
+                    out[0] = filter;
+                    memcpy(out + 1, candidate, row_bytes);
+                }
+            }
+            unsigned char *swap = previous;
+            previous = current;
+            current = swap;
+        }
+        band_adler[band] = adler32(adler32(0, NULL, 0), filtered, filtered_size);
+        band_filtered_size[band] = filtered_size;
+
+        //raw deflate, every band but last ends with full flush which byte aligns it and resets dictionary
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) {
+            free(filtered);
+            free(rows);
+            failed = 1;
+            continue;
+        }
+        long header = band == 0 ? 2 : 0;
+        long bound = deflateBound(&stream, filtered_size) + 64;
+        band_data[band] = (unsigned char *)malloc(header + bound + 4);
+        if (band_data[band] != NULL) {
+            stream.next_in = filtered;
+            stream.avail_in = filtered_size;
+            stream.next_out = band_data[band] + header;
+            stream.avail_out = bound;
+            int result = deflate(&stream, band == num_bands - 1 ? Z_FINISH : Z_FULL_FLUSH);
+            failed |= band == num_bands - 1 ? result != Z_STREAM_END : result != Z_OK || stream.avail_in != 0;
+            band_size[band] = header + bound - stream.avail_out;
+        } else {
+            failed = 1;
+        }
+        deflateEnd(&stream);
+        free(filtered);
+        free(rows);
+    }
+
+    FILE *fp = failed ? NULL : fopen(file_name, "wb");
+    if (!failed && fp == NULL)
+        fprintf(stderr, "Can not write %s.\n", file_name);
+    if (fp != NULL) {
+        // zlib header for compression level (check bits make it divisible by 31) and adler32 of all bands
+        band_data[0][0] = 0x78;
+        band_data[0][1] = level <= 1 ? 0x01 : level <= 5 ? 0x5e : level == 6 ? 0x9c : 0xda;
+        uLong adler = band_adler[0];
+        for (int band = 1; band < num_bands; band++)
+            adler = adler32_combine(adler, band_adler[band], band_filtered_size[band]);
+        storePngInt(band_data[num_bands - 1] + band_size[num_bands - 1], adler);
+        band_size[num_bands - 1] += 4;
+
+        unsigned char ihdr[13];
+        storePngInt(ihdr, width);
+        storePngInt(ihdr + 4, height);
+        ihdr[8] = 8;
+        ihdr[9] = 6;
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+        // kmBD: number of bands, then first row and offset in zlib stream of every band; it is private and not safe
+        // to copy, so editors which recompress image drop it
+        unsigned char *kmbd = (unsigned char *)malloc(4 + 8L * num_bands);
+        storePngInt(kmbd, num_bands);
+        long offset = 0;
+        for (int band = 0; band < num_bands; band++) {
+            storePngInt(kmbd + 4 + 8 * band, band * band_rows);
+            storePngInt(kmbd + 8 + 8 * band, offset + (band == 0 ? 2 : 0));
+            offset += band_size[band];
+        }
+
+        failed = fwrite(PNG_SIGNATURE, 1, 8, fp) != 8;
+        failed |= writePngChunk(fp, "IHDR", ihdr, 13);
+        failed |= writePngChunk(fp, "kmBD", kmbd, 4 + 8L * num_bands);
+        for (int band = 0; band < num_bands && !failed; band++)
+            failed |= writePngChunk(fp, "IDAT", band_data[band], band_size[band]);
+        failed |= writePngChunk(fp, "IEND", NULL, 0);
+        failed |= fclose(fp) != 0;
+        if (failed)
+            fprintf(stderr, "Can not write %s.\n", file_name);
+        free(kmbd);
+    } else {
+        failed = 1;
+    }
+
+    for (int band = 0; band < num_bands; band++)
+        free(band_data[band]);
+    free(band_data);
+    free(band_size);
+    free(band_adler);
+    free(band_filtered_size);
+    return failed;
+}
+
+static inline void freePngInfo(PngInfo *png){
+    free(png->stream);
+    free(png->band_rows);
+    free(png->band_offsets);
+    memset(png, 0, sizeof(PngInfo));
+}
+
+static inline int parsePng(const unsigned char *file, long file_size, PngInfo *png){
+    //reads chunks of png file to png, returns 0 if image can be decoded here
+    memset(png, 0, sizeof(PngInfo));
+    if (file_size < 8 || memcmp(file, PNG_SIGNATURE, 8) != 0)
+        return 1;
+    int has_header = 0, has_transparency = 0;
+    for (int i = 0; i < 256; i++)
+        png->palette[i * 4 + 3] = 255;
+
+    // first pass finds size of stream, second copies IDAT chunks to it
+    for (int pass = 0; pass < 2; pass++) {
+        long position = 8;
+        png->stream_size = 0;
+        while (position + 12 <= file_size) {
+            long length = readPngInt(file + position);
+            const unsigned char *type = file + position + 4;
+            const unsigned char *data = file + position + 8;
+            if (length < 0 || position + 12 + length > file_size)
+                return 1;
+            position += 12 + length;
+
+            if (memcmp(type, "IDAT", 4) == 0) {
+                if (pass == 1)
+                    memcpy(png->stream + png->stream_size, data, length);
+                png->stream_size += length;
+            } else if (memcmp(type, "IEND", 4) == 0) {
+                break;
+            } else if (pass == 1) {
+                continue;
+            } else if (memcmp(type, "IHDR", 4) == 0 && length == 13) {
+                // only critical chunks with pixel data are checked, as they are not verified by anything later
+                if (crc32(crc32(0, type, 4), data, length) != readPngInt(data + length))
+                    return 1;
+                png->width = readPngInt(data);
+                png->height = readPngInt(data + 4);
+                png->colour_type = data[9];
+                png->channels = data[9] == 0 ? 1 : data[9] == 2 ? 3 : data[9] == 3 ? 1 : data[9] == 4 ? 2 : data[9] == 6 ? 4 : 0;
+                if (data[8] != 8 || png->channels == 0 || data[12] != 0 || png->width <= 0 || png->height <= 0 ||
+                    png->width > 1 << 24 || png->height > 1 << 24)
+                    return 1;
+                png->row_bytes = (long)png->width * png->channels;
+                has_header = 1;
+            } else if (memcmp(type, "PLTE", 4) == 0 && length % 3 == 0 && length <= 256 * 3) {
+                if (crc32(crc32(0, type, 4), data, length) != readPngInt(data + length))
+                    return 1;
+                for (int i = 0; i < length / 3; i++) {
+                    png->palette[i * 4] = data[i * 3 + 2];
+                    png->palette[i * 4 + 1] = data[i * 3 + 1];
+                    png->palette[i * 4 + 2] = data[i * 3];
+                }
+            } else if (memcmp(type, "tRNS", 4) == 0) {
+                for (int i = 0; i < length && i < 256; i++)
+                    png->palette[i * 4 + 3] = data[i];
+                has_transparency = 1;
+            } else if (memcmp(type, "gAMA", 4) == 0 && length == 4) {
+                // FreeImage corrects gamma which is not that of screen, such images are left to it
+                if (readPngInt(data) != 45455)
+                    return 1;
+            } else if (memcmp(type, "kmBD", 4) == 0 && length >= 4 && png->num_bands == 0) {
+                int num_bands = readPngInt(data);
+                if (num_bands <= 0 || num_bands > PNG_MAX_BANDS || length != 4 + 8L * num_bands)
+                    continue;
+                png->band_rows = (unsigned int *)malloc(num_bands * sizeof(unsigned int));
+                png->band_offsets = (unsigned int *)malloc(num_bands * sizeof(unsigned int));
+                for (int band = 0; band < num_bands; band++) {
+                    png->band_rows[band] = readPngInt(data + 4 + 8 * band);
+                    png->band_offsets[band] = readPngInt(data + 8 + 8 * band);
+                }
+                png->num_bands = num_bands;
+            } else if (!(type[0] & 0x20)) {
+                // unknown critical chunk
+                return 1;
+            }
+        }
+        if (pass == 0) {
+            // key colour transparency of grey and RGB images is handled by FreeImage
+            if (!has_header || png->stream_size == 0 || (has_transparency && png->colour_type != 3))
+                return 1;
+            png->stream = (unsigned char *)malloc(png->stream_size);
+            if (png->stream == NULL)
+                return 1;
+        }
+    }
+
+    // bands must start with first row and first byte after zlib header and be in order
+    for (int band = 0; band < png->num_bands; band++) {
+        if ((band == 0 && (png->band_rows[0] != 0 || png->band_offsets[0] != 2)) ||
+            (band > 0 && (png->band_rows[band] <= png->band_rows[band - 1] || png->band_offsets[band] <= png->band_offsets[band - 1])) ||
+            png->band_rows[band] >= (unsigned int)png->height || png->band_offsets[band] >= png->stream_size - 4)
+            png->num_bands = 0;
+    }
+    return 0;
+}
+
+static inline void convertPngRow(PngInfo *png, const unsigned char *row, unsigned char *out){
+    //one unfiltered row to engine layout
+    for (int x = 0; x < png->width; x++) {
+        unsigned char *pixel = out + x * 4;
+        const unsigned char *value = row + (long)x * png->channels;
+        if (png->colour_type == 3) {
+            memcpy(pixel, png->palette + value[0] * 4, 4);
+        } else if (png->channels <= 2) {
+            pixel[0] = pixel[1] = pixel[2] = value[0];
+            pixel[3] = png->channels == 2 ? value[1] : 255;
+        } else {
+            pixel[0] = value[2];
+            pixel[1] = value[1];
+            pixel[2] = value[0];
+            pixel[3] = png->channels == 4 ? value[3] : 255;
+        }
+    }
+}
+
+static inline int inflatePngRows(PngInfo *png, z_stream *stream, int row_start, int row_end, unsigned char *filtered, unsigned char *raw,
+                                 uLong *adler, long *rows_ready){
+    //inflates and unfilters rows, first row of range uses row above it only when range starts image's stream;
+    //adler (if not NULL) gets checksum of filtered data and rows_ready (if not NULL) number of rows done; 0 on success
+    long stride = png->row_bytes + 1;
+    for (int y = row_start; y < row_end; y++) {
+        stream->next_out = filtered;
+        stream->avail_out = stride;
+        while (stream->avail_out > 0) {
+            int result = inflate(stream, Z_NO_FLUSH);
+            if (result != Z_OK && !(result == Z_STREAM_END && stream->avail_out == 0))
+                return 1;
+        }
+        if (adler != NULL)
+            *adler = adler32(*adler, filtered, stride);
+        const unsigned char *previous = y > 0 && (y > row_start || row_start == 0) ? raw + (long)(y - 1) * png->row_bytes : NULL;
+        if (y == row_start && row_start > 0 && filtered[0] >= PNG_FILTER_UP)
+            return 1;
+        if (unfilterPngRow(raw + (long)y * png->row_bytes, filtered + 1, previous, filtered[0], png->row_bytes, png->channels))
+            return 1;
+        if (rows_ready != NULL)
+            __atomic_store_n(rows_ready, y + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+static inline unsigned char *readPngImage(const char *file_name, int *width, int *height, int *pitch,
+                                          ImageAllocator allocate = NULL, void *context = NULL){
+    //returns image in engine layout, NULL if file can not be decoded here
+    long file_size = getFileSize(file_name);
+    FILE *fp = fopen(file_name, "rb");
+    if (fp == NULL || file_size <= 0) {
+        if (fp != NULL)
+            fclose(fp);
+        return NULL;
+    }
+    unsigned char *file = (unsigned char *)malloc(file_size);
+    int failed = file == NULL || fread(file, 1, file_size, fp) != (size_t)file_size;
+    fclose(fp);
+    PngInfo png;
+    failed = failed || parsePng(file, file_size, &png) != 0;
+    free(file);
+    if (failed) {
+        freePngInfo(&png);
+        return NULL;
+    }
+
+    *width = png.width;
+    *height = png.height;
+    *pitch = png.width * 4;
+    size_t size = (size_t)*pitch * *height;
+    unsigned char *image = (unsigned char *)(allocate != NULL ? allocate(context, size) : malloc(size));
+    unsigned char *raw = (unsigned char *)malloc((size_t)png.row_bytes * png.height);
+    if (image == NULL || raw == NULL) {
+        if (allocate == NULL)
+            free(image);
+        free(raw);
+        freePngInfo(&png);
+        return NULL;
+    }
+
+    if (png.num_bands > 0) {
+        //file written by writePngImage: every thread inflates, unfilters and converts whole bands
+        uLong *band_adler = (uLong *)malloc(png.num_bands * sizeof(uLong));
+        #pragma omp parallel for schedule(dynamic) reduction(|:failed)
+        for (int band = 0; band < png.num_bands; band++) {
+            int row_start = png.band_rows[band];
+            int row_end = band + 1 < png.num_bands ? png.band_rows[band + 1] : png.height;
+            long stream_end = band + 1 < png.num_bands ? png.band_offsets[band + 1] : png.stream_size - 4;
+            unsigned char *filtered = (unsigned char *)malloc(png.row_bytes + 1);
+            z_stream stream;
+            memset(&stream, 0, sizeof(stream));
+            if (filtered == NULL || inflateInit2(&stream, -15) != Z_OK) {
+                free(filtered);
+                failed = 1;
+                continue;
+            }
+            stream.next_in = png.stream + png.band_offsets[band];
+            stream.avail_in = stream_end - png.band_offsets[band];
+            band_adler[band] = adler32(0, NULL, 0);
+            failed |= inflatePngRows(&png, &stream, row_start, row_end, filtered, raw, &band_adler[band], NULL);
+            for (int y = row_start; y < row_end && !failed; y++)
+                convertPngRow(&png, raw + (long)y * png.row_bytes, image + (long)y * *pitch);
+            inflateEnd(&stream);
+            free(filtered);
+        }
+        if (!failed) {
+            uLong adler = band_adler[0];
+            for (int band = 1; band < png.num_bands; band++) {
+                int rows = (band + 1 < png.num_bands ? png.band_rows[band + 1] : png.height) - png.band_rows[band];
+                adler = adler32_combine(adler, band_adler[band], (long)rows * (png.row_bytes + 1));
+            }
+            failed = adler != readPngInt(png.stream + png.stream_size - 4);
+        }
+        free(band_adler);
+    } else {
+        //thread 0 inflates whole stream, other threads convert groups of rows as soon as they are decoded and
+        //thread 0 joins them when it is done
+        long rows_ready = 0;
+        long next_group = 0;
+        #pragma omp parallel reduction(|:failed)
+        {
+            if (omp_get_thread_num() == 0) {
+                unsigned char *filtered = (unsigned char *)malloc(png.row_bytes + 1);
+                z_stream stream;
+                memset(&stream, 0, sizeof(stream));
+                if (filtered != NULL && inflateInit(&stream) == Z_OK) {
+                    stream.next_in = png.stream;
+                    stream.avail_in = png.stream_size;
+                    failed |= inflatePngRows(&png, &stream, 0, png.height, filtered, raw, NULL, &rows_ready);
+                    // stream is inflated to its end too, so zlib checks adler32 of filtered data after last row
+                    int result = Z_OK;
+                    while (!failed && result == Z_OK) {
+                        stream.next_out = filtered;
+                        stream.avail_out = png.row_bytes + 1;
+                        result = inflate(&stream, Z_NO_FLUSH);
+                    }
+                    failed |= result != Z_STREAM_END;
+                    inflateEnd(&stream);
+                } else {
+                    failed = 1;
+                }
+                free(filtered);
+                // on failure waiting threads are released, what they convert is not used
+                __atomic_store_n(&rows_ready, png.height, __ATOMIC_RELEASE);
+            }
+            while (1) {
+                long group = __atomic_fetch_add(&next_group, 1, __ATOMIC_RELAXED);
+                long row_start = group * PNG_CONVERT_ROWS;
+                if (row_start >= png.height)
+                    break;
+                long row_end = row_start + PNG_CONVERT_ROWS < png.height ? row_start + PNG_CONVERT_ROWS : png.height;
+                while (__atomic_load_n(&rows_ready, __ATOMIC_ACQUIRE) < row_end)
+                    sched_yield();
+                for (long y = row_start; y < row_end; y++)
+                    convertPngRow(&png, raw + y * png.row_bytes, image + y * *pitch);
+            }
+        }
+    }
+
+    free(raw);
+    freePngInfo(&png);
+    if (failed) {
+        fprintf(stderr, "Can not decode png %s in parallel.\n", file_name);
+        if (allocate == NULL)
+            free(image);
+        return NULL;
+    }
+    return image;
+}
+
+#endif
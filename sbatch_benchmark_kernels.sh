@@ -0,0 +1,13 @@
+#!/bin/bash
+
+# Micro-benchmarks of single stages (assignment, accumulation, centroid update, remap) on synthetic images
+# Options: --clusters=2,4,... --sizes=400x200,... --layouts=noise,gradient,flat --filter=<part of name>
+# --warmup=<n> --reps=<n> --min-time=<ms per repetition> --json=<file>
+# Compare JSON of two builds stage by stage to find which one regressed
+
+#SBATCH --ntasks=1
+#SBATCH --cpus-per-task=1
+#SBATCH --reservation=fri
+#SBATCH --output=output/benchmark_kernels_output.txt
+
+srun ./benchmark_kernels --sizes=400x200,1600x900,4000x2667 --reps=10 --json=output/benchmark_kernels.json
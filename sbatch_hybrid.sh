@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Arg 1: input test image
+# Arg 2: number of clusters
+# Arg 3: number of iterations
+# Options: --ratio=<r> initial share of pixels for GPU (default 0.5), --fixed-ratio (no rebalancing), --local-size=<n>
+# Every iteration prints its time and GPU share used, the share is rebalanced by measured throughput of GPU and CPU threads
+# Device selection: --device-type=gpu|cpu|accelerator|default|all (default gpu), --device-name=<part of device name>, --list-devices
+# Without usable device all pixels go to OpenMP threads (--no-fallback exits with error), device failing mid-run hands its part to host
+
+#SBATCH --ntasks=1
+#SBATCH --cpus-per-task=64
+#SBATCH --reservation=fri
+#SBATCH --constraint=gpu
+#SBATCH --output=output/hybrid_output.txt
+
+export OMP_PLACES=cores
+export OMP_PROC_BIND=TRUE
+
+clusters=(2 4 8 16 32 64 128 256 512 1024)
+
+for c in ${clusters[@]}
+do
+    srun --export=ALL ./parallel_hybrid test_images/lake_4000_2667.png $c 10
+done
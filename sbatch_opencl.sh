@@ -3,7 +3,13 @@
 # Arg 1: input test image
 # Arg 2: number of clusters
 # Arg 3: number of iterations
-# Arg 4 (optional): version of parallel opencl implementation (defaults to latest)
+# Arg 4 (optional): version of parallel opencl implementation (defaults to auto)
+# Arg 5 (optional): local size (defaults to auto)
+# Auto picks fastest version/local size from opencl_tuning.txt, tuning and storing them first if device and clusters range are not there yet
+# Options: --retune (tune again even if stored), --tuning-file=<file>
+# --sync-interval=<n>: queue iterations back to back, host checks changed pixels every n iterations (0 = only at end) and stops on convergence
+# Device selection: --device-type=gpu|cpu|accelerator|default|all (default gpu), --device-name=<part of device name>, --list-devices
+# If no device is found or any OpenCL call fails, iterations run on OpenMP threads instead (--no-fallback exits with error)
 # Run without sbatch: srun -n1 --reservation=fri --constraint=gpu ./parallel_opencl test_images/lake_4000_2667.png 64 10
 
 #SBATCH --ntasks=1
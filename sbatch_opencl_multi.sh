@@ -0,0 +1,25 @@
+#!/bin/bash
+
+# Arg 1: input test image
+# Arg 2: number of clusters
+# Arg 3: number of iterations
+# Pixels are split between all selected devices proportionally to their compute units, partial sums are reduced on host
+# Options: --device-type=gpu|cpu|accelerator|default|all (default gpu), --device-name=<part of device name>, --max-devices=<n>,
+# --sub-devices=<n> (split every device to sub-devices of n compute units), --local-size=<n>, --list-devices, --no-fallback
+
+#SBATCH --ntasks=1
+#SBATCH --reservation=fri
+#SBATCH --constraint=gpu
+#SBATCH --gpus=2
+#SBATCH --output=output/opencl_multi_output.txt
+
+devices=(1 2)
+clusters=(2 4 8 16 32 64 128 256 512 1024)
+
+for d in ${devices[@]}
+do
+    for c in ${clusters[@]}
+    do
+        srun ./parallel_opencl_multi test_images/lake_4000_2667.png $c 10 --max-devices=$d
+    done
+done
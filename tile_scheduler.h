@@ -0,0 +1,129 @@
+// Work stealing scheduler of tiles (ranges of consecutive items) for parallel loops with uneven cost per item.
+// Every thread has its own deque of tiles, filled with its static share so it keeps its NUMA placement. Owner takes
+// tiles from front, thread whose deque is empty steals back half of another thread's remaining tiles.
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#define DEFAULT_TILE_SIZE 4096
+
+// Deque is range of tile indices [begin, end) packed in one word (begin in low, end in high 32 bits), so owner and
+// thieves take tiles with one compare and swap; deques are on separate cache lines
+typedef struct {
+    unsigned long long range;
+    long steals;
+    char padding[48];
+} TileDeque;
+
+typedef struct {
+    TileDeque *deques;
+    int max_threads;
+    int num_threads;
+    long num_items;
+    long tile_size;
+} TileScheduler;
+
+static inline unsigned long long packTileRange(unsigned int begin, unsigned int end){
+    return (unsigned long long)end << 32 | begin;
+}
+
+static inline int initTileScheduler(TileScheduler *scheduler, int max_threads){
+    //returns 0 on success
+    memset(scheduler, 0, sizeof(TileScheduler));
+    void *deques = NULL;
+    if (posix_memalign(&deques, 64, max_threads * sizeof(TileDeque)) != 0)
+        return 1;
+    memset(deques, 0, max_threads * sizeof(TileDeque));
+    scheduler->deques = (TileDeque *)deques;
+    scheduler->max_threads = max_threads;
+    scheduler->num_threads = max_threads;
+    return 0;
+}
+
+static inline void resetTileScheduler(TileScheduler *scheduler, long num_items, long tile_size, int num_threads){
+    //splits items to tiles and gives every thread of next parallel region (at most max_threads) equal consecutive part
+    //of them, called outside of parallel region
+    scheduler->num_threads = num_threads < scheduler->max_threads ? num_threads : scheduler->max_threads;
+    scheduler->num_items = num_items;
+    scheduler->tile_size = tile_size > 0 ? tile_size : DEFAULT_TILE_SIZE;
+    long num_tiles = (num_items + scheduler->tile_size - 1) / scheduler->tile_size;
+    for (int t = 0; t < scheduler->num_threads; t++)
+        scheduler->deques[t].range = packTileRange(t * num_tiles / scheduler->num_threads, (t + 1) * num_tiles / scheduler->num_threads);
+}
+
+static inline long getTileSteals(TileScheduler *scheduler){
+    long steals = 0;
+    for (int t = 0; t < scheduler->max_threads; t++)
+        steals += scheduler->deques[t].steals;
+    return steals;
+}
+
+static inline long popTile(TileDeque *deque){
+    //takes first tile of own deque, -1 if it is empty
+    unsigned long long range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+    while (1) {
+        unsigned int begin = (unsigned int)range, end = (unsigned int)(range >> 32);
+        if (begin >= end)
+            return -1;
+        if (__atomic_compare_exchange_n(&deque->range, &range, packTileRange(begin + 1, end), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return begin;
+    }
+}
+
+static inline long stealTiles(TileScheduler *scheduler, int thread){
+    //takes back half of tiles of first other thread which has any, returns first of them (rest go to own deque),
+    //-1 when all deques are empty; tiles are never added, so then all work is taken
+    for (int i = 1; i < scheduler->num_threads; i++) {
+        TileDeque *victim = &scheduler->deques[(thread + i) % scheduler->num_threads];
+        unsigned long long range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+        while (1) {
+            unsigned int begin = (unsigned int)range, end = (unsigned int)(range >> 32);
+            if (begin >= end)
+                break;
+            unsigned int taken = (end - begin + 1) / 2;
+            if (__atomic_compare_exchange_n(&victim->range, &range, packTileRange(begin, end - taken), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&scheduler->deques[thread].range, packTileRange(end - taken + 1, end), __ATOMIC_RELEASE);
+                scheduler->deques[thread].steals++;
+                return end - taken;
+            }
+        }
+    }
+    return -1;
+}
+
+static inline int nextTile(TileScheduler *scheduler, int thread, long *start, long *end){
+    //gives range of items of next tile for this thread, 0 when there is no work left
+    if (thread >= scheduler->num_threads)
+        return 0;
+    long tile = popTile(&scheduler->deques[thread]);
+    if (tile < 0)
+        tile = stealTiles(scheduler, thread);
+    if (tile < 0)
+        return 0;
+    *start = tile * scheduler->tile_size;
+    *end = *start + scheduler->tile_size < scheduler->num_items ? *start + scheduler->tile_size : scheduler->num_items;
+    return 1;
+}
+
+static inline int getStaticRange(long num_items, long *start, long *end){
+    //range of items this thread gets in schedule(static) loop without chunk size: equal blocks in thread order, first
+    //num_items % num_threads threads get one item more (split of libgomp and libomp); 0 if thread gets none
+    long num_threads = omp_get_num_threads();
+    long thread = omp_get_thread_num();
+    long block = num_items / num_threads;
+    long extra = num_items % num_threads;
+    *start = thread * block + (thread < extra ? thread : extra);
+    *end = *start + block + (thread < extra ? 1 : 0);
+    return *end > *start;
+}
+
+static inline void freeTileScheduler(TileScheduler *scheduler){
+    free(scheduler->deques);
+    memset(scheduler, 0, sizeof(TileScheduler));
+}
+
+#endif